@@ -0,0 +1,281 @@
+/***********************************************************************/
+/*                                                                     */
+/*   svm_hmm_lib.cpp                                                   */
+/*                                                                     */
+/*   Embeddable SVM-HMM tagger (libsvmhmm)                             */
+/*                                                                     */
+/***********************************************************************/
+
+#include <cstdio> //sprintf()
+#include <cstdlib> //free()
+#include <cstring> //memset()
+#include <pthread.h>
+#include "svm_struct/svm_struct_common.h"
+#include "svm_struct_api.h"
+#include "svm_hmm_lib.h"
+using namespace std;
+
+namespace svmhmm
+{
+
+namespace
+{
+pthread_mutex_t modelMutex = PTHREAD_MUTEX_INITIALIZER; //guards modelRead
+bool modelRead = false; //the API's globals hold the tags and feature maps of one model at a time
+pthread_mutex_t decoderMutex = PTHREAD_MUTEX_INITIALIZER; //see model::serialized and serializedMapping
+
+/*
+auxiliary to model(): pass an option to the API as svm_hmm_classify's command line would
+*/
+void setClassifyOption(const char* attribute, const string& value)
+{
+	parse_struct_parameters_classify(const_cast<char*>(attribute), const_cast<char*>(value.c_str()));
+}
+
+template <typename T>
+string toString(const char* format, T t)
+{
+	char buf[64];
+	sprintf(buf, format, t);
+	return buf;
+}
+
+class decoderLock
+{
+	public:
+
+		explicit decoderLock(bool on) : on(on) {if(on) pthread_mutex_lock(&decoderMutex);}
+		~decoderLock() {if(on) pthread_mutex_unlock(&decoderMutex);}
+
+	private:
+
+		const bool on;
+};
+
+/*
+auxiliary to the taggers: append the length tokens to mapped, with their features mapped as read_struct_examples() would
+(serializedMapping is the model's); input is scratch space
+*/
+void mapTokens(const tokenFeatures* tokens, size_t length, STRUCT_LEARN_PARM* sparm, bool serializedMapping,
+	vector<pair<long, double> >& input, vector<token>& mapped)
+{
+	mapped.reserve(mapped.size() + length);
+	for(size_t j = 0; j < length; j++)
+	{
+		input.clear();
+		for(size_t i = 0; i < tokens[j].numFeatures; i++)
+			if(tokens[j].features[i].id >= 1) //feature numbers start at 1
+				input.push_back(make_pair(tokens[j].features[i].id, tokens[j].features[i].value));
+		mapped.push_back(token()); //each with its own feature list
+		decoderLock lock(serializedMapping);
+		map_token_features(input, mapped.back().getFeatureMap(), sparm);
+	}
+}
+}
+
+struct model::state
+{
+	STRUCTMODEL sm;
+	STRUCT_LEARN_PARM sparm;
+};
+
+/************** class model ***********/
+
+model::model(const string& filename, const decoderOptions& options) : s(NULL), serialized(false), serializedMapping(false)
+{
+	pthread_mutex_lock(&modelMutex);
+	const bool first = !modelRead;
+	modelRead = true;
+	pthread_mutex_unlock(&modelMutex);
+	if(!first) throw error("'" + filename + "': another model is loaded in this process; the tagger can hold only one at a time");
+	try
+	{
+		load(filename, options);
+	}
+	catch(...)
+	{
+		release();
+		throw;
+	}
+}
+
+void model::load(const string& filename, const decoderOptions& options)
+{
+	if(options.decoder < 0 || options.decoder > 2) throw error("unknown decoder");
+
+	s = new state;
+	memset(&s->sparm, 0, sizeof(s->sparm));
+	struct_model_errors_throw(1);
+	try
+	{
+		s->sm = read_struct_model(const_cast<char*>(filename.c_str()), &s->sparm);
+	}
+	catch(const runtime_error& e)
+	{
+		struct_model_errors_throw(0);
+		svm_struct_classify_api_exit(); //drop whatever was read
+		delete s;
+		s = NULL;
+		throw error("'" + filename + "': " + e.what());
+	}
+	struct_model_errors_throw(0);
+	//as svm_struct_classify does
+	MODEL* svmModel = s->sm.svm_model;
+	if(svmModel->kernel_parm.kernel_type != LINEAR)
+	{
+		free_struct_model(s->sm);
+		svm_struct_classify_api_exit();
+		delete s;
+		s = NULL;
+		throw error("'" + filename + "': the model has a non-linear kernel; only linear models (including --x) can be used");
+	}
+	if(!svmModel->lin_weights)
+	{
+		add_weight_vector_to_linear_model(svmModel);
+		free(s->sm.w);
+		s->sm.w = svmModel->lin_weights;
+	}
+	if(s->sparm.transitionOrder == 2 && options.decoder != 0)
+	{
+		free_struct_model(s->sm);
+		svm_struct_classify_api_exit();
+		delete s;
+		s = NULL;
+		throw error("'" + filename + "': a second-order model (--t 2) can only be decoded with Viterbi");
+	}
+
+	setClassifyOption("--d", toString("%d", options.decoder));
+	setClassifyOption("--k", toString("%u", options.numClusters));
+	setClassifyOption("--m", toString("%.17g", options.pruneMargin));
+	//Viterbi on a first-order model keeps nothing between sentences; the other decoders cache bounds and count lattice cells
+	serialized = (options.decoder != 0 || s->sparm.transitionOrder == 2);
+	serializedMapping = (s->sparm.tokenFeatureMap == 2); //the Nystroem map counts svm-light's kernel evaluations
+}
+
+model::~model()
+{
+	free_struct_model(s->sm);
+	svm_struct_classify_api_exit();
+	delete s;
+	release();
+}
+
+void model::release()
+{
+	pthread_mutex_lock(&modelMutex);
+	modelRead = false;
+	pthread_mutex_unlock(&modelMutex);
+}
+
+unsigned int model::getNumTags() const
+{
+	return ::getNumTags();
+}
+
+const string& model::getTagName(unsigned int id) const
+{
+	if(id >= ::getNumTags()) throw error("no tag with this id");
+	return getTagByID(id);
+}
+
+unsigned int model::getTagID(const string& name) const
+{
+	const tagID id = registerTag(name); //the registry is read-only once the model is read
+	if(id >= ::getNumTags()) throw error("unknown tag '" + name + "'");
+	return id;
+}
+
+long model::getFeatureSpaceSize() const
+{
+	return s->sparm.featureSpaceSize;
+}
+
+/************* class tagger ***********/
+
+tagger::tagger(boost::shared_ptr<const model> m) : m(m)
+{
+	if(m.get() == NULL) throw error("tagger: no model");
+}
+
+double tagger::tag(const tokenFeatures* tokens, size_t length, unsigned int* tags)
+{
+	if(length == 0) return 0;
+	model::state& s = *m->s;
+	shared_ptr<vector<token> > emissions(new vector<token>());
+	mapTokens(tokens, length, &s.sparm, m->serializedMapping, input, *emissions);
+	PATTERN x;
+	x.setEmissionsVector(emissions);
+
+	LABEL y;
+	{
+		decoderLock lock(m->serialized);
+		y = classify_struct_example(x, &s.sm, &s.sparm);
+	}
+	if(y.getLength() != length) throw error("tagger: no tagging found");
+	for(size_t j = 0; j < length; j++) tags[j] = y.getTag(j);
+
+	double score = 0;
+	SVECTOR* fy = psi(x, y, &s.sm, &s.sparm);
+	for(SVECTOR* f = fy; f != NULL; f = f->next) score += f->factor * sprod_ns(s.sm.w, f);
+	free_svector(fy);
+	return score;
+}
+
+void tagger::tagBatch(const tokenFeatures* tokens, const size_t* lengths, size_t numSequences, unsigned int* tags)
+{
+	for(size_t i = 0; i < numSequences; i++)
+	{
+		tag(tokens, lengths[i], tags);
+		tokens += lengths[i];
+		tags += lengths[i];
+	}
+}
+
+/******* class incrementalTagger ******/
+
+struct incrementalTagger::state
+{
+	state(model::state& s) : t(&s.sm, &s.sparm) {}
+
+	::incrementalTagger t;
+};
+
+incrementalTagger::incrementalTagger(boost::shared_ptr<const model> m) : m(m), s(NULL)
+{
+	if(m.get() == NULL) throw error("incrementalTagger: no model");
+	if(m->s->sparm.transitionOrder == 2) throw error("incrementalTagger: second-order models (--t 2) aren't supported");
+	s = new state(*m->s);
+}
+
+incrementalTagger::~incrementalTagger()
+{
+	delete s;
+}
+
+void incrementalTagger::tag(const tokenFeatures* tokens, size_t length, unsigned int* tags)
+{
+	retag(0, getLength(), tokens, length, tags);
+}
+
+void incrementalTagger::retag(size_t start, size_t numRemoved, const tokenFeatures* inserted, size_t numInserted, unsigned int* tags)
+{
+	if(start > getLength() || numRemoved > getLength() - start)
+		throw error("incrementalTagger: can't remove tokens " + toString("%lu", (unsigned long)start) + ".." + toString("%lu", (unsigned long)(start + numRemoved))
+			+ " of " + toString("%lu", (unsigned long)getLength()));
+	vector<token> mapped;
+	mapTokens(inserted, numInserted, &m->s->sparm, m->serializedMapping, input, mapped);
+	const LABEL y = s->t.retag(start, numRemoved, mapped);
+	for(size_t j = 0; j < y.getLength(); j++) tags[j] = y.getTag(j);
+}
+
+size_t incrementalTagger::getLength() const
+{
+	return s->t.getLength();
+}
+
+size_t incrementalTagger::getNumRecomputed() const
+{
+	return s->t.getNumRecomputed();
+}
+
+}
@@ -0,0 +1,196 @@
+/***********************************************************************/
+/*                                                                     */
+/*   svm_hmm_lib.h                                                     */
+/*                                                                     */
+/*   Embeddable SVM-HMM tagger (libsvmhmm)                             */
+/*                                                                     */
+/***********************************************************************/
+
+/*
+tagging with an SVM-HMM model inside another program
+
+the model is read and the tokens are decoded by the same code as svm_hmm_classify's (read_struct_model() and
+classify_struct_example()), so every model svm_hmm_classify can use with a linear kernel works here, including models
+trained with --f, --x and --t 2, and the pruning decoders can be chosen as with --d, --k and --m; errors in the model
+are reported by throwing svmhmm::error instead of exiting
+
+that code keeps the tags and feature maps of the model in globals, so a process can hold one model at a time (another
+can be read, eg a retrained one, once the last pointer to the first is gone); it is read once and never changes, so it
+can be shared by any number of threads, each tagging with its own tagger (the pruning decoders, second-order models and
+Nystroem token maps keep statistics, so with those the threads take turns); destroy it before main() returns, since it
+frees the API's globals
+
+	boost::shared_ptr<const svmhmm::model> m(new svmhmm::model("pos.model"));
+	svmhmm::tagger t(m); //one per thread
+	t.tag(tokens, numTokens, tags); //tags[i] is a tag id; m->getTagName(tags[i]) is the tag
+
+a document that is edited in place (eg in an annotation tool) can be re-tagged after each edit with an incrementalTagger,
+which keeps its decoding state between calls
+
+	svmhmm::incrementalTagger d(m); //one per document
+	d.tag(tokens, numTokens, tags);
+	d.retag(start, numRemoved, inserted, numInserted, tags); //tags of the whole edited document
+
+a token is given by its features, as in the input files: (feature number, value) pairs in increasing feature number order
+*/
+
+#ifndef svm_hmm_lib
+#define svm_hmm_lib
+
+#include <cstddef> //size_t
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <boost/shared_ptr.hpp>
+
+namespace svmhmm
+{
+
+class error : public std::runtime_error
+{
+	public:
+
+		explicit error(const std::string& what) : std::runtime_error(what) {}
+};
+
+struct feature
+{
+	long id; //as in the input files; starts at 1
+	double value;
+};
+
+/*
+the features of one token: a span of numFeatures features starting at features
+*/
+struct tokenFeatures
+{
+	const feature* features;
+	size_t numFeatures;
+};
+
+/*
+svm_hmm_classify's decoding options
+*/
+struct decoderOptions
+{
+	decoderOptions() : decoder(0), numClusters(0), pruneMargin(0) {}
+
+	int decoder; //--d: 0 = Viterbi, 1 = coarse-to-fine, 2 = A*; second-order models need 0
+	unsigned int numClusters; //--k: tag clusters of the coarse pass; 0 means about sqrt(number of tags)
+	double pruneMargin; //--m: 0 is lossless, larger values prune more
+};
+
+/*
+a model as written by svm_hmm_learn; immutable once read
+*/
+class model
+{
+	public:
+
+		/*
+		throw error if the model can't be read, has a non-linear kernel or the options don't fit it, or if another
+		model is loaded in this process
+		*/
+		explicit model(const std::string& filename, const decoderOptions& options = decoderOptions());
+		~model();
+
+		unsigned int getNumTags() const;
+		const std::string& getTagName(unsigned int id) const;
+		unsigned int getTagID(const std::string& name) const;
+		/*
+		the number of features of a token the model has weights for (after the --f cutoff or the --x map)
+		*/
+		long getFeatureSpaceSize() const;
+
+	private:
+
+		friend class tagger;
+		friend class incrementalTagger;
+
+		void load(const std::string& filename, const decoderOptions& options); //auxiliary to the constructor
+		static void release(); //let the next model be read
+
+		struct state; //the structural model and its parameters
+		state* s;
+		bool serialized; //the decoder keeps caches and statistics that can't be shared between threads
+		bool serializedMapping; //so does the token feature map
+
+		model(const model&);
+		const model& operator = (const model&);
+};
+
+/*
+decoding with a shared model; not safe to use from more than one thread at a time
+*/
+class tagger
+{
+	public:
+
+		explicit tagger(boost::shared_ptr<const model> m);
+
+		/*
+		write the best tag id for each of the length tokens to tags; return the score of the tagging (0 for an empty sequence)
+		*/
+		double tag(const tokenFeatures* tokens, size_t length, unsigned int* tags);
+		/*
+		tag numSequences sequences stored one after another in tokens, with lengths[i] tokens in sequence i;
+		the tags are written one after another as well
+		*/
+		void tagBatch(const tokenFeatures* tokens, const size_t* lengths, size_t numSequences, unsigned int* tags);
+
+		const model& getModel() const {return *m;}
+
+	private:
+
+		boost::shared_ptr<const model> m;
+		std::vector<std::pair<long, double> > input; //a token's features, as the classification API takes them
+};
+
+/*
+Viterbi tagging of one token sequence that is edited in place: the forward and backward scores of every position are
+kept, and after an edit only the positions whose scores the edit changes are recomputed, so the time taken is
+proportional to the size of the edit and how far its effect reaches, not to the length of the sequence
+
+the tags are exact (as with decoder 0, whatever the model's options); throw error for a second-order model; not safe
+to use from more than one thread at a time
+*/
+class incrementalTagger
+{
+	public:
+
+		explicit incrementalTagger(boost::shared_ptr<const model> m);
+		~incrementalTagger();
+
+		/*
+		start over with a sequence of length tokens; write the best tag id for each to tags
+		*/
+		void tag(const tokenFeatures* tokens, size_t length, unsigned int* tags);
+		/*
+		replace the numRemoved tokens starting at index start by the numInserted tokens at inserted; write the best tag id
+		for each token of the edited sequence (getLength() of them) to tags
+		*/
+		void retag(size_t start, size_t numRemoved, const tokenFeatures* inserted, size_t numInserted, unsigned int* tags);
+
+		size_t getLength() const;
+		/*
+		the number of forward and backward score vectors the last call computed (2 per token when tagging from scratch)
+		*/
+		size_t getNumRecomputed() const;
+
+		const model& getModel() const {return *m;}
+
+	private:
+
+		boost::shared_ptr<const model> m;
+		struct state; //the decoder's cached scores
+		state* s;
+		std::vector<std::pair<long, double> > input;
+
+		incrementalTagger(const incrementalTagger&);
+		const incrementalTagger& operator = (const incrementalTagger&);
+};
+
+}
+
+#endif //svm_hmm_lib
@@ -0,0 +1,358 @@
+/***********************************************************************/
+/*                                                                     */
+/*   svm_hmm_serve.cpp                                                 */
+/*                                                                     */
+/*   Long-running SVM-HMM tagger with online updates from corrections  */
+/*                                                                     */
+/***********************************************************************/
+
+/*
+reads blocks of sentences in the svm_hmm input format from stdin, each block ended by an empty line (qids start at 1
+in each block; the tags are ignored), and writes one predicted label per sentence to stdout
+
+with a corrections file (--u; typically a fifo), a second thread reads labeled sentences from it as they arrive and applies
+a passive-aggressive (PA-I) update to w for each: ybar is the loss-augmented Viterbi labeling, and w moves along
+psi(x, y) - psi(x, ybar) by the smallest step that gives a margin of loss(y, ybar), capped at --c (this is also
+single-constraint MIRA)
+
+the updater works on its own copy of w and publishes a new copy after each block, RCU style: the tagger picks up the
+current copy for each sentence and keeps it alive for as long as it uses it, so tagging never waits for an update (the
+decoders' bounds are recomputed when it picks up a new copy); the updated model is written with write_struct_model()
+every --p updates and at the end of the input, when the updater is stopped (a block it hasn't read to its empty line
+yet is dropped)
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <streambuf>
+#include <string>
+using namespace std;
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h> //usleep()
+#include <boost/shared_ptr.hpp> //atomic_load(), atomic_store()
+#include "svm_struct/svm_struct_common.h"
+#include "svm_struct_api.h"
+
+namespace
+{
+/*
+options
+*/
+string modelFile;
+string correctionsFile; //--u; no updates if empty
+string persistFile; //--o; default MODEL_BASE_online.model
+unsigned long persistInterval = 100; //--p
+double aggressiveness = 1; //--c; 0 means no cap (PA)
+
+STRUCTMODEL servedModel;
+STRUCT_LEARN_PARM sparm;
+
+/*
+a published weight vector; freed when the last tagger using it lets go
+*/
+struct weightSnapshot
+{
+	weightSnapshot(const double* weights, long sizePsi, unsigned long version)
+		: w((double*)my_malloc((sizePsi + 1) * sizeof(double))), version(version)
+	{
+		memcpy(w, weights, (sizePsi + 1) * sizeof(double));
+	}
+	~weightSnapshot() {free(w);}
+
+	double* w;
+	unsigned long version; //the number of updates it includes
+
+	private:
+
+		weightSnapshot(const weightSnapshot&);
+		const weightSnapshot& operator = (const weightSnapshot&);
+};
+shared_ptr<weightSnapshot> publishedWeights;
+
+/*
+updater state, guarded by updateMutex
+*/
+pthread_mutex_t updateMutex = PTHREAD_MUTEX_INITIALIZER;
+double* workingWeights = NULL;
+unsigned long numUpdates = 0, numPersisted = 0;
+bool stopUpdater = false; //set by main() at the end of the input
+
+bool updater_stopping()
+{
+	pthread_mutex_lock(&updateMutex);
+	const bool stopping = stopUpdater;
+	pthread_mutex_unlock(&updateMutex);
+	return stopping;
+}
+
+/*
+the corrections file as a stream that waits at its end for more to be written (a fifo without a writer reads as ended
+too) and ends only when the updater is stopped
+*/
+class followingStreambuf : public streambuf
+{
+	public:
+
+		followingStreambuf(int fd) : fd(fd) {}
+
+	protected:
+
+		virtual int_type underflow();
+
+	private:
+
+		int fd;
+		char buffer[1 << 16];
+};
+
+followingStreambuf::int_type followingStreambuf::underflow()
+{
+	while(!updater_stopping())
+	{
+		pollfd p = {fd, POLLIN, 0};
+		if(poll(&p, 1, 250) <= 0) continue; //nothing yet; check for the stop every 250 ms
+		const ssize_t n = read(fd, buffer, sizeof(buffer));
+		if(n > 0)
+		{
+			setg(buffer, buffer, buffer + n);
+			return traits_type::to_int_type(buffer[0]);
+		}
+		if(n < 0 && errno != EAGAIN && errno != EINTR)
+		{
+			perror("reading the corrections");
+			break;
+		}
+		usleep(250000); //at the end
+	}
+	return traits_type::eof();
+}
+}
+
+void read_input_parameters(int argc, char* argv[]);
+void print_help();
+
+/*
+write the updater's weights to persistFile; call with updateMutex held while the updater runs
+*/
+void persist_model()
+{
+	if(numUpdates == numPersisted) return;
+	STRUCTMODEL sm = servedModel;
+	sm.w = workingWeights;
+	write_struct_model(const_cast<char*>(persistFile.c_str()), &sm, &sparm);
+	numPersisted = numUpdates;
+	if(verbosity >= 1) fprintf(stderr, "wrote the model after %lu updates to '%s'\n", numUpdates, persistFile.c_str());
+}
+
+/*
+one passive-aggressive step on w toward labeling x as y; return the loss of the loss-augmented labeling
+*/
+double pa_update(double* w, PATTERN x, LABEL y)
+{
+	STRUCTMODEL sm = servedModel;
+	sm.w = w;
+	LABEL ybar = find_most_violated_constraint_marginrescaling(x, y, &sm, &sparm);
+	const double l = loss(y, ybar, &sparm);
+	if(l > 0)
+	{
+		SVECTOR* fy = psi(x, y, &sm, &sparm);
+		SVECTOR* fybar = psi(x, ybar, &sm, &sparm);
+		SVECTOR* delta = sub_ss(fy, fybar);
+		const double violation = l - sprod_ns(w, delta), sqrNorm = sprod_ss(delta, delta);
+		if(violation > 0 && sqrNorm > 0)
+		{
+			double tau = violation / sqrNorm;
+			if(aggressiveness > 0 && tau > aggressiveness) tau = aggressiveness;
+			add_vector_ns(w, delta, tau);
+		}
+		free_svector(fy);
+		free_svector(fybar);
+		free_svector(delta);
+	}
+	free_label(ybar);
+	return l;
+}
+
+/*
+updater thread: follow the corrections file, and update and publish w after each block read
+*/
+void* apply_corrections(void*)
+{
+	const int fd = open(correctionsFile.c_str(), O_RDONLY | O_NONBLOCK); //don't wait for a fifo to get a writer
+	if(fd < 0)
+	{
+		fprintf(stderr, "can't open '%s' for reading; exiting\n", correctionsFile.c_str());
+		exit(-1);
+	}
+	followingStreambuf buf(fd);
+	istream infile(&buf);
+	while(true)
+	{
+		SAMPLE sample = read_struct_examples(infile, correctionsFile.c_str(), &sparm);
+		if(infile.eof()) //stopped
+		{
+			free_struct_sample(sample);
+			break;
+		}
+		if(sample.n == 0)
+		{
+			free_struct_sample(sample);
+			continue;
+		}
+		pthread_mutex_lock(&updateMutex);
+		double totalLoss = 0;
+		long numApplied = 0;
+		for(long i = 0; i < sample.n; i++)
+		{
+			const LABEL& y = sample.examples[i].y;
+			bool knownTags = true;
+			for(unsigned int j = 0; j < y.getLength(); j++)
+				if(y.getTag(j) >= getNumTags()) knownTags = false;
+			if(!knownTags || y.getLength() != sample.examples[i].x.getLength())
+			{
+				fprintf(stderr, "skipping correction %ld: it has tags the model doesn't know\n", i + 1);
+				continue;
+			}
+			totalLoss += pa_update(workingWeights, sample.examples[i].x, y);
+			numApplied++;
+			numUpdates++;
+		}
+		atomic_store(&publishedWeights, shared_ptr<weightSnapshot>(new weightSnapshot(workingWeights, servedModel.sizePsi, numUpdates)));
+		if(verbosity >= 1) fprintf(stderr, "applied %ld corrections (average loss before the update %.4f); %lu updates in total\n",
+			numApplied, (numApplied > 0) ? totalLoss / numApplied : 0.0, numUpdates);
+		if(numUpdates - numPersisted >= persistInterval) persist_model();
+		pthread_mutex_unlock(&updateMutex);
+		free_struct_sample(sample);
+	}
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+	svm_struct_classify_api_init(argc, argv);
+	read_input_parameters(argc, argv);
+
+	const long serveVerbosity = verbosity;
+	verbosity = 0; //stdout is for the labels only
+	servedModel = read_struct_model(const_cast<char*>(modelFile.c_str()), &sparm);
+	verbosity = serveVerbosity;
+	if(servedModel.svm_model->kernel_parm.kernel_type != LINEAR)
+	{
+		fprintf(stderr, "svm_hmm_serve needs a model with a linear kernel; exiting\n");
+		exit(-1);
+	}
+	sparm.writeSvmModel = 0; //the updated w is all the model there is
+	publishedWeights = shared_ptr<weightSnapshot>(new weightSnapshot(servedModel.w, servedModel.sizePsi, 0));
+
+	pthread_t updater;
+	if(!correctionsFile.empty())
+	{
+		workingWeights = (double*)my_malloc((servedModel.sizePsi + 1) * sizeof(double));
+		memcpy(workingWeights, servedModel.w, (servedModel.sizePsi + 1) * sizeof(double));
+		if(pthread_create(&updater, NULL, apply_corrections, NULL) != 0)
+		{
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	unsigned long decodedVersion = 0; //of the weights the decoders' cached bounds come from
+	while(true)
+	{
+		SAMPLE sample = read_struct_examples(cin, "stdin", &sparm);
+		if(sample.n == 0 && cin.eof()) break;
+		for(long i = 0; i < sample.n; i++)
+		{
+			shared_ptr<weightSnapshot> weights = atomic_load(&publishedWeights);
+			if(weights->version != decodedVersion)
+			{
+				invalidate_decoder_caches();
+				decodedVersion = weights->version;
+			}
+			STRUCTMODEL sm = servedModel;
+			sm.w = weights->w;
+			LABEL y = classify_struct_example(sample.examples[i].x, &sm, &sparm);
+			write_label(stdout, y);
+			printf("\n");
+			free_label(y);
+		}
+		fflush(stdout);
+		free_struct_sample(sample);
+	}
+
+	//stop the updater (it may be waiting for input), and write what it has
+	if(!correctionsFile.empty())
+	{
+		pthread_mutex_lock(&updateMutex);
+		stopUpdater = true;
+		pthread_mutex_unlock(&updateMutex);
+		pthread_join(updater, NULL);
+		persist_model();
+		free(workingWeights);
+	}
+	publishedWeights.reset();
+	free_struct_model(servedModel);
+	svm_struct_classify_api_exit();
+	return(0);
+}
+
+void read_input_parameters(int argc, char* argv[])
+{
+	verbosity = 1;
+	int i;
+	for(i = 1; (i < argc) && ((argv[i])[0] == '-'); i++)
+	{
+		switch((argv[i])[1])
+		{
+			case 'h': print_help(); exit(0);
+			case 'v': i++; verbosity = atol(argv[i]); break;
+			case '-':
+				switch((argv[i])[2])
+				{
+					case 'u': i++; correctionsFile = argv[i]; break;
+					case 'o': i++; persistFile = argv[i]; break;
+					case 'p': i++; persistInterval = atol(argv[i]); break;
+					case 'c': i++; aggressiveness = atof(argv[i]); break;
+					case 'd': case 'k': case 'm': parse_struct_parameters_classify(argv[i], argv[i + 1]); i++; break;
+					default: printf("\nUnrecognized option %s!\n\n", argv[i]); print_help(); exit(0);
+				}
+				break;
+			default: printf("\nUnrecognized option %s!\n\n", argv[i]); print_help(); exit(0);
+		}
+	}
+	if(i >= argc)
+	{
+		printf("\nNot enough input parameters!\n\n");
+		print_help();
+		exit(0);
+	}
+	modelFile = argv[i];
+	if(persistFile.empty()) persistFile = modelFile.substr(0, modelFile.rfind('.')) + "_online.model";
+	if(persistInterval == 0) persistInterval = 1;
+}
+
+void print_help()
+{
+	printf("\nSVM-HMM tagging server: %s, %s, %s\n", INST_NAME, INST_VERSION, INST_VERSION_DATE);
+	printf("   usage: svm_hmm_serve [options] model_file < sentences > labels\n\n");
+	printf("   Tags blocks of sentences read from stdin, each ended by an empty line,\n");
+	printf("   and writes a label per sentence to stdout.\n\n");
+	printf("options: -h         -> this help\n");
+	printf("         -v [0..3]  -> verbosity level (default 1)\n");
+	printf("         --u file   -> follow this file (eg a fifo) for corrected sentences, in\n");
+	printf("                       blocks ended by an empty line, and update the weights\n");
+	printf("                       with each (default: no updates)\n");
+	printf("         --c float  -> max step size of an update (default 1; 0: no cap)\n");
+	printf("         --o file   -> where to write the updated model (default\n");
+	printf("                       MODEL_BASE_online.model)\n");
+	printf("         --p int    -> write the updated model every this many updates, and at\n");
+	printf("                       the end of the input (default 100)\n");
+	printf("         --d, --k, --m -> decoder and its options, as for svm_hmm_classify\n");
+	printf("                       (default: Viterbi)\n");
+}
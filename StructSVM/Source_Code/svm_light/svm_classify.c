@@ -17,10 +17,14 @@
 /************************************************************************/
 
 # include "svm_common.h"
+# include <zlib.h>
 
 char docfile[200];
 char modelfile[200];
 char predictionsfile[200];
+long expand_poly2=0;          /* classify -t 1 -d 2 models on the explicit */
+                              /* feature map (-E) */
+long poly2_hash_bits=DEFAULT_POLY2_HASH_BITS; /* its pair features (-H) */
 
 void read_input_parameters(int, char **, char *, char *, char *, long *, 
 			   long *);
@@ -35,11 +39,13 @@ int main (int argc, char* argv[])
   long totdoc=0,queryid,slackid;
   long correct=0,incorrect=0,no_accuracy=0;
   long res_a=0,res_b=0,res_c=0,res_d=0,wnum,pred_format;
-  long j;
+  long j,expwords=0;
+  SVECTOR *expanded;
   double t1,runtime=0;
   double dist,doc_label,costfactor;
   char *line,*comment; 
-  FILE *predfl,*docfl;
+  FILE *predfl;
+  gzFile docfl;
   MODEL *model; 
 
   read_input_parameters(argc,argv,docfile,modelfile,predictionsfile,
@@ -58,17 +64,35 @@ int main (int argc, char* argv[])
     /* compute weight vector */
     add_weight_vector_to_linear_model(model);
   }
+  else if(expand_poly2) {
+    expwords=poly2_expanded_totwords(&(model->kernel_parm),model->totwords,
+				     poly2_hash_bits);
+    if(expwords) {
+      /* compute weight vector in the space of the explicit feature map */
+      add_weight_vector_to_poly2_model(model,poly2_hash_bits);
+      if(poly2_hashed(model->totwords,poly2_hash_bits)) {
+	printf("\nWARNING: The feature pairs are hashed into 2^%ld pair features (-H);\n",
+	       poly2_hash_bits);
+	printf("the decision values approximate the kernel's.\n\n");
+      }
+    }
+    else {
+      printf("\nWARNING: Not using the explicit feature map (-E); it needs -t 1 -d 2 with\n");
+      printf("s*r>=0 and -H in 1..%d. Classifying with the kernel instead.\n\n",
+	     MAXPOLY2HASHBITS);
+    }
+  }
   
   if(verbosity>=2) {
     printf("Classifying test examples.."); fflush(stdout);
   }
 
-  if ((docfl = fopen (docfile, "r")) == NULL)
+  if ((docfl = gzopen (docfile, "rb")) == NULL) /* plain or gzip */
   { perror (docfile); exit (1); }
   if ((predfl = fopen (predictionsfile, "w")) == NULL)
   { perror (predictionsfile); exit (1); }
 
-  while((!feof(docfl)) && fgets(line,(int)lld,docfl)) {
+  while(gzgets(docfl,line,(int)lld)) {
     if(line[0] == '#') continue;  /* line contains comments */
     parse_document(line,words,&doc_label,&queryid,&slackid,&costfactor,&wnum,
 		   max_words_doc,&comment);
@@ -85,6 +109,13 @@ int main (int argc, char* argv[])
     if(model->kernel_parm.kernel_type == LINEAR) {   /* linear kernel */
       dist=classify_example_linear(model,doc);
     }
+    else if(expwords) {                  /* explicit map of poly kernel */
+      expanded=expand_poly2_svector(doc->fvec,&(model->kernel_parm),
+				    model->totwords,poly2_hash_bits);
+      free_svector(doc->fvec);
+      doc->fvec=expanded;
+      dist=classify_example_linear(model,doc);
+    }
     else {                                           /* non-linear kernel */
       dist=classify_example(model,doc);
     }
@@ -158,6 +189,8 @@ void read_input_parameters(int argc, char **argv, char *docfile,
       case 'h': print_help(); exit(0);
       case 'v': i++; (*verbosity)=atol(argv[i]); break;
       case 'f': i++; (*pred_format)=atol(argv[i]); break;
+      case 'E': i++; expand_poly2=atol(argv[i]); break;
+      case 'H': i++; poly2_hash_bits=atol(argv[i]); break;
       default: printf("\nUnrecognized option %s!\n\n",argv[i]);
 	       print_help();
 	       exit(0);
@@ -188,7 +221,15 @@ void print_help(void)
   printf("options: -h         -> this help\n");
   printf("         -v [0..3]  -> verbosity level (default 2)\n");
   printf("         -f [0,1]   -> 0: old output format of V1.0\n");
-  printf("                    -> 1: output the value of decision function (default)\n\n");
+  printf("                    -> 1: output the value of decision function (default)\n");
+  printf("         -E [0,1]   -> for models with -t 1 -d 2, classify with the weight\n");
+  printf("                       vector in the explicit feature space of the kernel\n");
+  printf("                       (all products of two features) (default 0)\n");
+  printf("         -H [1..%d] -> with -E, at most 2^H features for the products of\n",
+	 MAXPOLY2HASHBITS);
+  printf("                       two features; if there are more pairs, they are\n");
+  printf("                       hashed into them and the kernel is approximated\n");
+  printf("                       (default %d)\n\n",DEFAULT_POLY2_HASH_BITS);
 }
 
 
@@ -19,6 +19,7 @@
 # include "ctype.h"
 # include "svm_common.h"
 # include "kernel.h"           /* this contains a user supplied kernel */
+# include <zlib.h>             /* document files may be gzip compressed */
 
 #define MAX(x,y)      ((x) < (y) ? (y) : (x))
 #define MIN(x,y)      ((x) > (y) ? (y) : (x))
@@ -560,6 +561,166 @@ void add_weight_vector_to_linear_model(MODEL *model)
   }
 }
 
+long poly2_pair_features(long totwords, long hashbits)
+     /* The number of features of the explicit feature map of the
+	degree-2 polynomial kernel that hold the products of two of the
+	features 1..totwords: one per pair if there are at most
+	2^hashbits pairs, else 2^hashbits */
+{
+  if((double)totwords*((double)totwords+1.0)/2.0 <= (double)(1L<<hashbits))
+    return(totwords*(totwords+1)/2);
+  return(1L<<hashbits);
+}
+
+int poly2_hashed(long totwords, long hashbits)
+     /* whether the pair products are hashed (see expand_poly2_svector),
+	so that the map only approximates the kernel */
+{
+  return((double)totwords*((double)totwords+1.0)/2.0 > (double)(1L<<hashbits));
+}
+
+long poly2_expanded_totwords(KERNEL_PARM *kernel_parm, long totwords,
+			     long hashbits)
+     /* The highest feature index of the explicit feature map of the
+	polynomial kernel (s a*b+c)^2 over features 1..totwords with
+	at most 2^hashbits pair features, or 0 if the kernel has no
+	such map (other kernel or degree, s*c<0) or hashbits is out of
+	range. The map holds sqrt(2sc)*x_i at i, c at totwords+1, and
+	the pair products after that (see expand_poly2_svector). */
+{
+  double words;
+
+  if((kernel_parm->kernel_type != POLY) || (kernel_parm->poly_degree != 2)
+     || (kernel_parm->coef_lin*kernel_parm->coef_const < 0)
+     || (hashbits < 1) || (hashbits > MAXPOLY2HASHBITS))
+    return(0);
+  words=(double)totwords+1.0+(double)poly2_pair_features(totwords,hashbits);
+  if(words > (double)FNUM_MAX)
+    return(0);
+  return((long)words);
+}
+
+unsigned long poly2_pair_hash(FNUM a, FNUM b)
+     /* mixes the feature numbers of a pair (a<=b) into the bits of the
+	result; the low hashbits pick the feature, the next one the
+	sign */
+{
+  unsigned long h=(unsigned long)a;
+  h=(h*2654435761UL)^(unsigned long)b;
+  h^=h>>15;
+  h*=2246822519UL;
+  h^=h>>13;
+  h*=3266489917UL;
+  h^=h>>16;
+  return(h);
+}
+
+int compare_word_wnum(const void *a, const void *b)
+{
+  const WORD *wa=(const WORD *)a,*wb=(const WORD *)b;
+  return((wa->wnum < wb->wnum) ? -1 : ((wa->wnum > wb->wnum) ? 1 : 0));
+}
+
+SVECTOR *expand_poly2_svector(SVECTOR *vec, KERNEL_PARM *kernel_parm, 
+			      long totwords, long hashbits)
+     /* Returns the explicit feature map of vec for the polynomial
+	kernel of degree 2 (see poly2_expanded_totwords), with the same
+	factor. The product s*x_i*x_j (times sqrt(2) for i<j) of the
+	pair i<=j goes to totwords+1+j*(j-1)/2+i, so that the dot
+	product of two mapped vectors is the kernel; if there are more
+	than 2^hashbits pairs, it goes to totwords+2 plus the low
+	hashbits of a hash of the pair instead, with a sign from the next
+	bit, and the dot product is the kernel plus the products of the
+	pairs that collide, which cancel out on average. Features above
+	totwords are dropped; they can't match a feature of a vector it
+	is compared with. Only the first vector of a list is mapped. */
+{
+  SVECTOR *expanded;
+  WORD *words;
+  long n,i,j,k,first_pair,hashed;
+  unsigned long h,mask;
+  double s=kernel_parm->coef_lin,c=kernel_parm->coef_const;
+  double lin=sqrt(2.0*s*c),sign;
+
+  hashed=poly2_hashed(totwords,hashbits);
+  mask=(1UL<<hashbits)-1;
+  for(n=0;vec->words[n].wnum && (vec->words[n].wnum <= totwords);n++);
+  words=(WORD *)my_malloc(sizeof(WORD)*(n+1+n*(n+1)/2+1));
+  k=0;
+  if(lin != 0) {
+    for(i=0;i<n;i++) {
+      words[k].wnum=vec->words[i].wnum;
+      words[k].weight=(FVAL)(lin*vec->words[i].weight);
+      k++;
+    }
+  }
+  if(c != 0) {
+    words[k].wnum=totwords+1;
+    words[k].weight=(FVAL)c;
+    k++;
+  }
+  first_pair=k;
+  /* by increasing j, then i, the exact indices increase */
+  for(j=0;j<n;j++) {
+    for(i=0;i<=j;i++) {
+      sign=1.0;
+      if(hashed) {
+	h=poly2_pair_hash(vec->words[i].wnum,vec->words[j].wnum);
+	words[k].wnum=totwords+2+(FNUM)(h&mask);
+	if((h>>hashbits)&1)
+	  sign=-1.0;
+      }
+      else
+	words[k].wnum=totwords+1+(FNUM)((long)vec->words[j].wnum
+					 *(vec->words[j].wnum-1)/2)
+	  +vec->words[i].wnum;
+      words[k].weight=(FVAL)(sign*s*(i == j ? 1.0 : sqrt(2.0))
+			     *vec->words[i].weight*vec->words[j].weight);
+      k++;
+    }
+  }
+  if(hashed && (k > first_pair)) {
+    /* sort the hashed pairs by feature and add up those that collide */
+    qsort(words+first_pair,k-first_pair,sizeof(WORD),compare_word_wnum);
+    for(i=first_pair,j=first_pair+1;j<k;j++) {
+      if(words[j].wnum == words[i].wnum)
+	words[i].weight+=words[j].weight;
+      else
+	words[++i]=words[j];
+    }
+    k=i+1;
+  }
+  words[k].wnum=0;
+  expanded=create_svector(words,vec->userdefined,vec->factor);
+  expanded->kernel_id=vec->kernel_id;
+  free(words);
+  return(expanded);
+}
+
+void add_weight_vector_to_poly2_model(MODEL *model, long hashbits)
+     /* compute the weight vector of a model with the polynomial kernel
+	of degree 2 in its explicit feature space (with at most
+	2^hashbits pair features) and add it to the model; examples are
+	classified with classify_example_linear after mapping them with
+	expand_poly2_svector */
+{
+  long i,words;
+  SVECTOR *f,*e;
+
+  words=poly2_expanded_totwords(&(model->kernel_parm),model->totwords,
+				hashbits);
+  model->lin_weights=create_nvector(words);
+  clear_nvector(model->lin_weights,words);
+  for(i=1;i<model->sv_num;i++) {
+    for(f=(model->supvec[i])->fvec;f;f=f->next) {
+      e=expand_poly2_svector(f,&(model->kernel_parm),model->totwords,
+			     hashbits);
+      add_vector_ns(model->lin_weights,e,f->factor*model->alpha[i]);
+      free_svector(e);
+    }
+  }
+}
+
 
 DOC *create_example(long docnum, long queryid, long slackid, 
 		    double costfactor, SVECTOR *fvec)
@@ -626,7 +787,7 @@ MATRIX *realloc_matrix(MATRIX *matrix, int n, int m)
   return(matrix);
 }
 
-double *create_nvector(int n)
+double *create_nvector(long n)
 /* creates a dense column vector with n+1 rows. unfortunately, there
    is part of the code that starts counting at 0, while the sparse
    vectors start counting at 1. So, it always allocates one extra
@@ -917,11 +1078,144 @@ void print_matrix(MATRIX *matrix)
 
 /***************************** IO routines ***************************/
 
+unsigned long hash_svector(SVECTOR *vec)
+     /* hashes the feature/value pairs and the userdefined string of a
+	single SVECTOR (the list is not followed, the factor is
+	ignored) */
+{
+  unsigned long h=2166136261UL;
+  WORD *w;
+  char *c;
+  unsigned int bits;
+
+  for(w=vec->words;w->wnum;w++) {
+    memcpy(&bits,&(w->weight),sizeof(bits));
+    h=(h^(unsigned long)w->wnum)*16777619UL;
+    h=(h^(unsigned long)bits)*16777619UL;
+  }
+  if(vec->userdefined)
+    for(c=vec->userdefined;*c;c++)
+      h=(h^(unsigned long)(unsigned char)(*c))*16777619UL;
+  return(h);
+}
+
+int svector_eq(SVECTOR *a, SVECTOR *b)
+     /* tests two single SVECTORs for identical feature/value pairs and
+	userdefined strings (unlike featvec_eq, the vectors must have
+	the same length) */
+{
+  WORD *ai,*bj;
+
+  for(ai=a->words,bj=b->words;ai->wnum && bj->wnum;ai++,bj++)
+    if((ai->wnum != bj->wnum) || (ai->weight != bj->weight))
+      return(0);
+  if(ai->wnum || bj->wnum)
+    return(0);
+  if((!a->userdefined) || (!b->userdefined))
+    return(a->userdefined == b->userdefined);
+  return(strcmp(a->userdefined,b->userdefined) == 0);
+}
+
+int compare_svec_entry_hash(const void *a, const void *b)
+{
+  const SVEC_ENTRY *ea=(const SVEC_ENTRY *)a,*eb=(const SVEC_ENTRY *)b;
+  if(ea->hash != eb->hash)
+    return((ea->hash < eb->hash) ? -1 : 1);
+  return((ea->pos < eb->pos) ? -1 : ((ea->pos > eb->pos) ? 1 : 0));
+}
+
+int compare_svec_entry_pos(const void *a, const void *b)
+{
+  const SVEC_ENTRY *ea=(const SVEC_ENTRY *)a,*eb=(const SVEC_ENTRY *)b;
+  return((ea->pos < eb->pos) ? -1 : ((ea->pos > eb->pos) ? 1 : 0));
+}
+
+long merge_support_vectors(MODEL *model, SVEC_ENTRY **merged)
+     /* flattens the SVECTOR lists of all support vectors of model and
+	sums the alpha's of identical vectors. Returns the number of
+	distinct vectors with non-zero coefficient; they are stored in
+	(*merged) in order of first appearance. */
+{
+  long i,j,k,n,run_end;
+  SVECTOR *v;
+  SVEC_ENTRY *e;
+
+  n=0;
+  for(i=1;i<model->sv_num;i++)
+    for(v=model->supvec[i]->fvec;v;v=v->next)
+      n++;
+  e=(SVEC_ENTRY *)my_malloc(sizeof(SVEC_ENTRY)*(n+1));
+  n=0;
+  for(i=1;i<model->sv_num;i++) {
+    for(v=model->supvec[i]->fvec;v;v=v->next) {
+      e[n].vec=v;
+      e[n].alpha=model->alpha[i]*v->factor;
+      e[n].hash=hash_svector(v);
+      e[n].pos=n;
+      n++;
+    }
+  }
+
+  /* identical vectors have identical hashes, so only compare within
+     runs of equal hash values */
+  qsort(e,n,sizeof(SVEC_ENTRY),compare_svec_entry_hash);
+  for(i=0;i<n;i=run_end) {
+    for(run_end=i+1;(run_end<n) && (e[run_end].hash == e[i].hash);run_end++);
+    for(j=i;j<run_end;j++) {
+      if(!e[j].vec) continue;
+      for(k=j+1;k<run_end;k++) {
+	if(e[k].vec && svector_eq(e[j].vec,e[k].vec)) {
+	  e[j].alpha+=e[k].alpha;
+	  e[k].vec=NULL;
+	}
+      }
+    }
+  }
+  qsort(e,n,sizeof(SVEC_ENTRY),compare_svec_entry_pos);
+
+  j=0;
+  for(i=0;i<n;i++)
+    if(e[i].vec && (e[i].alpha != 0))
+      e[j++]=e[i];
+  (*merged)=e;
+  return(j);
+}
+
+char *format_shortest_float(char *buf, double value)
+     /* prints value with the fewest significant digits that still read
+	back as the same FVAL (float) */
+{
+  int digits;
+  for(digits=6;digits<9;digits++) {
+    sprintf(buf,"%.*g",digits,value);
+    if((FVAL)strtod(buf,NULL) == (FVAL)value)
+      return(buf);
+  }
+  sprintf(buf,"%.9g",value);
+  return(buf);
+}
+
+char *format_shortest_double(char *buf, double value)
+     /* prints value with the fewest significant digits that still read
+	back as the same double */
+{
+  int digits;
+  for(digits=15;digits<17;digits++) {
+    sprintf(buf,"%.*g",digits,value);
+    if(strtod(buf,NULL) == value)
+      return(buf);
+  }
+  sprintf(buf,"%.17g",value);
+  return(buf);
+}
+
 void write_model(char *modelfile, MODEL *model)
 {
   FILE *modelfl;
   long j,i,sv_num;
   SVECTOR *v;
+  SVEC_ENTRY *merged;
+  char numbuf[64];
 
   if(verbosity>=1) {
     printf("Writing model file..."); fflush(stdout);
@@ -943,28 +1237,27 @@ void write_model(char *modelfile, MODEL *model)
   fprintf(modelfl,"%ld # highest feature index \n",model->totwords);
   fprintf(modelfl,"%ld # number of training documents \n",model->totdoc);
  
-  sv_num=1;
-  for(i=1;i<model->sv_num;i++) {
-    for(v=model->supvec[i]->fvec;v;v=v->next) 
-      sv_num++;
-  }
+  /* identical vectors (e.g. the same Psi(x,y) in several constraints)
+     are written only once with their alpha's summed */
+  sv_num=merge_support_vectors(model,&merged)+1;
   fprintf(modelfl,"%ld # number of support vectors plus 1 \n",sv_num);
   fprintf(modelfl,"%.8g # threshold b, each following line is a SV (starting with alpha*y)\n",model->b);
 
-  for(i=1;i<model->sv_num;i++) {
-    for(v=model->supvec[i]->fvec;v;v=v->next) {
-      fprintf(modelfl,"%.32g ",model->alpha[i]*v->factor);
-      for (j=0; (v->words[j]).wnum; j++) {
-	fprintf(modelfl,"%ld:%.8g ",
-		(long)(v->words[j]).wnum,
-		(double)(v->words[j]).weight);
-      }
-      fprintf(modelfl,"#%s\n",v->userdefined);
-    /* NOTE: this could be made more efficient by summing the
-       alpha's of identical vectors before writing them to the
-       file. */
+  for(i=0;i<sv_num-1;i++) {
+    v=merged[i].vec;
+    fputs(format_shortest_double(numbuf,merged[i].alpha),modelfl);
+    for (j=0; (v->words[j]).wnum; j++) {
+      if((v->words[j]).weight == 0) continue;
+      fprintf(modelfl," %ld:%s",
+	      (long)(v->words[j]).wnum,
+	      format_shortest_float(numbuf,(double)(v->words[j]).weight));
     }
+    if(v->userdefined && v->userdefined[0])
+      fprintf(modelfl," #%s\n",v->userdefined);
+    else
+      fprintf(modelfl,"\n");
   }
+  free(merged);
   fclose(modelfl);
   if(verbosity>=1) {
     printf("done\n");
@@ -1096,7 +1389,7 @@ void read_documents(char *docfile, DOC ***docs, double **label,
   long dnum=0,wpos,dpos=0,dneg=0,dunlab=0,queryid,slackid,max_docs;
   long max_words_doc, ll;
   double doc_label,costfactor;
-  FILE *docfl;
+  gzFile docfl;
 
   if(verbosity>=1) {
     printf("Scanning examples..."); fflush(stdout);
@@ -1113,7 +1406,7 @@ void read_documents(char *docfile, DOC ***docs, double **label,
   (*label) = (double *)my_malloc(sizeof(double)*max_docs); /* target values */
   line = (char *)my_malloc(sizeof(char)*ll);
 
-  if ((docfl = fopen (docfile, "r")) == NULL)
+  if ((docfl = gzopen (docfile, "rb")) == NULL) /* plain or gzip */
   { perror (docfile); exit (1); }
 
   words = (WORD *)my_malloc(sizeof(WORD)*(max_words_doc+10));
@@ -1122,7 +1415,7 @@ void read_documents(char *docfile, DOC ***docs, double **label,
   }
   dnum=0;
   (*totwords)=0;
-  while((!feof(docfl)) && fgets(line,(int)ll,docfl)) {
+  while(gzgets(docfl,line,(int)ll)) {
     if(line[0] == '#') continue;  /* line contains comments */
     if(!parse_document(line,words,&doc_label,&queryid,&slackid,&costfactor,
 		       &wpos,max_words_doc,&comment)) {
@@ -1152,7 +1445,7 @@ void read_documents(char *docfile, DOC ***docs, double **label,
     }
   } 
 
-  fclose(docfl);
+  gzclose(docfl);
   free(line);
   free(words);
   if(verbosity>=1) {
@@ -1235,6 +1528,11 @@ int parse_document(char *line, WORD *words, double *label,
 	printf("LINE: %s\n",line);
 	exit (1); 
       }
+      if(wnum>FNUM_MAX) { /* check before it is truncated to FNUM */
+	printf("\nFeature number does not fit into FNUM (define LARGE_INDEX in svm_common.h)!\n");
+	printf("LINE: %s\n",line);
+	exit (1); 
+      }
       if((wpos>0) && ((words[wpos-1]).wnum >= wnum)) { 
 	perror ("Features must be in increasing order!!!\n"); 
 	printf("LINE: %s\n",line);
@@ -1302,6 +1600,8 @@ void set_learning_defaults(LEARN_PARM *learn_parm, KERNEL_PARM *kernel_parm)
   learn_parm->svm_c=0.0;
   learn_parm->eps=0.1;
   learn_parm->transduction_posratio=-1.0;
+  learn_parm->transduction_switches=1;
+  learn_parm->transduction_annealing=1.5;
   learn_parm->svm_costratio=1.0;
   learn_parm->svm_costratio_unlab=1.0;
   learn_parm->svm_unlabbound=1E-5;
@@ -1352,6 +1652,14 @@ int check_learning_parms(LEARN_PARM *learn_parm, KERNEL_PARM *kernel_parm)
     printf("be less than 1.0 !!!\n\n");
     return(0);
   }
+  if(learn_parm->transduction_switches<1) {
+    printf("\nThe number of label switches per round must be at least 1!\n\n");
+    return(0);
+  }
+  if(learn_parm->transduction_annealing<=1) {
+    printf("\nThe factor for the cost of unlabeled examples must be greater than 1!\n\n");
+    return(0);
+  }
   if(learn_parm->svm_costratio<=0) {
     printf("\nThe COSTRATIO parameter must be greater than zero!\n\n");
     return(0);
@@ -1378,19 +1686,19 @@ void nol_ll(char *file, long int *nol, long int *wol, long int *ll)
      /* Grep through file and count number of lines, maximum number of
         spaces per line, and longest line. */
 {
-  FILE *fl;
+  gzFile fl;
   int ic;
   char c;
   long current_length,current_wol;
 
-  if ((fl = fopen (file, "r")) == NULL)
+  if ((fl = gzopen (file, "rb")) == NULL) /* plain or gzip */
   { perror (file); exit (1); }
   current_length=0;
   current_wol=0;
   (*ll)=0;
   (*nol)=1;
   (*wol)=0;
-  while((ic=getc(fl)) != EOF) {
+  while((ic=gzgetc(fl)) != -1) {
     c=(char)ic;
     current_length++;
     if(space_or_null((int)c)) {
@@ -1408,7 +1716,7 @@ void nol_ll(char *file, long int *nol, long int *wol, long int *ll)
       current_wol=0;
     }
   }
-  fclose(fl);
+  gzclose(fl);
 }
 
 long minl(long int a, long int b)
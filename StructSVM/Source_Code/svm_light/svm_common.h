@@ -19,9 +19,19 @@
 #ifndef SVM_COMMON
 #define SVM_COMMON
 
+/* # define LARGE_INDEX */      /* uncomment for 64-bit feature ids (doubles
+				   the size of WORD); it is set here, not in
+				   a makefile, so that svm_light, svm_struct
+				   and the API objects all get the same WORD */
+
 # define MAXSHRINK     50000    /* maximum number of shrinking rounds */
+# ifdef LARGE_INDEX
+# define MAXFEATNUM 999999999999999L /* maximum feature number (must be in
+			  	   valid range of long int type!) */
+# else
 # define MAXFEATNUM 99999999    /* maximum feature number (must be in
 			  	   valid range of long int type!) */
+# endif
 
 # include <stdio.h>
 # include <stdint.h>
@@ -38,7 +48,13 @@
 # define CFLOAT  float       /* the type of float to use for caching */
                              /* kernel evaluations. Using float saves */
                              /* us some memory, but you can use double, too */
+# ifdef LARGE_INDEX
+# define FNUM    int64_t     /* the type used for storing feature ids */
+# define FNUM_MAX INT64_MAX  /* largest id representable in FNUM */
+# else
 # define FNUM    int32_t     /* the type used for storing feature ids */
+# define FNUM_MAX INT32_MAX  /* largest id representable in FNUM */
+# endif
 # define FVAL    float       /* the type used for storing feature values */
 
 # define LINEAR  0           /* linear kernel type */
@@ -48,6 +64,12 @@
 # define CUSTOM  4           /* userdefined kernel function from kernel.h */
 # define GRAM    5           /* use explicit gram matrix from kernel_parm */
 
+# define DEFAULT_POLY2_HASH_BITS 24 /* the explicit expansion of the */
+                             /* degree-2 polynomial kernel has at most */
+                             /* 2^bits pair features; more pairs are */
+                             /* hashed into them (the weights are dense) */
+# define MAXPOLY2HASHBITS 30
+
 # define CLASSIFICATION 1    /* train classification model */
 # define REGRESSION     2    /* train regression model */
 # define RANKING        3    /* train ranking model */
@@ -134,6 +156,11 @@ typedef struct learn_parm {
   double svm_costratio;        /* factor to multiply C for positive examples */
   double transduction_posratio;/* fraction of unlabeled examples to be */
                                /* classified as positives */
+  long   transduction_switches;/* maximum number of label pairs of
+				  unlabeled examples switched per round
+				  (1 switches a single pair as in [3]) */
+  double transduction_annealing;/* factor by which the cost of unlabeled
+				  examples grows per step */
   long   biased_hyperplane;    /* if nonzero, use hyperplane w*x+b=0 
 				  otherwise w*x=0 */
   long   sharedslack;          /* if nonzero, it will use the shared
@@ -242,6 +269,12 @@ typedef struct quadratic_program {
   double *opt_g0;          /* linear part of objective */
   double *opt_xinit;       /* initial value for variables */
   double *opt_low,*opt_up; /* box constraints */
+  double *opt_k,*opt_kold; /* kernel matrix of this and the last QP, 
+			      so the next QP can reuse its entries */
+  long   *opt_kkey;        /* docs of the last QP */
+  long   opt_kn;           /* and how many */
+  long   *opt_kpos;        /* doc -> position in opt_kkey, or -1 */
+  long   *opt_ktodo;       /* entries of opt_k still to compute */
 } QP;
 
 typedef struct kernel_cache {
@@ -260,6 +293,13 @@ typedef struct kernel_cache {
 } KERNEL_CACHE;
 
 
+typedef struct svec_entry {
+  SVECTOR *vec;        /* NULL once merged into an earlier entry */
+  double  alpha;       /* summed alpha*factor of all identical vectors */
+  unsigned long hash;  /* hash of the feature/value pairs */
+  long    pos;         /* position in the order of first appearance */
+} SVEC_ENTRY;
+
 typedef struct timing_profile {
   long   time_kernel;
   long   time_opti;
@@ -306,11 +346,18 @@ void   mult_vector_ns(double *, SVECTOR *, double);
 void   add_vector_ns(double *, SVECTOR *, double);
 double sprod_ns(double *, SVECTOR *);
 void   add_weight_vector_to_linear_model(MODEL *);
+long   poly2_pair_features(long, long);
+int    poly2_hashed(long, long);
+long   poly2_expanded_totwords(KERNEL_PARM *, long, long);
+unsigned long poly2_pair_hash(FNUM, FNUM);
+int    compare_word_wnum(const void *, const void *);
+SVECTOR *expand_poly2_svector(SVECTOR *, KERNEL_PARM *, long, long);
+void   add_weight_vector_to_poly2_model(MODEL *, long);
 DOC    *create_example(long, long, long, double, SVECTOR *);
 void   free_example(DOC *, long);
 MATRIX *create_matrix(int n, int m);
 MATRIX *realloc_matrix(MATRIX *matrix, int n, int m);
-double *create_nvector(int n);
+double *create_nvector(long n);
 void   clear_nvector(double *vec, long int n);
 MATRIX *copy_matrix(MATRIX *matrix);
 void   free_matrix(MATRIX *matrix);
@@ -325,6 +372,13 @@ double *prod_nvector_ltmatrix(double *v, MATRIX *A);
 double *prod_ltmatrix_nvector(MATRIX *A, double *v);
 MATRIX *prod_matrix_matrix(MATRIX *A, MATRIX *B);
 void   print_matrix(MATRIX *matrix);
+unsigned long hash_svector(SVECTOR *);
+int    svector_eq(SVECTOR *, SVECTOR *);
+int    compare_svec_entry_hash(const void *, const void *);
+int    compare_svec_entry_pos(const void *, const void *);
+long   merge_support_vectors(MODEL *, SVEC_ENTRY **);
+char   *format_shortest_float(char *, double);
+char   *format_shortest_double(char *, double);
 MODEL  *read_model(char *);
 MODEL  *copy_model(MODEL *);
 void   free_model(MODEL *, int);
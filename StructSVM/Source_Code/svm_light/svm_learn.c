@@ -17,6 +17,8 @@
 /***********************************************************************/
 
 
+# include <unistd.h>
+# include <pthread.h>
 # include "svm_common.h"
 # include "svm_learn.h"
 
@@ -493,76 +495,49 @@ void svm_learn_regression(DOC **docs, double *value, long int totdoc,
      /* totwords:    Number of features (i.e. highest feature index) */
      /* learn_parm:  Learning paramenters */
      /* kernel_parm: Kernel paramenters */
-     /* kernel_cache:Initialized Cache, if using a kernel. NULL if
-                     linear. Note that it will be free'd and reassigned */
+     /* kernel_cache:Initialized Cache of size totdoc, if using a kernel. 
+                     If NULL (linear), one is created and returned here */
      /* model:       Returns learning result (assumed empty before called) */
+
+     /* Solves the epsilon-SVR dual over the differences
+	beta_i=alpha_i-alpha*_i of the paired variables of each example,
+
+          min 1/2 beta'K beta - value'beta + eps sum_i |beta_i|
+          s.t. -C_i* <= beta_i <= C_i  (and sum_i beta_i = 0 if biased),
+
+	so the kernel cache, the gradient and the working set are over
+	the totdoc examples, and not over the 2*totdoc variables of the
+	standard form. alpha_i and alpha*_i are never both positive at
+	the optimum, so beta determines them. Each iteration changes the
+	pair of examples chosen with second order information as in Fan,
+	Chen and Lin (JMLR 2005), or a single example without a bias, and
+	solves for it exactly; the eps term makes the subproblem piecewise
+	quadratic, with breaks where a beta changes sign. */
 {
-  long *inconsistent,i,j;
-  long inconsistentnum;
-  long upsupvecnum;
-  double loss,model_length,example_length;
-  double maxdiff,*lin,*a,*c;
+  long i,j,k,a,iterations,bestiteration,upsupvecnum,activenum;
+  long *active2dnum,*isactive;
+  double *beta,*grad,*cup,*clow,*kdiag,*dup,*ddown,b,lo,hi,nfree;
+  double maxdiff,bestmaxdiff,gain,bestgain,eta,t,tlow,thigh,di,dj;
+  double tau=1e-12;
+  double loss,model_length,example_length,r_delta_avg;
+  CFLOAT *ki,*kj;
   long runtime_start,runtime_end;
-  long iterations,kernel_cache_size;
-  long *unlabeled;
-  double r_delta_sq=0,r_delta,r_delta_avg;
-  double *xi_fullset; /* buffer for storing xi on full sample in loo */
-  double *a_fullset;  /* buffer for storing alpha on full sample in loo */
-  TIMING timing_profile;
-  SHRINK_STATE shrink_state;
-  DOC **docs_org;
-  long *label;
-
-  /* set up regression problem in standard form */
-  docs_org=docs;
-  docs = (DOC **)my_malloc(sizeof(DOC)*2*totdoc);
-  label = (long *)my_malloc(sizeof(long)*2*totdoc);
-  c = (double *)my_malloc(sizeof(double)*2*totdoc);
-  for(i=0;i<totdoc;i++) {   
-    j=2*totdoc-1-i;
-    docs[i]=create_example(i,0,0,docs_org[i]->costfactor,docs_org[i]->fvec);
-    label[i]=+1;
-    c[i]=value[i];
-    docs[j]=create_example(j,0,0,docs_org[i]->costfactor,docs_org[i]->fvec);
-    label[j]=-1;
-    c[j]=value[i];
-  }
-  totdoc*=2;
-
-  /* need to get a bigger kernel cache */
-  if(*kernel_cache) {
-    kernel_cache_size=(*kernel_cache)->buffsize*sizeof(CFLOAT)/(1024*1024);
-    kernel_cache_cleanup(*kernel_cache);
-    (*kernel_cache)=kernel_cache_init(totdoc,kernel_cache_size);
-  }
 
   runtime_start=get_runtime();
-  timing_profile.time_kernel=0;
-  timing_profile.time_opti=0;
-  timing_profile.time_shrink=0;
-  timing_profile.time_update=0;
-  timing_profile.time_model=0;
-  timing_profile.time_check=0;
-  timing_profile.time_select=0;
   kernel_cache_statistic=0;
-
   learn_parm->totwords=totwords;
 
-  /* make sure -n value is reasonable */
-  if((learn_parm->svm_newvarsinqp < 2) 
-     || (learn_parm->svm_newvarsinqp > learn_parm->svm_maxqpsize)) {
-    learn_parm->svm_newvarsinqp=learn_parm->svm_maxqpsize;
-  }
-
-  init_shrink_state(&shrink_state,totdoc,(long)MAXSHRINK);
-
-  inconsistent = (long *)my_malloc(sizeof(long)*totdoc);
-  unlabeled = (long *)my_malloc(sizeof(long)*totdoc);
-  a = (double *)my_malloc(sizeof(double)*totdoc);
-  a_fullset = (double *)my_malloc(sizeof(double)*totdoc);
-  xi_fullset = (double *)my_malloc(sizeof(double)*totdoc);
-  lin = (double *)my_malloc(sizeof(double)*totdoc);
-  learn_parm->svm_cost = (double *)my_malloc(sizeof(double)*totdoc);
+  beta = (double *)my_malloc(sizeof(double)*totdoc);
+  grad = (double *)my_malloc(sizeof(double)*totdoc);
+  cup = (double *)my_malloc(sizeof(double)*totdoc);
+  clow = (double *)my_malloc(sizeof(double)*totdoc);
+  kdiag = (double *)my_malloc(sizeof(double)*totdoc);
+  dup = (double *)my_malloc(sizeof(double)*totdoc);
+  ddown = (double *)my_malloc(sizeof(double)*totdoc);
+  ki = (CFLOAT *)my_malloc(sizeof(CFLOAT)*totdoc);
+  kj = (CFLOAT *)my_malloc(sizeof(CFLOAT)*totdoc);
+  active2dnum = (long *)my_malloc(sizeof(long)*(totdoc+1));
+  isactive = (long *)my_malloc(sizeof(long)*totdoc);
   model->supvec = (DOC **)my_malloc(sizeof(DOC *)*(totdoc+2));
   model->alpha = (double *)my_malloc(sizeof(double)*(totdoc+2));
   model->index = (long *)my_malloc(sizeof(long)*(totdoc+2));
@@ -582,10 +557,6 @@ void svm_learn_regression(DOC **docs, double *value, long int totdoc,
   model->xa_error=-1;
   model->xa_recall=-1;
   model->xa_precision=-1;
-  inconsistentnum=0;
-
-  r_delta=estimate_r_delta(docs,totdoc,kernel_parm);
-  r_delta_sq=r_delta*r_delta;
 
   r_delta_avg=estimate_r_delta_average(docs,totdoc,kernel_parm);
   if(learn_parm->svm_c == 0.0) {  /* default value for C */
@@ -596,84 +567,217 @@ void svm_learn_regression(DOC **docs, double *value, long int totdoc,
   }
 
   for(i=0;i<totdoc;i++) {    /* various inits */
-    inconsistent[i]=0;
-    a[i]=0;
-    lin[i]=0;
-    unlabeled[i]=0;
-    if(label[i] > 0) {
-      learn_parm->svm_cost[i]=learn_parm->svm_c*learn_parm->svm_costratio*
-	docs[i]->costfactor;
-    }
-    else if(label[i] < 0) {
-      learn_parm->svm_cost[i]=learn_parm->svm_c*docs[i]->costfactor;
-    }
-  }
-
-  /* caching makes no sense for linear kernel */
-  if((kernel_parm->kernel_type == LINEAR) && (*kernel_cache)) {
-    printf("WARNING: Using a kernel cache for linear case will slow optimization down!\n");
-  } 
+    beta[i]=0;
+    grad[i]=-value[i];       /* gradient of the quadratic part */
+    cup[i]=learn_parm->svm_c*learn_parm->svm_costratio*docs[i]->costfactor;
+    clow[i]=learn_parm->svm_c*docs[i]->costfactor;
+    kdiag[i]=kernel(kernel_parm,docs[i],docs[i]);
+    active2dnum[i]=i;
+    isactive[i]=1;
+  }
+  active2dnum[totdoc]=-1;
+
+  /* the solver takes the kernel rows one or two at a time, so unlike
+     svm_learn_classification() it gains from a cache with the linear
+     kernel as well */
+  if(!(*kernel_cache))
+    (*kernel_cache)=kernel_cache_init(totdoc,learn_parm->kernel_cache_size);
 
   if(verbosity==1) {
     printf("Optimizing"); fflush(stdout);
   }
 
-  /* train the svm */
-  iterations=optimize_to_convergence(docs,label,totdoc,totwords,learn_parm,
-				     kernel_parm,*kernel_cache,&shrink_state,
-				     model,inconsistent,unlabeled,a,lin,c,
-				     &timing_profile,&maxdiff,(long)-1,
-				     (long)1);
-  
-  if(verbosity>=1) {
-    if(verbosity==1) printf("done. (%ld iterations)\n",iterations);
-
-    printf("Optimization finished (maxdiff=%.5f).\n",maxdiff); 
-
-    runtime_end=get_runtime();
-    if(verbosity>=2) {
-      printf("Runtime in cpu-seconds: %.2f (%.2f%% for kernel/%.2f%% for optimizer/%.2f%% for final/%.2f%% for update/%.2f%% for model/%.2f%% for check/%.2f%% for select)\n",
-        ((float)runtime_end-(float)runtime_start)/100.0,
-        (100.0*timing_profile.time_kernel)/(float)(runtime_end-runtime_start),
-	(100.0*timing_profile.time_opti)/(float)(runtime_end-runtime_start),
-	(100.0*timing_profile.time_shrink)/(float)(runtime_end-runtime_start),
-        (100.0*timing_profile.time_update)/(float)(runtime_end-runtime_start),
-        (100.0*timing_profile.time_model)/(float)(runtime_end-runtime_start),
-        (100.0*timing_profile.time_check)/(float)(runtime_end-runtime_start),
-        (100.0*timing_profile.time_select)/(float)(runtime_end-runtime_start));
+  bestmaxdiff=1e300;
+  bestiteration=0;
+  activenum=totdoc;
+  for(iterations=1;;iterations++) {
+    /* the rates at which the objective changes when beta_i goes up or
+       down, with the one-sided derivative of eps*|beta_i| */
+    i=-1;
+    j=-1;
+    lo=-1e300;
+    hi=1e300;
+    for(a=0;(k=active2dnum[a])>=0;a++) {
+      dup[k]=grad[k]+((beta[k] >= 0) ? learn_parm->eps : -learn_parm->eps);
+      ddown[k]=-grad[k]+((beta[k] > 0) ? -learn_parm->eps : learn_parm->eps);
+      if((beta[k] < cup[k]) && (-dup[k] > lo)) {
+	lo=-dup[k];
+	i=k;
+      }
+      if((beta[k] > -clow[k]) && (ddown[k] < hi)) {
+	hi=ddown[k];
+	j=k;
+      }
+    }
+    if(learn_parm->biased_hyperplane) {
+      /* optimal iff some b has dup+b >= 0 >= b-ddown, i.e. lo <= hi */
+      maxdiff=MAX(0,(lo-hi)/2);
     }
     else {
-      printf("Runtime in cpu-seconds: %.2f\n",
-	     (runtime_end-runtime_start)/100.0);
+      maxdiff=MAX(0,MAX(lo,-hi));
+      if(lo > -hi)   /* one variable, the more violating direction */
+	j=-1;
+      else {
+	i=j;
+	j=-1;
+      }
+    }
+    if((maxdiff <= learn_parm->epsilon_crit) || (i < 0)) {
+      if(activenum == totdoc)
+	break;
+      /* optimal on the active examples; check the shrunk ones too */
+      regression_unshrink(*kernel_cache,docs,value,beta,totdoc,active2dnum,
+			  isactive,ki,grad,kernel_parm);
+      activenum=totdoc;
+      bestmaxdiff=1e300;  /* the shrunk examples may violate more */
+      continue;
+    }
+    if(maxdiff < bestmaxdiff) {
+      bestmaxdiff=maxdiff;
+      bestiteration=iterations;
+    }
+    if(iterations-bestiteration > learn_parm->maxiter) 
+      break;
+
+    if((iterations % learn_parm->svm_iter_to_shrink) == 0) {
+      /* drop the examples at a bound (or at 0) that can't be part of
+	 a violating pair as long as lo and hi don't move past them;
+	 without a bias, those that violate less than -maxdiff */
+      if(!learn_parm->biased_hyperplane) {
+	lo=maxdiff;
+	hi=-maxdiff;
+      }
+      activenum=0;
+      for(a=0;(k=active2dnum[a])>=0;a++) {
+	if(((beta[k] < cup[k]) && (-dup[k] >= hi))
+	   || ((beta[k] > -clow[k]) && (ddown[k] <= lo))
+	   || ((beta[k] != 0) && (beta[k] < cup[k]) && (beta[k] > -clow[k])))
+	  active2dnum[activenum++]=k;
+	else
+	  isactive[k]=0;
+      }
+      active2dnum[activenum]=-1;
+      if(verbosity>=2) {
+	printf(" %ld active examples\n",activenum); fflush(stdout);
+      }
     }
 
-    if(learn_parm->remove_inconsistent) {	  
-      inconsistentnum=0;
-      for(i=0;i<totdoc;i++) 
-	if(inconsistent[i]) 
-	  inconsistentnum++;
-      printf("Number of SV: %ld (plus %ld inconsistent examples)\n",
-	     model->sv_num-1,inconsistentnum);
+    (*kernel_cache)->time=iterations;  /* for lru cache */
+    cache_kernel_row(*kernel_cache,docs,i,kernel_parm);
+    get_kernel_row(*kernel_cache,docs,i,totdoc,active2dnum,ki,kernel_parm);
+
+    if(learn_parm->biased_hyperplane) {
+      /* i goes up, j goes down: the one that promises the largest
+	 decrease for the quadratic model of the pair */
+      j=-1;
+      bestgain=0;
+      for(a=0;(k=active2dnum[a])>=0;a++) {
+	if((k != i) && (beta[k] > -clow[k])) {
+	  di=dup[i]+ddown[k];
+	  if(di < 0) {
+	    eta=MAX(kdiag[i]+kdiag[k]-2*ki[k],tau);
+	    gain=di*di/eta;
+	    if(gain > bestgain) {
+	      bestgain=gain;
+	      j=k;
+	    }
+	  }
+	}
+      }
+      if(j < 0)
+	break;
+      cache_kernel_row(*kernel_cache,docs,j,kernel_parm);
+      get_kernel_row(*kernel_cache,docs,j,totdoc,active2dnum,kj,kernel_parm);
+      eta=MAX(kdiag[i]+kdiag[j]-2*ki[j],tau);
+      tlow=MAX(-clow[i]-beta[i],beta[j]-cup[j]);
+      thigh=MIN(cup[i]-beta[i],beta[j]+clow[j]);
+      t=regression_step(eta,grad[i]-grad[j],beta[i],beta[j],1,tlow,thigh,
+			learn_parm->eps);
+      di=beta[i];
+      dj=beta[j];
+      beta[i]=regression_clip(beta[i]+t,-clow[i],cup[i],
+			      learn_parm->epsilon_a);
+      beta[j]=regression_clip(beta[j]-t,-clow[j],cup[j],
+			      learn_parm->epsilon_a);
+      di=beta[i]-di;
+      dj=beta[j]-dj;
+      for(a=0;(k=active2dnum[a])>=0;a++)
+	grad[k]+=di*ki[k]+dj*kj[k];
     }
     else {
-      upsupvecnum=0;
-      for(i=1;i<model->sv_num;i++) {
-	if(fabs(model->alpha[i]) >= 
-	   (learn_parm->svm_cost[(model->supvec[i])->docnum]-
-	    learn_parm->epsilon_a)) 
-	  upsupvecnum++;
+      t=regression_step(MAX(kdiag[i],tau),grad[i],beta[i],0,0,
+			-clow[i]-beta[i],cup[i]-beta[i],learn_parm->eps);
+      di=beta[i];
+      beta[i]=regression_clip(beta[i]+t,-clow[i],cup[i],
+			      learn_parm->epsilon_a);
+      di=beta[i]-di;
+      for(a=0;(k=active2dnum[a])>=0;a++)
+	grad[k]+=di*ki[k];
+    }
+    if((verbosity==1) && ((iterations % 1000) == 0)) {
+      printf("."); fflush(stdout);
+    }
+  }
+  if((iterations-bestiteration > learn_parm->maxiter) && (verbosity>=1))
+    printf("\nWARNING: Relaxing KT-Conditions due to slow progress! Terminating!\n");
+  if(activenum < totdoc)
+    regression_unshrink(*kernel_cache,docs,value,beta,totdoc,active2dnum,
+			isactive,ki,grad,kernel_parm);
+  iterations--;
+
+  /* threshold: the prediction of a free beta_i is value_i-eps*sign,
+     so b=-dup_i; the midpoint of [lo,hi] if none is free */
+  b=0;
+  if(learn_parm->biased_hyperplane) {
+    nfree=0;
+    for(k=0;k<totdoc;k++)
+      if((beta[k] != 0) && (beta[k] < cup[k]) && (beta[k] > -clow[k])) {
+	b+=-(grad[k]+((beta[k] > 0) ? learn_parm->eps : -learn_parm->eps));
+	nfree++;
       }
-      printf("Number of SV: %ld (including %ld at upper bound)\n",
-	     model->sv_num-1,upsupvecnum);
+    if(nfree > 0)
+      b/=nfree;
+    else
+      b=(lo+hi)/2;
+  }
+  model->b=-b;      /* svm-light subtracts the threshold */
+
+  for(k=0;k<totdoc;k++) {
+    model->index[k]=-1;
+    if(beta[k] != 0) {
+      model->supvec[model->sv_num]=docs[k];
+      model->alpha[model->sv_num]=beta[k];
+      model->index[k]=model->sv_num;
+      model->sv_num++;
+    }
+  }
+  if(verbosity>=1) {
+    if(verbosity==1) printf("done. (%ld iterations)\n",iterations);
+
+    printf("Optimization finished (maxdiff=%.5f).\n",maxdiff); 
+
+    runtime_end=get_runtime();
+    printf("Runtime in cpu-seconds: %.2f\n",
+	   (runtime_end-runtime_start)/100.0);
+
+    upsupvecnum=0;
+    for(k=0;k<totdoc;k++) {
+      if((beta[k] >= cup[k]-learn_parm->epsilon_a)
+	 || (beta[k] <= -clow[k]+learn_parm->epsilon_a)) 
+	upsupvecnum++;
     }
+    printf("Number of SV: %ld (including %ld at upper bound)\n",
+	   model->sv_num-1,upsupvecnum);
     
     if((verbosity>=1) && (!learn_parm->skip_final_opt_check)) {
       loss=0;
       model_length=0; 
-      for(i=0;i<totdoc;i++) {
-	if((lin[i]-model->b)*(double)label[i] < (-learn_parm->eps+(double)label[i]*c[i])-learn_parm->epsilon_crit)
-	  loss+=-learn_parm->eps+(double)label[i]*c[i]-(lin[i]-model->b)*(double)label[i];
-	model_length+=a[i]*label[i]*lin[i];
+      for(k=0;k<totdoc;k++) {
+	/* the prediction is grad+value+b */
+	t=fabs(grad[k]+b)-learn_parm->eps;
+	if(t > learn_parm->epsilon_crit)
+	  loss+=t;
+	model_length+=beta[k]*(grad[k]+value[k]);
       }
       model_length=sqrt(model_length);
       fprintf(stdout,"L1 loss: loss=%.5f\n",loss);
@@ -687,32 +791,101 @@ void svm_learn_regression(DOC **docs, double *value, long int totdoc,
     }
   }
     
-  if(learn_parm->alphafile[0])
-    write_alphas(learn_parm->alphafile,a,label,totdoc);
+  if(learn_parm->alphafile[0]) 
+    write_alphas(learn_parm->alphafile,beta,isactive,totdoc);
+
+  free(beta);
+  free(grad);
+  free(cup);
+  free(clow);
+  free(kdiag);
+  free(dup);
+  free(ddown);
+  free(ki);
+  free(kj);
+  free(active2dnum);
+  free(isactive);
+}
+
+void regression_unshrink(KERNEL_CACHE *kernel_cache, DOC **docs, 
+			 double *value, double *beta, long int totdoc, 
+			 long int *active2dnum, long int *isactive, 
+			 CFLOAT *buffer, double *grad, 
+			 KERNEL_PARM *kernel_parm)
+     /* Recomputes the gradient of the examples removed by shrinking
+	(isactive[i]==0), whose kernel rows haven't been used since,
+	and makes all examples active again. */
+{
+  long i,j,k,num=0;
+  long *inactive2dnum;
 
-  /* this makes sure the model we return does not contain pointers to the 
-     temporary documents */
-  for(i=1;i<model->sv_num;i++) { 
-    j=model->supvec[i]->docnum;
-    if(j >= (totdoc/2)) {
-      j=totdoc-j-1;
+  inactive2dnum=(long *)my_malloc(sizeof(long)*(totdoc+1));
+  for(i=0;i<totdoc;i++)
+    if(!isactive[i]) {
+      inactive2dnum[num++]=i;
+      grad[i]=-value[i];
     }
-    model->supvec[i]=docs_org[j];
+  inactive2dnum[num]=-1;
+  if(verbosity>=2) {
+    printf(" Reactivating %ld examples\n",num); fflush(stdout);
   }
-  
-  shrink_state_cleanup(&shrink_state);
-  for(i=0;i<totdoc;i++)
-    free_example(docs[i],0);
-  free(docs);
-  free(label);
-  free(inconsistent);
-  free(unlabeled);
-  free(c);
-  free(a);
-  free(a_fullset);
-  free(xi_fullset);
-  free(lin);
-  free(learn_parm->svm_cost);
+  for(j=0;j<totdoc;j++) 
+    if(beta[j] != 0) {
+      get_kernel_row(kernel_cache,docs,j,totdoc,inactive2dnum,buffer,
+		     kernel_parm);
+      for(k=0;(i=inactive2dnum[k])>=0;k++)
+	grad[i]+=beta[j]*buffer[i];
+    }
+  for(i=0;i<totdoc;i++) {
+    active2dnum[i]=i;
+    isactive[i]=1;
+  }
+  active2dnum[totdoc]=-1;
+  free(inactive2dnum);
+}
+
+double regression_step(double eta, double dg, double bi, double bj, 
+		       long pair, double tlow, double thigh, double eps)
+     /* The step t in [tlow,thigh] that minimizes 1/2 eta t^2 + dg t +
+	eps (|bi+t| + |bj-t|), or without the bj term if pair is 0. The
+	function is convex and quadratic between the breaks at -bi and
+	bj, so its minimum is at a break, a bound, or the stationary
+	point of one of the pieces. */
+{
+  double cand[8],t,f,best,bestt;
+  long n=0,k,si,sj;
+
+  cand[n++]=tlow;
+  cand[n++]=thigh;
+  cand[n++]=-bi;
+  if(pair)
+    cand[n++]=bj;
+  for(si=-1;si<=1;si+=2)
+    for(sj=(pair ? -1 : 0);sj<=(pair ? 1 : 0);sj+=2)
+      cand[n++]=-(dg+eps*(si-sj))/eta;
+  bestt=0;
+  best=(pair ? eps*(fabs(bi)+fabs(bj)) : eps*fabs(bi));
+  for(k=0;k<n;k++) {
+    t=MIN(MAX(cand[k],tlow),thigh);
+    f=0.5*eta*t*t+dg*t+eps*fabs(bi+t);
+    if(pair)
+      f+=eps*fabs(bj-t);
+    if(f < best) {
+      best=f;
+      bestt=t;
+    }
+  }
+  return(bestt);
+}
+
+double regression_clip(double a, double low, double up, double epsilon_a)
+     /* a on its bounds, if it is within epsilon_a of them */
+{
+  if(a >= up-epsilon_a)
+    return(up);
+  if(a <= low+epsilon_a)
+    return(low);
+  return(a);
 }
 
 void svm_learn_ranking(DOC **docs, double *rankvalue, long int totdoc, 
@@ -1284,6 +1457,16 @@ long optimize_to_convergence(DOC **docs, long int *label, long int totdoc,
   qp.opt_xinit = (double *)my_malloc(sizeof(double)*learn_parm->svm_maxqpsize);
   qp.opt_low=(double *)my_malloc(sizeof(double)*learn_parm->svm_maxqpsize);
   qp.opt_up=(double *)my_malloc(sizeof(double)*learn_parm->svm_maxqpsize);
+  qp.opt_k=(double *)my_malloc(sizeof(double)*learn_parm->svm_maxqpsize
+				*learn_parm->svm_maxqpsize);
+  qp.opt_kold=(double *)my_malloc(sizeof(double)*learn_parm->svm_maxqpsize
+				   *learn_parm->svm_maxqpsize);
+  qp.opt_kkey=(long *)my_malloc(sizeof(long)*learn_parm->svm_maxqpsize);
+  qp.opt_kn=0;
+  qp.opt_kpos=(long *)my_malloc(sizeof(long)*totdoc);
+  for(i=0;i<totdoc;i++) qp.opt_kpos[i]=-1;
+  qp.opt_ktodo=(long *)my_malloc(sizeof(long)*learn_parm->svm_maxqpsize
+				 *learn_parm->svm_maxqpsize);
   if(kernel_parm->kernel_type == LINEAR) {
     weights=create_nvector(totwords);
     clear_nvector(weights,totwords); /* set weights to zero */
@@ -1445,7 +1628,7 @@ long optimize_to_convergence(DOC **docs, long int *label, long int totdoc,
     if(retrain != 2) {
       optimize_svm(docs,label,unlabeled,inconsistent,0.0,chosen,active2dnum,
 		   model,totdoc,working2dnum,choosenum,a,lin,c,learn_parm,
-		   aicache,kernel_parm,&qp,&epsilon_crit_org);
+		   aicache,kernel_parm,kernel_cache,&qp,&epsilon_crit_org);
     }
 
     if(verbosity>=2) t3=get_runtime();
@@ -1648,6 +1831,11 @@ long optimize_to_convergence(DOC **docs, long int *label, long int totdoc,
   free(qp.opt_xinit);
   free(qp.opt_low);
   free(qp.opt_up);
+  free(qp.opt_k);
+  free(qp.opt_kold);
+  free(qp.opt_kkey);
+  free(qp.opt_kpos);
+  free(qp.opt_ktodo);
   if(weights) free(weights);
 
   learn_parm->epsilon_crit=epsilon_crit_org; /* restore org */
@@ -1729,6 +1917,16 @@ long optimize_to_convergence_sharedslack(DOC **docs, long int *label,
   qp.opt_xinit = (double *)my_malloc(sizeof(double)*learn_parm->svm_maxqpsize);
   qp.opt_low=(double *)my_malloc(sizeof(double)*learn_parm->svm_maxqpsize);
   qp.opt_up=(double *)my_malloc(sizeof(double)*learn_parm->svm_maxqpsize);
+  qp.opt_k=(double *)my_malloc(sizeof(double)*learn_parm->svm_maxqpsize
+				*learn_parm->svm_maxqpsize);
+  qp.opt_kold=(double *)my_malloc(sizeof(double)*learn_parm->svm_maxqpsize
+				   *learn_parm->svm_maxqpsize);
+  qp.opt_kkey=(long *)my_malloc(sizeof(long)*learn_parm->svm_maxqpsize);
+  qp.opt_kn=0;
+  qp.opt_kpos=(long *)my_malloc(sizeof(long)*totdoc);
+  for(i=0;i<totdoc;i++) qp.opt_kpos[i]=-1;
+  qp.opt_ktodo=(long *)my_malloc(sizeof(long)*learn_parm->svm_maxqpsize
+				 *learn_parm->svm_maxqpsize);
   if(kernel_parm->kernel_type == LINEAR) {
     weights=create_nvector(totwords);
     clear_nvector(weights,totwords); /* set weights to zero */
@@ -1903,7 +2101,7 @@ long optimize_to_convergence_sharedslack(DOC **docs, long int *label,
     if(jointstep) learn_parm->biased_hyperplane=1;
     optimize_svm(docs,label,unlabeled,ignore,eq_target,chosen,active2dnum,
 		 model,totdoc,working2dnum,choosenum,a,lin,c,learn_parm,
-		 aicache,kernel_parm,&qp,&epsilon_crit_org);
+		 aicache,kernel_parm,kernel_cache,&qp,&epsilon_crit_org);
     learn_parm->biased_hyperplane=0;
 
     for(jj=0;(i=working2dnum[jj])>=0;jj++)   /* recompute sums of alphas */
@@ -2093,6 +2291,11 @@ long optimize_to_convergence_sharedslack(DOC **docs, long int *label,
   free(qp.opt_xinit);
   free(qp.opt_low);
   free(qp.opt_up);
+  free(qp.opt_k);
+  free(qp.opt_kold);
+  free(qp.opt_kkey);
+  free(qp.opt_kpos);
+  free(qp.opt_ktodo);
   if(weights) free(weights);
 
   learn_parm->epsilon_crit=epsilon_crit_org; /* restore org */
@@ -2158,7 +2361,8 @@ void optimize_svm(DOC **docs, long int *label, long int *unlabeled,
 		  long int *chosen, long int *active2dnum, MODEL *model, 
 		  long int totdoc, long int *working2dnum, long int varnum, 
 		  double *a, double *lin, double *c, LEARN_PARM *learn_parm, 
-		  CFLOAT *aicache, KERNEL_PARM *kernel_parm, QP *qp, 
+		  CFLOAT *aicache, KERNEL_PARM *kernel_parm, 
+		  KERNEL_CACHE *kernel_cache, QP *qp, 
 		  double *epsilon_crit_target)
      /* Do optimization on the working set. */
 {
@@ -2169,7 +2373,7 @@ void optimize_svm(DOC **docs, long int *label, long int *unlabeled,
 				      exclude_from_eq_const,eq_target,chosen,
 				      active2dnum,working2dnum,model,a,lin,c,
 				      varnum,totdoc,learn_parm,aicache,
-				      kernel_parm,qp);
+				      kernel_parm,kernel_cache,qp);
 
     if(verbosity>=3) {
       printf("Running optimizer..."); fflush(stdout);
@@ -2203,10 +2407,12 @@ void compute_matrices_for_optimization(DOC **docs, long int *label,
 	  long int *chosen, long int *active2dnum, 
           long int *key, MODEL *model, double *a, double *lin, double *c, 
 	  long int varnum, long int totdoc, LEARN_PARM *learn_parm, 
-          CFLOAT *aicache, KERNEL_PARM *kernel_parm, QP *qp)
+          CFLOAT *aicache, KERNEL_PARM *kernel_parm, 
+	  KERNEL_CACHE *kernel_cache, QP *qp)
 {
   register long ki,kj,i,j;
   register double kernel_temp;
+  double *k;
 
   if(verbosity>=3) {
     fprintf(stdout,"Computing qp-matrices (type %ld kernel [degree %ld, rbf_gamma %f, coef_lin %f, coef_const %f])...",kernel_parm->kernel_type,kernel_parm->poly_degree,kernel_parm->rbf_gamma,kernel_parm->coef_lin,kernel_parm->coef_const); 
@@ -2231,6 +2437,8 @@ void compute_matrices_for_optimization(DOC **docs, long int *label,
     qp->opt_g0[i]=lin[key[i]];
   }
 
+  k=get_qp_kernel_matrix(docs,key,varnum,kernel_parm,kernel_cache,qp);
+
   for(i=0;i<varnum;i++) {
     ki=key[i];
 
@@ -2239,14 +2447,14 @@ void compute_matrices_for_optimization(DOC **docs, long int *label,
     qp->opt_low[i]=0;
     qp->opt_up[i]=learn_parm->svm_cost[ki];
 
-    kernel_temp=(double)kernel(kernel_parm,docs[ki],docs[ki]); 
+    kernel_temp=k[varnum*i+i]; 
     /* compute linear part of objective function */
     qp->opt_g0[i]-=(kernel_temp*a[ki]*(double)label[ki]); 
     /* compute quadratic part of objective function */
     qp->opt_g[varnum*i+i]=kernel_temp;
     for(j=i+1;j<varnum;j++) {
       kj=key[j];
-      kernel_temp=(double)kernel(kernel_parm,docs[ki],docs[kj]);
+      kernel_temp=k[varnum*i+j];
       /* compute linear part of objective function */
       qp->opt_g0[i]-=(kernel_temp*a[kj]*(double)label[kj]);
       qp->opt_g0[j]-=(kernel_temp*a[ki]*(double)label[ki]); 
@@ -2274,6 +2482,190 @@ void compute_matrices_for_optimization(DOC **docs, long int *label,
   }
 }
 
+double *get_qp_kernel_matrix(DOC **docs, long int *key, long int varnum,
+			     KERNEL_PARM *kernel_parm, 
+			     KERNEL_CACHE *kernel_cache, QP *qp)
+     /* Returns the kernel values between the docs in key as the upper
+	triangle of a varnum x varnum matrix. Entries between docs that
+	were in the last QP are taken from its matrix, then from the
+	kernel cache, and the rest are computed in one batch. The matrix
+	is kept for the next call. */
+{
+  register long i,j,ki,kj,pi,pj;
+  long todonum,*pos=qp->opt_kpos;
+  double *k=qp->opt_k;
+
+  todonum=0;
+  for(i=0;i<varnum;i++) {
+    ki=key[i];
+    pi=pos[ki];
+    for(j=i;j<varnum;j++) {
+      kj=key[j];
+      pj=pos[kj];
+      if((pi>=0) && (pj>=0)) 
+	k[varnum*i+j]=qp->opt_kold[qp->opt_kn*MIN(pi,pj)+MAX(pi,pj)];
+      else if(kernel_cache && (kernel_cache->index[ki] != -1)
+	      && (kernel_cache->totdoc2active[kj] >= 0))
+	k[varnum*i+j]=kernel_cache->buffer[kernel_cache->activenum
+					   *kernel_cache->index[ki]
+					   +kernel_cache->totdoc2active[kj]];
+      else if(kernel_cache && (kernel_cache->index[kj] != -1)
+	      && (kernel_cache->totdoc2active[ki] >= 0))
+	k[varnum*i+j]=kernel_cache->buffer[kernel_cache->activenum
+					   *kernel_cache->index[kj]
+					   +kernel_cache->totdoc2active[ki]];
+      else
+	qp->opt_ktodo[todonum++]=varnum*i+j;
+    }
+  }
+  if(todonum)
+    compute_qp_kernel_entries(docs,key,varnum,kernel_parm,k,
+			      qp->opt_ktodo,todonum);
+
+  for(i=0;i<qp->opt_kn;i++)    /* remember this QP for the next */
+    pos[qp->opt_kkey[i]]=-1;
+  for(i=0;i<varnum;i++) {
+    qp->opt_kkey[i]=key[i];
+    pos[key[i]]=i;
+  }
+  qp->opt_kn=varnum;
+  qp->opt_k=qp->opt_kold;
+  qp->opt_kold=k;
+  return(k);
+}
+
+
+typedef struct qp_kernel_job {
+  DOC    **docs;
+  long   *key,varnum;
+  KERNEL_PARM *kernel_parm;
+  double *k;
+  long   *todo;
+  long   from,to;     /* the entries todo[from..to-1] */
+  long   maxwnum;     /* largest feature number in the docs (linear) */
+  long   evals;       /* kernel evaluations done */
+} QP_KERNEL_JOB;
+
+void *compute_qp_kernel_job(void *job)
+     /* For the linear kernel, each row's doc is spread into a dense
+	vector once, and its products with the other docs of the row are
+	read off with one pass over their features. The sums are taken
+	in the same order as in kernel(), so the values are the same. */
+{
+  QP_KERNEL_JOB *p=(QP_KERNEL_JOB *)job;
+  register long e,t,i,j;
+  register WORD *w;
+  register CFLOAT dot;
+  long end;
+  SVECTOR *fa,*fb;
+  CFLOAT *dense;
+
+  p->evals=0;
+  if(p->kernel_parm->kernel_type != LINEAR) {
+    for(e=p->from;e<p->to;e++) {
+      i=p->todo[e]/p->varnum;
+      j=p->todo[e]%p->varnum;
+      p->k[p->todo[e]]=(double)kernel(p->kernel_parm,p->docs[p->key[i]],
+				      p->docs[p->key[j]]);
+      for(fa=p->docs[p->key[i]]->fvec;fa;fa=fa->next) 
+	for(fb=p->docs[p->key[j]]->fvec;fb;fb=fb->next) 
+	  if((fa->kernel_id == fb->kernel_id) 
+	     && (p->kernel_parm->kernel_type != GRAM))
+	    p->evals++;
+    }
+    return(NULL);
+  }
+
+  dense=(CFLOAT *)calloc(p->maxwnum+1,sizeof(CFLOAT));
+  if(!dense) { 
+    perror ("Out of memory!\n"); 
+    exit (1); 
+  }
+  for(e=p->from;e<p->to;e=end) {
+    i=p->todo[e]/p->varnum;
+    for(end=e;(end<p->to) && (p->todo[end]/p->varnum == i);end++)
+      p->k[p->todo[end]]=0;
+    for(fa=p->docs[p->key[i]]->fvec;fa;fa=fa->next) {
+      for(w=fa->words;w->wnum;w++)
+	dense[w->wnum]=(CFLOAT)(w->weight);
+      for(t=e;t<end;t++) {
+	j=p->todo[t]%p->varnum;
+	for(fb=p->docs[p->key[j]]->fvec;fb;fb=fb->next) {
+	  if(fa->kernel_id == fb->kernel_id) {
+	    dot=0;
+	    for(w=fb->words;w->wnum;w++)
+	      dot+=dense[w->wnum]*(CFLOAT)(w->weight);
+	    p->k[p->todo[t]]+=fa->factor*fb->factor*(double)dot;
+	    p->evals++;
+	  }
+	}
+      }
+      for(w=fa->words;w->wnum;w++)
+	dense[w->wnum]=0;
+    }
+    for(t=e;t<end;t++) 
+      p->k[p->todo[t]]=(double)((CFLOAT)p->k[p->todo[t]]);
+  }
+  free(dense);
+  return(NULL);
+}
+
+void compute_qp_kernel_entries(DOC **docs, long int *key, long int varnum,
+			       KERNEL_PARM *kernel_parm, double *k,
+			       long int *todo, long int todonum)
+     /* Sets k[todo[e]]=kernel(docs[key[i]],docs[key[j]]) for the
+	todonum entries todo[e]=varnum*i+j, split over the processors
+	if there are enough of them (large -q). */
+{
+  QP_KERNEL_JOB job[QP_MAX_THREADS];
+  pthread_t thread[QP_MAX_THREADS];
+  int       started[QP_MAX_THREADS];
+  long      t,i,numthreads,maxwnum=0,statistic;
+  SVECTOR   *f;
+  WORD      *w;
+
+  numthreads=MIN(sysconf(_SC_NPROCESSORS_ONLN),QP_MAX_THREADS);
+  numthreads=MIN(numthreads,todonum/QP_MIN_PER_THREAD);
+  if((numthreads < 1) || (kernel_parm->kernel_type == CUSTOM))
+    numthreads=1;
+  for(i=0;i<varnum;i++) {
+    for(f=docs[key[i]]->fvec;f;f=f->next) {
+      if(kernel_parm->kernel_type == LINEAR) {
+	for(w=f->words;w->wnum;w++)
+	  maxwnum=MAX(maxwnum,w->wnum);
+      }
+      else if((kernel_parm->kernel_type == RBF) && (numthreads > 1)
+	      && (f->twonorm_sq < 0))  /* so the threads only read */
+	f->twonorm_sq=sprod_ss(f,f);
+    }
+  }
+  statistic=kernel_cache_statistic;
+  for(t=0;t<numthreads;t++) {
+    job[t].docs=docs;
+    job[t].key=key;
+    job[t].varnum=varnum;
+    job[t].kernel_parm=kernel_parm;
+    job[t].k=k;
+    job[t].todo=todo;
+    job[t].from=(todonum*t)/numthreads;
+    job[t].to=(todonum*(t+1))/numthreads;
+    job[t].maxwnum=maxwnum;
+    started[t]=0;
+  }
+  for(t=1;t<numthreads;t++) 
+    started[t]=(pthread_create(&thread[t],NULL,compute_qp_kernel_job,
+			       &job[t]) == 0);
+  for(t=0;t<numthreads;t++) 
+    if(!started[t])  /* the first part, and any without a thread */
+      compute_qp_kernel_job(&job[t]);
+  for(t=1;t<numthreads;t++) 
+    if(started[t])
+      pthread_join(thread[t],NULL);
+  for(t=0;t<numthreads;t++)   /* kernel() counts unsafely in threads */
+    statistic+=job[t].evals;
+  kernel_cache_statistic=statistic;
+}
+
 long calculate_svm_model(DOC **docs, long int *label, long int *unlabeled, 
 			 double *lin, double *a, double *a_old, double *c, 
 			 LEARN_PARM *learn_parm, long int *working2dnum, 
@@ -2710,7 +3102,7 @@ long incorporate_unlabeled_examples(MODEL *model, long int *label,
   double loss;
   static double switchsens=0.0,switchsensorg=0.0;
   double umin,umax,sumalpha;
-  long imin=0,imax=0;
+  long imin=0,imax=0,nswitch,*switchpos;
   static long switchnum=0;
 
   switchsens/=1.2;
@@ -2928,6 +3320,55 @@ long incorporate_unlabeled_examples(MODEL *model, long int *label,
     umin=99999;
     umax=-99999;
     j4=1;
+    if(learn_parm->transduction_switches > 1) {
+      /* multi-switch: pair the positives closest to the negative side
+	 with the negatives closest to the positive side, in that order,
+	 and switch every pair that the single switch below would switch
+	 (the pairs violate less and less, so stop at the first that
+	 doesn't); each switch keeps the number of positives */
+      switchpos=(long *)my_malloc(sizeof(long)*(learn_parm->transduction_switches+1));
+      j3=0;
+      for(i=0;i<totdoc;i++) {
+	if((label[i]>0) && (unlabeled[i]) && (!inconsistent[i])) {
+	  selcrit[j3]=-(lin[i]-model->b);
+	  key[j3]=i;
+	  j3++;
+	}
+      }
+      nswitch=MIN(j3,learn_parm->transduction_switches);
+      select_top_n(selcrit,j3,select,nswitch);
+      for(k=0;k<nswitch;k++) 
+	switchpos[k]=key[select[k]];
+      j3=0;
+      for(i=0;i<totdoc;i++) {
+	if((label[i]<0) && (unlabeled[i]) && (!inconsistent[i])) {
+	  selcrit[j3]=lin[i]-model->b;
+	  key[j3]=i;
+	  j3++;
+	}
+      }
+      nswitch=MIN(j3,nswitch);
+      select_top_n(selcrit,j3,select,nswitch);
+      for(k=0;k<nswitch;k++) {
+	imin=switchpos[k];
+	imax=key[select[k]];
+	if((lin[imin]-model->b) < (lin[imax]-model->b)+switchsens-1E-4) {
+	  j1++;
+	  j2++;
+	  unsupaddnum1++;	
+	  unlabeled[imin]=3;
+	  inconsistent[imin]=1;
+	  unsupaddnum2++;	
+	  unlabeled[imax]=2;
+	  inconsistent[imax]=1;
+	}
+	else
+	  break;
+      }
+      free(switchpos);
+      j3=0;
+      j4=0;
+    }
     while(j4) {
       umin=99999;
       umax=-99999;
@@ -2992,7 +3433,7 @@ long incorporate_unlabeled_examples(MODEL *model, long int *label,
 	return((long)0);
       }
       switchsens=switchsensorg;
-      learn_parm->svm_unlabbound*=1.5;
+      learn_parm->svm_unlabbound*=learn_parm->transduction_annealing;
       if(learn_parm->svm_unlabbound>1) {
 	learn_parm->svm_unlabbound=1;
       }
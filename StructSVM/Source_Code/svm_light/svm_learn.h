@@ -19,11 +19,22 @@
 #ifndef SVM_LEARN
 #define SVM_LEARN
 
+/* the kernel values of a QP subproblem that are neither in the last 
+   subproblem nor in the kernel cache are computed with up to 
+   QP_MAX_THREADS threads, each getting at least QP_MIN_PER_THREAD */
+#define QP_MAX_THREADS     16
+#define QP_MIN_PER_THREAD  1024
+
 void   svm_learn_classification(DOC **, double *, long, long, LEARN_PARM *, 
 				KERNEL_PARM *, KERNEL_CACHE *, MODEL *,
 				double *);
 void   svm_learn_regression(DOC **, double *, long, long, LEARN_PARM *, 
 			    KERNEL_PARM *, KERNEL_CACHE **, MODEL *);
+void   regression_unshrink(KERNEL_CACHE *, DOC **, double *, double *, long,
+			   long *, long *, CFLOAT *, double *, KERNEL_PARM *);
+double regression_step(double, double, double, double, long, double, 
+		       double, double);
+double regression_clip(double, double, double, double);
 void   svm_learn_ranking(DOC **, double *, long, long, LEARN_PARM *, 
 			 KERNEL_PARM *, KERNEL_CACHE **, MODEL *);
 void   svm_learn_optimization(DOC **, double *, long, long, LEARN_PARM *, 
@@ -47,12 +58,18 @@ long   compute_index(long *,long, long *);
 void   optimize_svm(DOC **, long *, long *, long *, double, long *, long *, 
 		    MODEL *, 
 		    long, long *, long, double *, double *, double *, 
-		    LEARN_PARM *, CFLOAT *, KERNEL_PARM *, QP *, double *);
+		    LEARN_PARM *, CFLOAT *, KERNEL_PARM *, KERNEL_CACHE *,
+		    QP *, double *);
 void   compute_matrices_for_optimization(DOC **, long *, long *, long *, double,
 					 long *,
 					 long *, long *, MODEL *, double *, 
 					 double *, double *, long, long, LEARN_PARM *, 
-					 CFLOAT *, KERNEL_PARM *, QP *);
+					 CFLOAT *, KERNEL_PARM *, KERNEL_CACHE *,
+					 QP *);
+double *get_qp_kernel_matrix(DOC **, long *, long, KERNEL_PARM *, 
+			     KERNEL_CACHE *, QP *);
+void   compute_qp_kernel_entries(DOC **, long *, long, KERNEL_PARM *, 
+				 double *, long *, long);
 long   calculate_svm_model(DOC **, long *, long *, double *, double *, 
 			   double *, double *, LEARN_PARM *, long *,
 			   long *, MODEL *);
@@ -27,6 +27,8 @@
 char docfile[200];           /* file with training examples */
 char modelfile[200];         /* file for resulting classifier */
 char restartfile[200];       /* file with initial alphas */
+long expand_poly2=0;         /* train -t 1 -d 2 on the explicit map (-E) */
+long poly2_hash_bits=DEFAULT_POLY2_HASH_BITS; /* its pair features (-H) */
 
 void   read_input_parameters(int, char **, char *, char *, char *, long *, 
 			     LEARN_PARM *, KERNEL_PARM *);
@@ -38,8 +40,10 @@ void   print_help();
 int main (int argc, char* argv[])
 {  
   DOC **docs;  /* training examples */
-  long totwords,totdoc,i;
-  double *target;
+  DOC **expdocs=NULL; /* their explicit feature maps, if used */
+  long totwords,totdoc,i,expwords=0;
+  KERNEL_PARM kernel_parm_org;
+  double *target,r_delta_avg;
   double *alpha_in=NULL;
   KERNEL_CACHE *kernel_cache;
   LEARN_PARM learn_parm;
@@ -51,6 +55,58 @@ int main (int argc, char* argv[])
   read_documents(docfile,&docs,&target,&totwords,&totdoc);
   if(restartfile[0]) alpha_in=read_alphas(restartfile,totdoc);
 
+  if(expand_poly2) {
+    /* the dot products of the maps are the kernel values, so the linear
+       solver finds the dual solution of the kernel problem; the model
+       gets the original examples and kernel back before it's written */
+    expwords=poly2_expanded_totwords(&kernel_parm,totwords,poly2_hash_bits);
+    if((learn_parm.type != CLASSIFICATION) 
+       && (learn_parm.type != REGRESSION)) 
+      expwords=0;
+    for(i=0;expwords && (i<totdoc);i++) 
+      if(docs[i]->fvec->next) 
+	expwords=0;
+    if(!expwords) {
+      printf("\nWARNING: Not using the explicit feature map (-E); it needs -t 1 -d 2 with\n");
+      printf("s*r>=0, classification or regression, and -H in 1..%d. Training with the\n",
+	     MAXPOLY2HASHBITS);
+      printf("kernel instead.\n\n");
+    }
+    else if(poly2_hashed(totwords,poly2_hash_bits)) {
+      printf("\nWARNING: The %.0f pairs of features are hashed into 2^%ld pair features\n",
+	     (double)totwords*((double)totwords+1.0)/2.0,poly2_hash_bits);
+      printf("(-H). Training approximates the kernel; a larger -H makes collisions rarer.\n\n");
+    }
+  }
+  if(expwords) {
+    if(verbosity>=1) {
+      printf("Expanding the examples into %ld polynomial features...",
+	     expwords); fflush(stdout);
+    }
+    expdocs=(DOC **)my_malloc(sizeof(DOC *)*totdoc);
+    for(i=0;i<totdoc;i++) 
+      expdocs[i]=create_example(i,docs[i]->queryid,docs[i]->slackid,
+				docs[i]->costfactor,
+				expand_poly2_svector(docs[i]->fvec,
+						     &kernel_parm,totwords,
+						     poly2_hash_bits));
+    if(verbosity>=1) {
+      printf("done\n"); fflush(stdout);
+    }
+    /* the learners set the default C from the distances to the zero
+       example under the kernel; the map of the zero example isn't the
+       zero vector for r != 0, so take them on the original examples */
+    if(learn_parm.svm_c == 0.0) {
+      r_delta_avg=estimate_r_delta_average(docs,totdoc,&kernel_parm);
+      learn_parm.svm_c=1.0/(r_delta_avg*r_delta_avg);
+      if(verbosity>=1) 
+	printf("Setting default regularization parameter C=%.4f\n",
+	       learn_parm.svm_c);
+    }
+    kernel_parm_org=kernel_parm;
+    kernel_parm.kernel_type=LINEAR;
+  }
+
   if(kernel_parm.kernel_type == LINEAR) { /* don't need the cache */
     kernel_cache=NULL;
   }
@@ -60,7 +116,20 @@ int main (int argc, char* argv[])
     kernel_cache=kernel_cache_init(totdoc,learn_parm.kernel_cache_size);
   }
 
-  if(learn_parm.type == CLASSIFICATION) {
+  if(expwords) {
+    if(learn_parm.type == CLASSIFICATION) 
+      svm_learn_classification(expdocs,target,totdoc,expwords,&learn_parm,
+			       &kernel_parm,kernel_cache,model,alpha_in);
+    else
+      svm_learn_regression(expdocs,target,totdoc,expwords,&learn_parm,
+			   &kernel_parm,&kernel_cache,model);
+    for(i=1;i<model->sv_num;i++) 
+      model->supvec[i]=docs[model->supvec[i]->docnum];
+    model->kernel_parm=kernel_parm_org;
+    model->totwords=totwords;
+    kernel_parm=kernel_parm_org;
+  }
+  else if(learn_parm.type == CLASSIFICATION) {
     svm_learn_classification(docs,target,totdoc,totwords,&learn_parm,
 			     &kernel_parm,kernel_cache,model,alpha_in);
   }
@@ -93,6 +162,11 @@ int main (int argc, char* argv[])
   for(i=0;i<totdoc;i++) 
     free_example(docs[i],1);
   free(docs);
+  if(expdocs) {
+    for(i=0;i<totdoc;i++) 
+      free_example(expdocs[i],1);
+    free(expdocs);
+  }
   free(target);
 
   return(0);
@@ -131,6 +205,10 @@ void read_input_parameters(int argc,char *argv[],char *docfile,char *modelfile,
       case 'c': i++; learn_parm->svm_c=atof(argv[i]); break;
       case 'w': i++; learn_parm->eps=atof(argv[i]); break;
       case 'p': i++; learn_parm->transduction_posratio=atof(argv[i]); break;
+      case 'S': i++; learn_parm->transduction_switches=atol(argv[i]); break;
+      case 'U': i++; learn_parm->transduction_annealing=atof(argv[i]); break;
+      case 'E': i++; expand_poly2=atol(argv[i]); break;
+      case 'H': i++; poly2_hash_bits=atol(argv[i]); break;
       case 'j': i++; learn_parm->svm_costratio=atof(argv[i]); break;
       case 'e': i++; learn_parm->epsilon_crit=atof(argv[i]); break;
       case 'o': i++; learn_parm->rho=atof(argv[i]); break;
@@ -238,6 +316,12 @@ void print_help()
   printf("         -p [0..1]   -> fraction of unlabeled examples to be classified\n");
   printf("                        into the positive class (default is the ratio of\n");
   printf("                        positive and negative examples in the training data)\n");
+  printf("         -S [1..]    -> maximum number of label pairs of unlabeled examples\n");
+  printf("                        switched per round; each round switches the pairs\n");
+  printf("                        that most violate the current labeling (default 1)\n");
+  printf("         -U ]1..]    -> factor by which the cost of unlabeled examples grows\n");
+  printf("                        when no more labels switch (default 1.5; with -S,\n");
+  printf("                        larger steps such as 3 or 5 are fine)\n");
   printf("Kernel options:\n");
   printf("         -t int      -> type of kernel function:\n");
   printf("                        0: linear (default)\n");
@@ -250,6 +334,15 @@ void print_help()
   printf("         -s float    -> parameter s in sigmoid/poly kernel\n");
   printf("         -r float    -> parameter c in sigmoid/poly kernel\n");
   printf("         -u string   -> parameter of user defined kernel\n");
+  printf("         -E [0,1]    -> for -t 1 -d 2, train with the linear solver on the\n");
+  printf("                        explicit feature map of the kernel (all products of\n");
+  printf("                        two features); faster for sparse data with few\n");
+  printf("                        distinct features. Same model as without (default 0)\n");
+  printf("         -H [1..%d]  -> with -E, at most 2^H features for the products of\n",
+	 MAXPOLY2HASHBITS);
+  printf("                        two features; if there are more pairs, they are\n");
+  printf("                        hashed into them and the kernel is approximated\n");
+  printf("                        (default %d)\n",DEFAULT_POLY2_HASH_BITS);
   printf("Optimization options (see [1]):\n");
   printf("         -q [2..]    -> maximum size of QP-subproblems (default 10)\n");
   printf("         -n [2..q]   -> number of new variables entering the working set\n");
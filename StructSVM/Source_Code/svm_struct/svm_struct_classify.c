@@ -29,6 +29,7 @@ extern "C" {
 char testfile[200];
 char modelfile[200];
 char predictionsfile[200];
+long hardware_counters=0;      /* count cycles, cache misses... */
 
 void read_input_parameters(int, char **, char *, char *, char *, long *);
 void print_help(void);
@@ -60,9 +61,11 @@ int main (int argc, char* argv[])
     fprintf(stdout, "done.\n");
   }
 
-  if(model.svm_model->kernel_parm.kernel_type == LINEAR) { /* linear kernel */
+  if((model.svm_model->kernel_parm.kernel_type == LINEAR) /* linear kernel */
+     && (!model.svm_model->lin_weights)) { /* not read with the model */
     /* compute weight vector */
     add_weight_vector_to_linear_model(model.svm_model);
+    free(model.w); /* the copy read_struct_model() read */
     model.w=model.svm_model->lin_weights;
   }
   
@@ -81,9 +84,14 @@ int main (int argc, char* argv[])
   if ((predfl = fopen (predictionsfile, "w")) == NULL)
   { perror (predictionsfile); exit (1); }
 
+  if(hardware_counters)
+    perf_counters_open();
+
   for(i=0;i<testsample.n;i++) {
     t1=get_runtime();
+    perf_counters_start(PERF_CLASSIFY);
     y=classify_struct_example(testsample.examples[i].x,&model,&sparm);
+    perf_counters_stop(PERF_CLASSIFY);
     runtime+=(get_runtime()-t1);
 
     write_label(predfl,y);
@@ -114,9 +122,11 @@ int main (int argc, char* argv[])
   }
   if((!no_accuracy) && (verbosity>=1)) {
     printf("Average loss on test set: %.4f\n",(float)avgloss);
-    printf("Zero/one-error on test set: %.2f%% (%ld correct, %ld incorrect, %d total)\n",(float)100.0*incorrect/testsample.n,correct,incorrect,testsample.n);
+    printf("Zero/one-error on test set: %.2f%% (%ld correct, %ld incorrect, %ld total)\n",(float)100.0*incorrect/testsample.n,correct,incorrect,testsample.n);
   }
   print_struct_testing_stats(testsample,&model,&sparm,&teststats);
+  perf_counters_print(stdout);
+  perf_counters_close();
   free_struct_sample(testsample);
   free_struct_model(model);
 
@@ -141,6 +151,7 @@ void read_input_parameters(int argc, char **argv, char *testfile,
       { 
       case 'h': print_help(); exit(0);
       case 'v': i++; (*verbosity)=atol(argv[i]); break;
+      case 'x': i++; hardware_counters=atol(argv[i]); break;
       case '-': parse_struct_parameters_classify(argv[i],argv[i+1]);i++; break;
       default: printf("\nUnrecognized option %s!\n\n",argv[i]);
 	       print_help();
@@ -167,7 +178,10 @@ void print_help(void)
   copyright_notice();
   printf("   usage: svm_struct_classify [options] example_file model_file output_file\n\n");
   printf("options: -h         -> this help\n");
-  printf("         -v [0..3]  -> verbosity level (default 2)\n\n");
+  printf("         -v [0..3]  -> verbosity level (default 2)\n");
+  printf("         -x [0,1]   -> report hardware counters (cycles, instructions,\n");
+  printf("                       LLC misses, branch misses) for the classification\n");
+  printf("                       (Linux only; default 0)\n\n");
 
   print_struct_help_classify();
 }
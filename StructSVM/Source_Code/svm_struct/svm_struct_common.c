@@ -19,6 +19,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 #include "svm_struct_common.h"
 
@@ -43,7 +49,7 @@ void printWordArray(WORD* x)
   int i=0;
   for(;x[i].wnum!=0;i++)
     if(x[i].weight != 0)
-      printf(" %i:%.2f ",(int)x[i].wnum,x[i].weight);
+      printf(" %ld:%.2f ",(long)x[i].wnum,x[i].weight);
 }
 
 void printW(double *w, long sizePhi, long n,double C)
@@ -64,3 +70,131 @@ void printW(double *w, long sizePhi, long n,double C)
 }
 /**** end print methods ****/
 
+
+/**** hardware performance counters ****/
+
+/* Each counter is opened on its own and counts events in user space
+   for this process and the threads it starts (the kernel and margin
+   threads of the learners; their counts are added when they exit).
+   perf_counters_start() and perf_counters_stop() read the counters
+   around a phase and add the difference to it; the readings are
+   scaled by time enabled/time running in case the kernel multiplexes
+   the counters. Counters the machine doesn't have are left out. */
+
+static const char *perf_counter_name[PERF_NUM_COUNTERS]={
+  "cycles","instructions","LLC-misses","branch-misses"};
+static const char *perf_phase_name[PERF_NUM_PHASES]={
+  "init","argmax","psi","QP","kernel","classify"};
+static int    perf_fd[PERF_NUM_COUNTERS]={-1,-1,-1,-1};
+static int    perf_numopen=0;
+static double perf_begin[PERF_NUM_PHASES][PERF_NUM_COUNTERS];
+static double perf_count[PERF_NUM_PHASES][PERF_NUM_COUNTERS];
+static long   perf_calls[PERF_NUM_PHASES];
+
+int perf_counters_open(void)
+     /* opens the counters; returns how many could be opened. If
+	none, a note is printed and the other functions do nothing. */
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+  unsigned long long config[PERF_NUM_COUNTERS]={
+    PERF_COUNT_HW_CPU_CYCLES,PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,PERF_COUNT_HW_BRANCH_MISSES};
+  int i,error=0;
+
+  for(i=0;i<PERF_NUM_COUNTERS;i++) {
+    memset(&attr,0,sizeof(attr));
+    attr.size=sizeof(attr);
+    attr.type=PERF_TYPE_HARDWARE;
+    attr.config=config[i];
+    attr.inherit=1;
+    attr.exclude_kernel=1;
+    attr.exclude_hv=1;
+    attr.read_format=PERF_FORMAT_TOTAL_TIME_ENABLED
+                     |PERF_FORMAT_TOTAL_TIME_RUNNING;
+    perf_fd[i]=(int)syscall(__NR_perf_event_open,&attr,0,-1,-1,0);
+    if(perf_fd[i]<0) 
+      error=errno;
+    else
+      perf_numopen++;
+  }
+  memset(perf_count,0,sizeof(perf_count));
+  memset(perf_calls,0,sizeof(perf_calls));
+  if(perf_numopen == 0)
+    printf("Hardware counters are not available (%s); not counting.\n",
+	   strerror(error));
+  return(perf_numopen);
+#else
+  printf("Hardware counters need Linux perf_event_open(); not counting.\n");
+  return(0);
+#endif
+}
+
+static double perf_read(int i)
+     /* current (scaled) value of counter i */
+{
+#ifdef __linux__
+  unsigned long long r[3]; /* value, time enabled, time running */
+  if((perf_fd[i]<0) || (read(perf_fd[i],r,sizeof(r)) != sizeof(r)) 
+     || (r[2] == 0))
+    return(0);
+  return((double)r[0]*((double)r[1]/(double)r[2]));
+#else
+  return(0);
+#endif
+}
+
+void perf_counters_start(int phase)
+{
+  int i;
+  if(!perf_numopen) return;
+  for(i=0;i<PERF_NUM_COUNTERS;i++)
+    perf_begin[phase][i]=perf_read(i);
+}
+
+void perf_counters_stop(int phase)
+{
+  int i;
+  if(!perf_numopen) return;
+  for(i=0;i<PERF_NUM_COUNTERS;i++)
+    perf_count[phase][i]+=perf_read(i)-perf_begin[phase][i];
+  perf_calls[phase]++;
+}
+
+void perf_counters_print(FILE *out)
+     /* the counts of each phase that was entered, and instructions per
+	cycle; n/a for counters that couldn't be opened */
+{
+  int p,i;
+  if(!perf_numopen) return;
+  fprintf(out,"Hardware counters (user space):\n");
+  fprintf(out,"  %-9s","phase");
+  for(i=0;i<PERF_NUM_COUNTERS;i++)
+    fprintf(out," %15s",perf_counter_name[i]);
+  fprintf(out," %6s\n","IPC");
+  for(p=0;p<PERF_NUM_PHASES;p++) {
+    if(!perf_calls[p]) continue;
+    fprintf(out,"  %-9s",perf_phase_name[p]);
+    for(i=0;i<PERF_NUM_COUNTERS;i++)
+      if(perf_fd[i]>=0)
+	fprintf(out," %15.0f",perf_count[p][i]);
+      else
+	fprintf(out," %15s","n/a");
+    if((perf_fd[0]>=0) && (perf_fd[1]>=0) && (perf_count[p][0]>0))
+      fprintf(out," %6.2f\n",perf_count[p][1]/perf_count[p][0]);
+    else
+      fprintf(out," %6s\n","n/a");
+  }
+}
+
+void perf_counters_close(void)
+{
+  int i;
+  for(i=0;i<PERF_NUM_COUNTERS;i++) {
+#ifdef __linux__
+    if(perf_fd[i]>=0) close(perf_fd[i]);
+#endif
+    perf_fd[i]=-1;
+  }
+  perf_numopen=0;
+}
@@ -37,13 +37,15 @@ typedef struct example {  /* an example is a pair of pattern and label */
 } EXAMPLE;
 
 typedef struct sample { /* a sample is a set of examples */
-  int     n;            /* n is the total number of examples */
+  long    n;            /* n is the total number of examples */
   EXAMPLE *examples;
+  void    *mapping;     /* the dataset file the examples read from if they
+			   are out of core (freed with them), else NULL */
 } SAMPLE;
 
 typedef struct constset { /* a set of linear inequality constrains of
 			     for lhs[i]*w >= rhs[i] */
-  int     m;            /* m is the total number of constrains */
+  long    m;            /* m is the total number of constrains */
   DOC     **lhs;
   double  *rhs;
 } CONSTSET;
@@ -58,4 +60,24 @@ void printW(double *, long, long, double);
 
 extern long   struct_verbosity;              /* verbosity level (0-4) */
 
+/**** hardware performance counters (Linux perf_event_open) ****/
+/* the phases the counters are split into; the same as the rt_* timers
+   of the learners, and classify_struct_example() for classification */
+#define PERF_INIT       0
+#define PERF_ARGMAX     1
+#define PERF_PSI        2
+#define PERF_QP         3
+#define PERF_KERNEL     4
+#define PERF_CLASSIFY   5
+#define PERF_NUM_PHASES 6
+
+/* cycles, instructions, last level cache misses, branch misses */
+#define PERF_NUM_COUNTERS 4
+
+int  perf_counters_open(void);
+void perf_counters_start(int phase);
+void perf_counters_stop(int phase);
+void perf_counters_print(FILE *out);
+void perf_counters_close(void);
+
 #endif
@@ -22,6 +22,8 @@
 #include "svm_struct_common.h"
 #include "../svm_struct_api.h"
 #include <assert.h>
+#include <unistd.h>  /* sysconf() */
+#include <pthread.h>
 
 #define MAX(x,y)      ((x) < (y) ? (y) : (x))
 #define MIN(x,y)      ((x) > (y) ? (y) : (x))
@@ -30,17 +32,18 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 		      LEARN_PARM *lparm, KERNEL_PARM *kparm, 
 		      STRUCTMODEL *sm)
 {
-  int         i,j;
+  long        i,j;
   int         numIt=0;
   long        argmax_count=0;
   long        newconstraints=0, totconstraints=0, activenum=0; 
   int         opti_round, *opti, fullround;
   long        old_numConst=0;
-  double      epsilon,svmCnorm;
-  long        tolerance,new_precision=1;
+  double      epsilon,svmCnorm,epsilon_step=0.49999999999;
+  long        tolerance,new_precision=1,levelrounds=0;
   double      lossval,factor,dist;
   double      margin=0;
-  double      slack, *slacks, slacksum, ceps;
+  double      slack, slacksum, ceps=0;
+  double      *cmargin=NULL, *exslack;
   double      dualitygap,modellength,alphasum;
   long        sizePsi;
   double      *alpha=NULL;
@@ -61,6 +64,7 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
   double      rt1,rt2;
 
   rt1=get_runtime();
+  perf_counters_start(PERF_INIT);
 
   init_struct_model(sample,sm,sparm,lparm,kparm); 
   sizePsi=sm->sizePsi+1;          /* sm must contain size of psi on return */
@@ -92,6 +96,11 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
     printf("ERROR: Slack norm must be L1 or L2!"); fflush(stdout);
     exit(0);
   }
+  if(sparm->tron_solver && (sparm->slack_norm != 2)) {
+    printf("ERROR: The TRON solver is for the L2 slack norm only!"); 
+    fflush(stdout);
+    exit(0); 
+  }
 
 
   epsilon=100.0;                  /* start with low precision and
@@ -114,18 +123,33 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
   /* set initial model and slack variables*/
   svmModel=(MODEL *)my_malloc(sizeof(MODEL));
   lparm->epsilon_crit=epsilon;
-  if(kparm->kernel_type != LINEAR)
-    kcache=kernel_cache_init(MAX(cset.m,1),lparm->kernel_cache_size);
-  svm_learn_optimization(cset.lhs,cset.rhs,cset.m,sizePsi+n,
-			 lparm,kparm,kcache,svmModel,alpha);
-  if(kcache)
-    kernel_cache_cleanup(kcache);
-  add_weight_vector_to_linear_model(svmModel);
+  if(sparm->tron_solver)
+    svm_learn_struct_tron(cset.lhs,cset.rhs,cset.m,sizePsi,n,
+			  lparm->epsilon_crit,kparm,svmModel,alpha);
+  else {
+    if(kparm->kernel_type != LINEAR)
+      kcache=kernel_cache_init(MAX(cset.m,1),lparm->kernel_cache_size);
+    svm_learn_optimization(cset.lhs,cset.rhs,cset.m,sizePsi+n,
+			   lparm,kparm,kcache,svmModel,alpha);
+    if(kcache)
+      kernel_cache_cleanup(kcache);
+    add_weight_vector_to_linear_model(svmModel);
+  }
   sm->svm_model=svmModel;
   sm->w=svmModel->lin_weights; /* short cut to weight vector */
 
-  /* create a cache of the feature vectors for the correct labels */
-  if(USE_FYCACHE) {
+  /* index the working set by example: the margin of each constraint
+     under the current model, and from those the slack of each
+     example, so that checking an example doesn't scan the working
+     set */
+  exslack=(double *)my_malloc(sizeof(double)*(n+1));
+  update_slack_index(&cset,svmModel,sm->w,sizePsi,svmCnorm,sparm,n,
+		     &cmargin,exslack);
+
+  /* create a cache of the feature vectors for the correct labels
+     (unless the examples are out of core, where it would grow with
+     the corpus) */
+  if(USE_FYCACHE && (!sparm->outOfCore)) {
     fycache=(SVECTOR **)malloc(n*sizeof(SVECTOR *));
     for(i=0;i<n;i++) {
       fy=psi(ex[i].x,ex[i].y,sm,sparm);
@@ -138,6 +162,7 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
     }
   }
 
+  perf_counters_stop(PERF_INIT);
   rt_init+=MAX(get_runtime()-rt1,0);
   rt_total+=MAX(get_runtime()-rt1,0);
 
@@ -146,7 +171,19 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
   /*****************/
   do { /* iteratively increase precision */
 
-    epsilon=MAX(epsilon*0.49999999999,sparm->epsilon);
+    if(sparm->adaptive_precision && (numIt > 0)) {
+      /* the last full pass found no constraint violated by more than
+	 ceps, so skip the precisions above it; step down faster while
+	 the levels take a single full pass */
+      if(levelrounds <= 1)
+	epsilon_step=MAX(epsilon_step*0.5,0.125);
+      else
+	epsilon_step=0.49999999999;
+      epsilon=MAX(MIN(epsilon,ceps)*epsilon_step,sparm->epsilon);
+    }
+    else
+      epsilon=MAX(epsilon*0.49999999999,sparm->epsilon);
+    levelrounds=0;
     new_precision=1;
     if(epsilon == sparm->epsilon)   /* for final precision, find all SV */
       tolerance=0; 
@@ -170,6 +207,7 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	old_numConst=cset.m;
 	ceps=0;
 	fullround=(activenum == n);
+	if(fullround) levelrounds++;
 
 	for(i=0; i<n; i++) { /*** example loop ***/
 	  
@@ -179,6 +217,7 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	                                away, then see if it is necessary to 
 					add a new constraint */
 	    rt2=get_runtime();
+	    perf_counters_start(PERF_ARGMAX);
 	    argmax_count++;
 	    if(sparm->loss_type == SLACK_RESCALING) 
 	      ybar=find_most_violated_constraint_slackrescaling(ex[i].x,
@@ -188,6 +227,7 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	      ybar=find_most_violated_constraint_marginrescaling(ex[i].x,
 								 ex[i].y,sm,
 								 sparm);
+	    perf_counters_stop(PERF_ARGMAX);
 	    rt_viol+=MAX(get_runtime()-rt2,0);
 	    
 	    if(empty_label(ybar)) {
@@ -196,17 +236,19 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 		opti[i]=opti_round; 
 	      }
 	      if(struct_verbosity>=2)
-		printf("no-incorrect-found(%i) ",i);
+		printf("no-incorrect-found(%ld) ",i);
 	      continue;
 	    }
 	  
 	    /**** get psi(y)-psi(ybar) ****/
 	    rt2=get_runtime();
+	    perf_counters_start(PERF_PSI);
 	    if(fycache) 
 	      fy=copy_svector(fycache[i]);
 	    else
 	      fy=psi(ex[i].x,ex[i].y,sm,sparm);
 	    fybar=psi(ex[i].x,ybar,sm,sparm);
+	    perf_counters_stop(PERF_PSI);
 	    rt_psi+=MAX(get_runtime()-rt2,0);
 	    
 	    /**** scale feature vector and margin by loss ****/
@@ -227,18 +269,8 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	    append_svector_list(fy,fybar);/* append the two vector lists */
 	    doc=create_example(cset.m,0,i+1,1,fy);
 
-	    /**** compute slack for this example ****/
-	    slack=0;
-	    for(j=0;j<cset.m;j++) 
-	      if(cset.lhs[j]->slackid == i+1) {
-		if(sparm->slack_norm == 2) /* works only for linear kernel */
-		  slack=MAX(slack,cset.rhs[j]
-			          -(classify_example(svmModel,cset.lhs[j])
-				    -sm->w[sizePsi+i]/(sqrt(2*svmCnorm))));
-		else
-		  slack=MAX(slack,
-			   cset.rhs[j]-classify_example(svmModel,cset.lhs[j]));
-	      }
+	    /**** slack for this example ****/
+	    slack=exslack[i+1];
 	    
 	    /**** if `error' add constraint and recompute ****/
 	    dist=classify_example(svmModel,doc);
@@ -246,12 +278,12 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	    if(slack > (margin-dist+0.0001)) {
 	      printf("\nWARNING: Slack of most violated constraint is smaller than slack of working\n");
 	      printf("         set! There is probably a bug in 'find_most_violated_constraint_*'.\n");
-	      printf("Ex %d: slack=%f, newslack=%f\n",i,slack,margin-dist);
+	      printf("Ex %ld: slack=%f, newslack=%f\n",i,slack,margin-dist);
 	      /* exit(1); */
 	    }
 	    if((dist+slack)<(margin-epsilon)) { 
 	      if(struct_verbosity>=2)
-		{printf("(%i,eps=%.2f) ",i,margin-dist-slack); fflush(stdout);}
+		{printf("(%ld,eps=%.2f) ",i,margin-dist-slack); fflush(stdout);}
 	      if(struct_verbosity==1)
 		{printf("."); fflush(stdout);}
 	      
@@ -284,6 +316,11 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	      }
 	      cset.rhs=(double *)realloc(cset.rhs,sizeof(double)*cset.m);
 	      cset.rhs[cset.m-1]=margin;
+	      cmargin=(double *)realloc(cmargin,sizeof(double)*cset.m);
+	      cmargin[cset.m-1]=classify_example(svmModel,cset.lhs[cset.m-1]);
+	      exslack[i+1]=MAX(exslack[i+1],
+			       working_set_slack(sparm,sm->w,sizePsi,svmCnorm,
+						 margin,cmargin[cset.m-1],i+1));
 	      alpha=(double *)realloc(alpha,sizeof(double)*cset.m);
 	      alpha[cset.m-1]=0;
 	      alphahist=(long *)realloc(alphahist,sizeof(long)*cset.m);
@@ -312,29 +349,42 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	      printf("*");fflush(stdout);
 	    }
 	    rt2=get_runtime();
-	    free_model(svmModel,0);
-	    svmModel=(MODEL *)my_malloc(sizeof(MODEL));
-	    /* Always get a new kernel cache. It is not possible to use the
-	       same cache for two different training runs */
-	    if(kparm->kernel_type != LINEAR)
-	      kcache=kernel_cache_init(MAX(cset.m,1),lparm->kernel_cache_size);
-	    /* Run the QP solver on cset. */
-	    svm_learn_optimization(cset.lhs,cset.rhs,cset.m,sizePsi+n,
-				   lparm,kparm,kcache,svmModel,alpha);
-	    if(kcache)
-	      kernel_cache_cleanup(kcache);
-	    /* Always add weight vector, in case part of the kernel is
-	       linear. If not, ignore the weight vector since its
-	       content is bogus. */
-	    add_weight_vector_to_linear_model(svmModel);
+	    perf_counters_start(PERF_QP);
+	    if(sparm->tron_solver) {
+	      /* Warm-started from the alphas of the last solution. */
+	      free_model(svmModel,0);
+	      svmModel=(MODEL *)my_malloc(sizeof(MODEL));
+	      svm_learn_struct_tron(cset.lhs,cset.rhs,cset.m,sizePsi,n,
+				    lparm->epsilon_crit,kparm,svmModel,alpha);
+	    }
+	    else {
+	      free_model(svmModel,0);
+	      svmModel=(MODEL *)my_malloc(sizeof(MODEL));
+	      /* Always get a new kernel cache. It is not possible to use the
+		 same cache for two different training runs */
+	      if(kparm->kernel_type != LINEAR)
+		kcache=kernel_cache_init(MAX(cset.m,1),lparm->kernel_cache_size);
+	      /* Run the QP solver on cset. */
+	      svm_learn_optimization(cset.lhs,cset.rhs,cset.m,sizePsi+n,
+				     lparm,kparm,kcache,svmModel,alpha);
+	      if(kcache)
+		kernel_cache_cleanup(kcache);
+	      /* Always add weight vector, in case part of the kernel is
+		 linear. If not, ignore the weight vector since its
+		 content is bogus. */
+	      add_weight_vector_to_linear_model(svmModel);
+	    }
 	    sm->svm_model=svmModel;
 	    sm->w=svmModel->lin_weights; /* short cut to weight vector */
+	    update_slack_index(&cset,svmModel,sm->w,sizePsi,svmCnorm,sparm,n,
+			       &cmargin,exslack);
 	    optcount++;
 	    /* keep track of when each constraint was last
 	       active. constraints marked with -1 are not updated */
 	    for(j=0;j<cset.m;j++) 
 	      if((alphahist[j]>-1) && (alpha[j] != 0))  
 		alphahist[j]=optcount;
+	    perf_counters_stop(PERF_QP);
 	    rt_opt+=MAX(get_runtime()-rt2,0);
 	    
 	    new_precision=0;
@@ -348,7 +398,7 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	rt1=get_runtime();
 	
 	if(struct_verbosity>=1)
-	  printf("(NumConst=%d, SV=%ld, CEps=%.4f, QPEps=%.4f)\n",cset.m,
+	  printf("(NumConst=%ld, SV=%ld, CEps=%.4f, QPEps=%.4f)\n",cset.m,
 		 svmModel->sv_num-1,ceps,svmModel->maxdiff);
 	
 	/* Check if some of the linear constraints have not been
@@ -356,11 +406,15 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	   avoid bloating the working set beyond necessity. */
 	if(struct_verbosity>=2)
 	  printf("Reducing working set...");fflush(stdout);
+	j=cset.m;
 	remove_inactive_constraints(&cset,alpha,optcount,alphahist,
 				    MAX(50,optcount-lastoptcount));
+	if(cset.m != j)
+	  update_slack_index(&cset,svmModel,sm->w,sizePsi,svmCnorm,sparm,n,
+			     &cmargin,exslack);
 	lastoptcount=optcount;
 	if(struct_verbosity>=2)
-	  printf("done. (NumConst=%d)\n",cset.m);
+	  printf("done. (NumConst=%ld)\n",cset.m);
 	
 	rt_total+=MAX(get_runtime()-rt1,0);
 	
@@ -373,30 +427,11 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	  || finalize_iteration(ceps,0,sample,sm,cset,alpha,sparm));  
 
   if(struct_verbosity>=1) {
-    /**** compute sum of slacks ****/
-    /**** WARNING: If positivity constraints are used, then the
-	  maximum slack id is larger than what is allocated
-	  below ****/
-    slacks=(double *)my_malloc(sizeof(double)*(n+1));
-    for(i=0; i<=n; i++) { 
-      slacks[i]=0;
-    }
-    if(sparm->slack_norm == 1) {
-      for(j=0;j<cset.m;j++) 
-	slacks[cset.lhs[j]->slackid]=MAX(slacks[cset.lhs[j]->slackid],
-			   cset.rhs[j]-classify_example(svmModel,cset.lhs[j]));
-      }
-    else if(sparm->slack_norm == 2) {
-      for(j=0;j<cset.m;j++) 
-	slacks[cset.lhs[j]->slackid]=MAX(slacks[cset.lhs[j]->slackid],
-		cset.rhs[j]
-	         -(classify_example(svmModel,cset.lhs[j])
-		   -sm->w[sizePsi+cset.lhs[j]->slackid-1]/(sqrt(2*svmCnorm))));
-    }
+    /**** compute sum of slacks (the index is up to date with the
+	  final model and working set) ****/
     slacksum=0;
     for(i=1; i<=n; i++)  
-      slacksum+=slacks[i];
-    free(slacks);
+      slacksum+=exslack[i];
     alphasum=0;
     for(i=0; i<cset.m; i++)  
       alphasum+=alpha[i]*cset.rhs[i];
@@ -409,7 +444,7 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
     printf("Upper bound on duality gap: %.5f\n", dualitygap);
     printf("Dual objective value: dval=%.5f\n",
 	    alphasum-0.5*modellength*modellength);
-    printf("Total number of constraints in final working set: %i (of %i)\n",(int)cset.m,(int)totconstraints);
+    printf("Total number of constraints in final working set: %ld (of %ld)\n",cset.m,totconstraints);
     printf("Number of iterations: %d\n",numIt);
     printf("Number of calls to 'find_most_violated_constraint': %ld\n",argmax_count);
     if(sparm->slack_norm == 1) {
@@ -452,6 +487,8 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
   free(alpha); 
   free(alphahist); 
   free(opti); 
+  free(cmargin);
+  free(exslack);
   free(cset.rhs); 
   for(i=0;i<cset.m;i++) 
     free_example(cset.lhs[i],1);
@@ -462,7 +499,7 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 			    LEARN_PARM *lparm, KERNEL_PARM *kparm, 
 			    STRUCTMODEL *sm, int alg_type)
 {
-  int         i,j;
+  long        i,j;
   int         numIt=0;
   long        argmax_count=0;
   long        totconstraints=0;
@@ -474,11 +511,11 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
   double      dualitygap,modellength,alphasum;
   long        sizePsi;
   double      *alpha=NULL;
-  long        *alphahist=NULL,optcount=0;
+  long        *alphahist=NULL,optcount=0,numaggregated=0;
   CONSTSET    cset;
   SVECTOR     *diff=NULL;
   double      *diff_n=NULL;
-  SVECTOR     *fy, *fybar, *f, **fycache, *lhs;
+  SVECTOR     *fy, *fybar, *f, **fycache=NULL, *lhs;
   MODEL       *svmModel=NULL;
   LABEL       ybar;
   DOC         *doc;
@@ -498,6 +535,7 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
   int         cached_constraint;
 
   rt1=get_runtime();
+  perf_counters_start(PERF_INIT);
 
   init_struct_model(sample,sm,sparm,lparm,kparm); 
   sizePsi=sm->sizePsi+1;          /* sm must contain size of psi on return */
@@ -546,16 +584,19 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
   sm->svm_model=svmModel;
   sm->w=svmModel->lin_weights; /* short cut to weight vector */
 
-  /* create a cache of the feature vectors for the correct labels */
-  fycache=(SVECTOR **)malloc(n*sizeof(SVECTOR *));
-  for(i=0;i<n;i++) {
-    fy=psi(ex[i].x,ex[i].y,sm,sparm);
-    if(kparm->kernel_type == LINEAR) {
-      diff=add_list_ss(fy); /* store difference vector directly */
-      free_svector(fy);
-      fy=diff;
+  /* create a cache of the feature vectors for the correct labels
+     (unless the examples are out of core) */
+  if(!sparm->outOfCore) {
+    fycache=(SVECTOR **)malloc(n*sizeof(SVECTOR *));
+    for(i=0;i<n;i++) {
+      fy=psi(ex[i].x,ex[i].y,sm,sparm);
+      if(kparm->kernel_type == LINEAR) {
+	diff=add_list_ss(fy); /* store difference vector directly */
+	free_svector(fy);
+	fy=diff;
+      }
+      fycache[i]=fy;
     }
-    fycache[i]=fy;
   }
 
   /* initialize the constraint cache */
@@ -563,6 +604,7 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
     ccache=create_constraint_cache(sample,sparm);
   }
 
+  perf_counters_stop(PERF_INIT);
   rt_init+=MAX(get_runtime()-rt1,0);
   rt_total+=MAX(get_runtime()-rt1,0);
 
@@ -637,6 +679,7 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	    {printf("."); fflush(stdout);}
 
 	  rt2=get_runtime();
+	  perf_counters_start(PERF_ARGMAX);
 	  argmax_count++;
 	  if(sparm->loss_type == SLACK_RESCALING) 
 	    ybar=find_most_violated_constraint_slackrescaling(ex[i].x,
@@ -646,18 +689,30 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	    ybar=find_most_violated_constraint_marginrescaling(ex[i].x,
 							       ex[i].y,sm,
 							       sparm);
+	  perf_counters_stop(PERF_ARGMAX);
 	  rt_viol+=MAX(get_runtime()-rt2,0);
 	  
 	  if(empty_label(ybar)) {
-	    printf("ERROR: empty label was returned for example (%i)\n",i);
+	    printf("ERROR: empty label was returned for example (%ld)\n",i);
 	    /* exit(1); */
 	    continue;
 	  }
 	  
 	  /**** get psi(x,y) and psi(x,ybar) ****/
 	  rt2=get_runtime();
-	  fy=copy_svector(fycache[i]); /*<= fy=psi(ex[i].x,ex[i].y,sm,sparm);*/
+	  perf_counters_start(PERF_PSI);
+	  if(fycache)
+	    fy=copy_svector(fycache[i]); /*<= fy=psi(ex[i].x,ex[i].y,sm,sparm);*/
+	  else {
+	    fy=psi(ex[i].x,ex[i].y,sm,sparm);
+	    if(kparm->kernel_type == LINEAR) {
+	      diff=add_list_ss(fy); /* as in the cache */
+	      free_svector(fy);
+	      fy=diff;
+	    }
+	  }
 	  fybar=psi(ex[i].x,ybar,sm,sparm);
+	  perf_counters_stop(PERF_PSI);
 	  rt_psi+=MAX(get_runtime()-rt2,0);
 	  lossval=loss(ex[i].y,ybar,sparm);
 	  free_label(ybar);
@@ -728,6 +783,18 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	/* exit(1); */
       }
       if(ceps > sparm->epsilon) { 
+	/**** make room for the new constraint by aggregating ****/
+	/* (only here: svmModel points to the constraints until the QP
+	   below replaces it) */
+	if((sparm->max_constraints>0) && (cset.m>=sparm->max_constraints)) {
+	  if(struct_verbosity>=2) {
+	    printf("Aggregating working set...");fflush(stdout);
+	  }
+	  numaggregated+=aggregate_constraints(&cset,alpha,optcount,alphahist,
+					       sparm->max_constraints-1,kparm);
+	  if(struct_verbosity>=2)
+	    printf("done. (NumConst=%ld) ",cset.m);
+	}
 	/**** resize constraint matrix and add new constraint ****/
 	cset.lhs=(DOC **)realloc(cset.lhs,sizeof(DOC *)*(cset.m+1));
 	if(sparm->slack_norm == 1) 
@@ -747,8 +814,10 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	    printf(":");fflush(stdout);
 	  }
 	  rt2=get_runtime();
+	  perf_counters_start(PERF_KERNEL);
 	  kparm->gram_matrix=update_kernel_matrix(kparm->gram_matrix,cset.m-1,
 						  &cset,kparm);
+	  perf_counters_stop(PERF_KERNEL);
 	  rt_kernel+=MAX(get_runtime()-rt2,0);
 	}
 	
@@ -757,6 +826,7 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	  printf("*");fflush(stdout);
 	}
 	rt2=get_runtime();
+	perf_counters_start(PERF_QP);
 	/* set svm precision so that higher than eps of most violated constr */
 	if(cached_constraint) {
 	  epsilon_cached=MIN(epsilon_cached,MAX(ceps,sparm->epsilon)); 
@@ -789,6 +859,7 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	for(j=0;j<cset.m;j++) 
 	  if((alphahist[j]>-1) && (alpha[j] != 0))  
 	    alphahist[j]=optcount;
+	perf_counters_stop(PERF_QP);
 	rt_opt+=MAX(get_runtime()-rt2,0);
 	
 	/* Check if some of the linear constraints have not been
@@ -798,14 +869,14 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 	  printf("Reducing working set...");fflush(stdout);
 	remove_inactive_constraints(&cset,alpha,optcount,alphahist,50);
 	if(struct_verbosity>=2)
-	  printf("done. (NumConst=%d) ",cset.m);
+	  printf("done. (NumConst=%ld) ",cset.m);
       }
       else {
 	free_svector(diff);
       }
 
       if(struct_verbosity>=1)
-	printf("(NumConst=%d, SV=%ld, CEps=%.4f, QPEps=%.4f)\n",cset.m,
+	printf("(NumConst=%ld, SV=%ld, CEps=%.4f, QPEps=%.4f)\n",cset.m,
 	       svmModel->sv_num-1,ceps,svmModel->maxdiff);
 
       free_example(doc,0);
@@ -843,7 +914,9 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
     printf("Upper bound on duality gap: %.5f\n", dualitygap);
     printf("Dual objective value: dval=%.5f\n",
 	    alphasum-0.5*modellength*modellength);
-    printf("Total number of constraints in final working set: %i (of %i)\n",(int)cset.m,(int)totconstraints);
+    printf("Total number of constraints in final working set: %ld (of %ld)\n",cset.m,totconstraints);
+    if(sparm->max_constraints>0)
+      printf("Number of constraints removed by aggregation: %ld\n",numaggregated);
     printf("Number of iterations: %d\n",numIt);
     printf("Number of calls to 'find_most_violated_constraint': %ld\n",argmax_count);
     if(sparm->slack_norm == 1) {
@@ -885,9 +958,11 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 
   if(ccache)    
     free_constraint_cache(ccache);
-  for(i=0;i<n;i++)
-    free_svector(fycache[i]);
-  free(fycache);
+  if(fycache) {
+    for(i=0;i<n;i++)
+      free_svector(fycache[i]);
+    free(fycache);
+  }
   if(svmModel)
     free_model(svmModel,0);
   free(alpha); 
@@ -902,6 +977,335 @@ void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 
 
 
+/*---------------------------------------------------------------------------*/
+/*  Trust-region Newton solver (TRON) for the L2-slack working set          */
+/*---------------------------------------------------------------------------*/
+
+/* The L2-slack problem over the working set,
+
+     min 1/2 w*w + C/n sum_i xi_i^2   s.t.  d_j*w >= r_j - xi_{s_j},
+
+   isn't smooth in the primal where two constraints of an example
+   define its slack, which is where its solution lies, so it is solved
+   in the dual that svm-light solves for -p 2: with x_j the lhs of the
+   working set, which carry the slack feature 1/sqrt(2C/n) of their
+   example,
+
+     min q(a) = 1/2 a'Qa - r'a   s.t.  a >= 0,   Q_jk = x_j*x_k.
+
+   This follows the trust-region Newton method for bound-constrained
+   problems of Lin and More (SIAM J. Optim. 1999): each iteration takes
+   a Cauchy step along the projected gradient path, then minimizes over
+   the variables that aren't at their bound with conjugate gradient
+   steps inside the trust region, and searches along their projection.
+   Products with Q go through the weight space: Qv = X(X'v). It stops
+   when the projected gradient is within eps, which is svm-light's
+   criterion on the KKT conditions (epsilon_crit). */
+
+typedef struct tron_problem {
+  DOC    **lhs;      /* working set */
+  double *rhs;
+  long   m;          /* number of constraints */
+  long   totwords;   /* sizePsi + number of examples */
+  double *u;         /* X'v, for products with Q */
+} TRON_PROBLEM;
+
+double tron_dot(double *a, double *b, long n)
+{
+  long i;
+  double sum=0;
+  for(i=0;i<n;i++)
+    sum+=a[i]*b[i];
+  return(sum);
+}
+
+double tron_sprod(TRON_PROBLEM *p, long j, double *v)
+{
+  double sum=0;
+  SVECTOR *f;
+  for(f=p->lhs[j]->fvec;f;f=f->next)
+    sum+=f->factor*sprod_ns(v,f);
+  return(sum);
+}
+
+/* u = X'v over the constraints j with v_j != 0 */
+void tron_xtv(TRON_PROBLEM *p, double *v, double *u)
+{
+  long j;
+  SVECTOR *f;
+
+  clear_nvector(u,p->totwords);
+  for(j=0;j<p->m;j++)
+    if(v[j] != 0)
+      for(f=p->lhs[j]->fvec;f;f=f->next)
+	add_vector_ns(u,f,v[j]*f->factor);
+}
+
+/* qv = Qv on the constraints with free[j] set (all if free is NULL),
+   where v is zero on the others; returns v'Qv */
+double tron_qv(TRON_PROBLEM *p, double *v, double *qv, char *free_var)
+{
+  long j;
+
+  tron_xtv(p,v,p->u);
+  for(j=0;j<p->m;j++)
+    qv[j]=((!free_var) || free_var[j]) ? tron_sprod(p,j,p->u) : 0;
+  return(tron_dot(p->u+1,p->u+1,p->totwords));
+}
+
+/* largest violation of the KKT conditions at a with gradient g */
+double tron_kkt(long m, double *a, double *g)
+{
+  long j;
+  double maxdiff=0;
+  for(j=0;j<m;j++)
+    maxdiff=MAX(maxdiff,(a[j] > 0) ? fabs(g[j]) : -g[j]);
+  return(maxdiff);
+}
+
+/* s = P[a - t*g] - a, the step to the projected gradient path at t;
+   returns ||s|| */
+double tron_gradient_path(long m, double *a, double *g, double t, double *s)
+{
+  long j;
+  for(j=0;j<m;j++)
+    s[j]=MAX(a[j]-t*g[j],0)-a[j];
+  return(sqrt(tron_dot(s,s,m)));
+}
+
+/* conjugate gradient for Q_FF d = -g_F over the free variables F within
+   ||d|| <= delta; returns the number of iterations and d */
+long tron_trcg(TRON_PROBLEM *p, double delta, double *g, char *free_var,
+	       double *d, double *r, double *dir, double *qdir)
+{
+  long j,cgiter=0;
+  double alpha,beta,rTr,rnewTrnew,cgtol,std,sts,dtd,dsq,rad,dQd;
+
+  for(j=0;j<p->m;j++) {
+    d[j]=0;
+    r[j]=free_var[j] ? -g[j] : 0;
+    dir[j]=r[j];
+  }
+  rTr=tron_dot(r,r,p->m);
+  cgtol=0.1*sqrt(rTr);
+  while((sqrt(rTr) > cgtol) && (cgiter < p->m)) {
+    cgiter++;
+    dQd=tron_qv(p,dir,qdir,free_var);
+    if(dQd > 0)
+      alpha=rTr/dQd;
+    if((dQd <= 0) || (sqrt(tron_dot(d,d,p->m)+2*alpha*tron_dot(d,dir,p->m)
+			   +alpha*alpha*tron_dot(dir,dir,p->m)) > delta)) {
+      /* to the boundary of the trust region */
+      std=tron_dot(d,dir,p->m);
+      sts=tron_dot(d,d,p->m);
+      dtd=tron_dot(dir,dir,p->m);
+      dsq=delta*delta;
+      rad=sqrt(MAX(std*std+dtd*(dsq-sts),0));
+      if(std >= 0)
+	alpha=(dsq-sts)/(std+rad);
+      else
+	alpha=(rad-std)/dtd;
+      for(j=0;j<p->m;j++)
+	d[j]+=alpha*dir[j];
+      break;
+    }
+    for(j=0;j<p->m;j++) {
+      d[j]+=alpha*dir[j];
+      r[j]-=alpha*qdir[j];
+    }
+    rnewTrnew=tron_dot(r,r,p->m);
+    beta=rnewTrnew/rTr;
+    for(j=0;j<p->m;j++)
+      dir[j]=r[j]+beta*dir[j];
+    rTr=rnewTrnew;
+  }
+  return(cgiter);
+}
+
+void svm_learn_struct_tron(DOC **lhs, double *rhs, long m, long sizePsi,
+			   long n, double eps, KERNEL_PARM *kparm,
+			   MODEL *svmModel, double *alpha)
+     /* Solves the L2-slack problem over the working set lhs*w >= rhs
+	(whose lhs include the slack features) in the dual, starting from
+	the multipliers in alpha, to the precision eps on the KKT
+	conditions, and fills svmModel with the solution like
+	svm_learn_optimization() would. alpha returns the
+	multipliers. */
+{
+  TRON_PROBLEM p;
+  long   j,iter=0,cgiter=0,totwords=sizePsi+n,maxsearch=50,k;
+  double *w,*g,*s,*gc,*qs,*d,*r,*dir,*qdir,*a_new,*step;
+  char   *free_var;
+  double maxdiff,delta,t,snorm,sQs,gs,decrease,qc,q_new,dnorm,beta;
+  double mu0=0.01;
+  int    ok;
+
+  p.lhs=lhs;
+  p.rhs=rhs;
+  p.m=m;
+  p.totwords=totwords;
+  p.u=create_nvector(totwords);
+  w=create_nvector(totwords);
+  g=(double *)my_malloc(sizeof(double)*(m+1));
+  s=(double *)my_malloc(sizeof(double)*(m+1));
+  gc=(double *)my_malloc(sizeof(double)*(m+1));
+  qs=(double *)my_malloc(sizeof(double)*(m+1));
+  d=(double *)my_malloc(sizeof(double)*(m+1));
+  r=(double *)my_malloc(sizeof(double)*(m+1));
+  dir=(double *)my_malloc(sizeof(double)*(m+1));
+  qdir=(double *)my_malloc(sizeof(double)*(m+1));
+  a_new=(double *)my_malloc(sizeof(double)*(m+1));
+  step=(double *)my_malloc(sizeof(double)*(m+1));
+  free_var=(char *)my_malloc(sizeof(char)*(m+1));
+  for(j=0;j<m;j++)
+    alpha[j]=MAX(alpha[j],0);
+
+  delta=0;
+  t=1;
+  for(;;) {
+    /* w = X'a and the gradient Qa - r, recomputed every iteration so
+       that they don't drift */
+    tron_xtv(&p,alpha,w);
+    for(j=0;j<m;j++)
+      g[j]=tron_sprod(&p,j,w)-rhs[j];
+    maxdiff=tron_kkt(m,alpha,g);
+    if(maxdiff <= eps)
+      break;
+    iter++;
+    if(delta == 0) {
+      for(j=0;j<m;j++)
+	s[j]=((alpha[j] > 0) || (g[j] < 0)) ? g[j] : 0;
+      delta=sqrt(tron_dot(s,s,m));
+    }
+
+    /* Cauchy step: the largest t on the projected gradient path, inside
+       the trust region, with a sufficient decrease; extrapolate from
+       the last t if it's accepted, else interpolate */
+    ok=0;
+    for(k=0;k<maxsearch;k++) {
+      snorm=tron_gradient_path(m,alpha,g,t,s);
+      sQs=tron_qv(&p,s,qs,NULL);
+      gs=tron_dot(g,s,m);
+      if((snorm <= delta) && (gs+0.5*sQs <= mu0*gs)) {
+	ok=1;
+	break;
+      }
+      t*=0.1;
+    }
+    if(ok)
+      for(k=0;k<maxsearch;k++) {
+	snorm=tron_gradient_path(m,alpha,g,10*t,step);
+	if(snorm > delta)
+	  break;
+	sQs=tron_qv(&p,step,gc,NULL);
+	gs=tron_dot(g,step,m);
+	if(gs+0.5*sQs > mu0*gs)
+	  break;
+	t*=10;
+	for(j=0;j<m;j++) {
+	  s[j]=step[j];
+	  qs[j]=gc[j];
+	}
+      }
+    if(!ok) {
+      printf("\nWARNING: No progress on the projected gradient (KKT violation %g)!\n",
+	     maxdiff);
+      printf("         Terminating the working set optimization.\n");
+      break;
+    }
+    sQs=tron_dot(s,qs,m);
+    gs=tron_dot(g,s,m);
+    decrease=gs+0.5*sQs;
+
+    /* Newton steps over the variables that aren't at their bound at the
+       Cauchy point, with gradient gc = g + Qs there */
+    for(j=0;j<m;j++) {
+      a_new[j]=alpha[j]+s[j];
+      gc[j]=g[j]+qs[j];
+      free_var[j]=(a_new[j] > 0);
+    }
+    cgiter+=tron_trcg(&p,delta,gc,free_var,d,r,dir,qdir);
+    dnorm=sqrt(tron_dot(d,d,m));
+    if(dnorm > 0) {
+      /* projected search along d from the Cauchy point */
+      qc=0;
+      for(beta=1,k=0;k<maxsearch;k++,beta*=0.5) {
+	for(j=0;j<m;j++)
+	  step[j]=MAX(a_new[j]+beta*d[j],0)-a_new[j];
+	q_new=tron_dot(gc,step,m)+0.5*tron_qv(&p,step,dir,NULL);
+	if(q_new <= mu0*tron_dot(gc,step,m)) {
+	  qc=q_new;
+	  break;
+	}
+      }
+      if(qc < 0) {
+	for(j=0;j<m;j++)
+	  a_new[j]+=step[j];
+	decrease+=qc;
+      }
+    }
+    for(j=0;j<m;j++) 
+      step[j]=a_new[j]-alpha[j];
+    snorm=sqrt(tron_dot(step,step,m));
+    if(decrease >= 0) {
+      printf("\nWARNING: No decrease of the dual objective (KKT violation %g)!\n",
+	     maxdiff);
+      printf("         Terminating the working set optimization.\n");
+      break;
+    }
+    for(j=0;j<m;j++)
+      alpha[j]=a_new[j];
+    /* the objective is quadratic, so the model predicts the decrease
+       exactly; let the region grow with the steps that reach it */
+    if(snorm >= 0.5*delta)
+      delta*=4;
+  }
+  if(struct_verbosity>=2)
+    printf("(TRON: %ld iterations, %ld CG steps, KKT %.2g) ",iter,cgiter,
+	   maxdiff);
+
+  /* the model, as svm_learn_optimization() gives it; the slack features
+     of the weight vector hold sqrt(2C/n) xi, see svm_learn_struct() */
+  svmModel->supvec=(DOC **)my_malloc(sizeof(DOC *)*(m+2));
+  svmModel->alpha=(double *)my_malloc(sizeof(double)*(m+2));
+  svmModel->supvec[0]=NULL;
+  svmModel->alpha[0]=0;
+  svmModel->sv_num=1;
+  for(j=0;j<m;j++)
+    if(alpha[j] != 0) {
+      svmModel->supvec[svmModel->sv_num]=lhs[j];
+      svmModel->alpha[svmModel->sv_num]=alpha[j];
+      svmModel->sv_num++;
+    }
+  svmModel->at_upper_bound=0;
+  svmModel->b=0;
+  svmModel->index=NULL;
+  svmModel->totwords=totwords;
+  svmModel->totdoc=m;
+  svmModel->kernel_parm=(*kparm);
+  svmModel->loo_error=-1;
+  svmModel->loo_recall=-1;
+  svmModel->loo_precision=-1;
+  svmModel->xa_error=-1;
+  svmModel->xa_recall=-1;
+  svmModel->xa_precision=-1;
+  svmModel->lin_weights=w;
+  svmModel->maxdiff=maxdiff;
+
+  free(p.u);
+  free(g);
+  free(s);
+  free(gc);
+  free(qs);
+  free(d);
+  free(r);
+  free(dir);
+  free(qdir);
+  free(a_new);
+  free(step);
+  free(free_var);
+}
+
 void remove_inactive_constraints(CONSTSET *cset, double *alpha, 
 			         long currentiter, long *alphahist, 
 				 long mininactive)
@@ -938,6 +1342,240 @@ void remove_inactive_constraints(CONSTSET *cset, double *alpha,
 }
 
 
+typedef struct alpha_rank {
+  double alpha;
+  long   pos;
+} ALPHA_RANK;
+
+int compare_alpha_rank(const void *a, const void *b)
+{
+  const ALPHA_RANK *x=(const ALPHA_RANK *)a,*y=(const ALPHA_RANK *)b;
+  if(x->alpha != y->alpha) return((x->alpha < y->alpha) ? -1 : 1);
+  return((x->pos < y->pos) ? -1 : (x->pos > y->pos));
+}
+
+long aggregate_constraints(CONSTSET *cset, double *alpha, 
+			   long currentiter, long *alphahist, 
+			   long maxconst, KERNEL_PARM *kparm)
+     /* shrinks the working set of the joint algorithm to maxconst
+	constraints: constraints with alpha=0 are dropped first, and
+	then the ones with the smallest alphas are replaced by their
+	alpha-weighted average with alpha=sum of their alphas, as in
+	aggregated bundle methods. w, sum alpha and the dual objective
+	stay what they were, so the next QP starts from the current
+	solution. Constraints marked -1 in alphahist are kept. The
+	kernel matrix in kparm->gram_matrix, if any, gets the row of
+	the new constraint from the rows of the ones it replaces. 
+	Returns the number of constraints removed. */
+{
+  long i,j,k,m,excess,numrank,numzero,nummerge,first=-1;
+  ALPHA_RANK *rank;
+  char *merged;
+  double alphasum=0,rhs=0,c,rowself,*row;
+  SVECTOR *sum=NULL,*f,*fcopy;
+  MATRIX *gram=kparm->gram_matrix;
+
+  excess=cset->m-maxconst;
+  if((maxconst<=0) || (excess<=0))
+    return(0);
+
+  rank=(ALPHA_RANK *)my_malloc(sizeof(ALPHA_RANK)*cset->m);
+  numrank=0;
+  numzero=0;
+  for(i=0;i<cset->m;i++) 
+    if(alphahist[i]>=0) {
+      rank[numrank].alpha=alpha[i];
+      rank[numrank].pos=i;
+      if(alpha[i] == 0) numzero++;
+      numrank++;
+    }
+  qsort(rank,numrank,sizeof(ALPHA_RANK),compare_alpha_rank);
+
+  /* drop constraints with alpha=0 first; merging k constraints with
+     alpha>0 into one removes k-1 */
+  nummerge=0;
+  if(numzero>=excess) 
+    numzero=excess;
+  else 
+    nummerge=MIN(excess-numzero+1,numrank-numzero);
+  if(nummerge<2) nummerge=0;
+
+  merged=(char *)my_malloc(cset->m);
+  for(i=0;i<cset->m;i++) merged[i]=0;
+  for(k=0;k<numzero;k++)
+    merged[rank[k].pos]=2;              /* dropped */
+  for(k=numzero;k<numzero+nummerge;k++) {
+    merged[rank[k].pos]=1;              /* aggregated */
+    alphasum+=rank[k].alpha;
+  }
+  free(rank);
+
+  if(nummerge) {
+    for(i=0;i<cset->m;i++) 
+      if(merged[i] == 1) {
+	if(first<0) first=i;
+	c=alpha[i]/alphasum;
+	rhs+=c*cset->rhs[i];
+	fcopy=copy_svector(cset->lhs[i]->fvec);
+	for(f=fcopy;f->next;f=f->next)
+	  f->factor*=c;
+	f->factor*=c;
+	f->next=sum;
+	sum=fcopy;
+      }
+    if(kparm->kernel_type == LINEAR) {
+      fcopy=add_list_ss(sum);
+      free_svector(sum);
+      sum=fcopy;
+    }
+    if(gram) {
+      /* K(new,r)=sum_j c_j K(j,r) over the aggregated constraints j */
+      row=(double *)my_malloc(sizeof(double)*cset->m);
+      rowself=0;
+      for(k=0;k<cset->m;k++) {
+	row[k]=0;
+	for(j=0;j<cset->m;j++) 
+	  if(merged[j] == 1)
+	    row[k]+=(alpha[j]/alphasum)
+	      *gram->element[cset->lhs[j]->kernelid][cset->lhs[k]->kernelid];
+	if(merged[k] == 1)
+	  rowself+=(alpha[k]/alphasum)*row[k];
+      }
+      j=cset->lhs[first]->kernelid;
+      for(k=0;k<cset->m;k++) 
+	if(!merged[k]) {
+	  gram->element[j][cset->lhs[k]->kernelid]=row[k];
+	  gram->element[cset->lhs[k]->kernelid][j]=row[k];
+	}
+      gram->element[j][j]=rowself;
+      free(row);
+    }
+    k=cset->lhs[first]->kernelid;
+    free_example(cset->lhs[first],1);
+    cset->lhs[first]=create_example(first,0,1,1,sum);
+    cset->lhs[first]->kernelid=k;
+    cset->rhs[first]=rhs;
+    alpha[first]=alphasum;
+    alphahist[first]=currentiter;
+    merged[first]=0;
+  }
+
+  m=0;
+  for(i=0;i<cset->m;i++) {
+    if(!merged[i]) {
+      cset->lhs[m]=cset->lhs[i];      
+      cset->lhs[m]->docnum=m;
+      cset->rhs[m]=cset->rhs[i];
+      alpha[m]=alpha[i];
+      alphahist[m]=alphahist[i];
+      m++;
+    }
+    else {
+      free_example(cset->lhs[i],1);
+    }
+  }
+  free(merged);
+  excess=cset->m-m;
+  if(excess) {
+    cset->m=m;
+    cset->lhs=(DOC **)realloc(cset->lhs,sizeof(DOC *)*cset->m);
+    cset->rhs=(double *)realloc(cset->rhs,sizeof(double)*cset->m);
+  }
+  return(excess);
+}
+
+
+typedef struct margin_job {
+  MODEL  *model;
+  DOC    **lhs;
+  double *margin;
+  long   from,to;   /* the constraints [from,to) */
+} MARGIN_JOB;
+
+void *compute_margin_job(void *job)
+{
+  MARGIN_JOB *p=(MARGIN_JOB *)job;
+  long j;
+
+  for(j=p->from;j<p->to;j++)
+    p->margin[j]=classify_example(p->model,p->lhs[j]);
+  return(NULL);
+}
+
+void compute_constraint_margins(MODEL *model, DOC **lhs, long m, 
+				double *margin)
+     /* sets margin[j]=classify_example(model,lhs[j]) for the m
+	constraints, split over the processors if there are enough
+	constraints to be worth it; each margin is computed the same
+	way whatever the split. Only linear models are split: kernel()
+	caches vector norms as it goes and counts its calls. */
+{
+  MARGIN_JOB job[MARGIN_MAX_THREADS];
+  pthread_t  thread[MARGIN_MAX_THREADS];
+  int        started[MARGIN_MAX_THREADS];
+  long       t,numthreads;
+
+  numthreads=MIN(sysconf(_SC_NPROCESSORS_ONLN),MARGIN_MAX_THREADS);
+  numthreads=MIN(numthreads,m/MARGIN_MIN_PER_THREAD);
+  if((numthreads < 1) || (model->kernel_parm.kernel_type != LINEAR))
+    numthreads=1;
+  for(t=0;t<numthreads;t++) {
+    job[t].model=model;
+    job[t].lhs=lhs;
+    job[t].margin=margin;
+    job[t].from=(m*t)/numthreads;
+    job[t].to=(m*(t+1))/numthreads;
+    started[t]=0;
+  }
+  for(t=1;t<numthreads;t++) 
+    started[t]=(pthread_create(&thread[t],NULL,compute_margin_job,&job[t]) 
+		== 0);
+  for(t=0;t<numthreads;t++) 
+    if(!started[t])  /* the first part, and any without a thread */
+      compute_margin_job(&job[t]);
+  for(t=1;t<numthreads;t++) 
+    if(started[t])
+      pthread_join(thread[t],NULL);
+}
+
+double working_set_slack(STRUCT_LEARN_PARM *sparm, double *w, long sizePsi,
+			 double svmCnorm, double rhs, double margin, 
+			 long slackid)
+     /* the slack that a working set constraint with right hand side
+	rhs and margin w*lhs gives its example (slackid) */
+{
+  if(sparm->slack_norm == 2) /* works only for linear kernel */
+    return(rhs-(margin-w[sizePsi+slackid-1]/(sqrt(2*svmCnorm))));
+  else
+    return(rhs-margin);
+}
+
+void update_slack_index(CONSTSET *cset, MODEL *svmModel, double *w, 
+			long sizePsi, double svmCnorm, 
+			STRUCT_LEARN_PARM *sparm, long n, double **margin,
+			double *slack)
+     /* recomputes the margins of all constraints in cset under
+	svmModel (w is its weight vector) into *margin, which is
+	resized to cset->m, and from them the slack of examples 1..n:
+	slack[i] is the largest slack of the constraints with slackid
+	i, or 0 if there are none. Call whenever the model or the
+	working set changes other than by adding a constraint. */
+{
+  long i,j;
+
+  (*margin)=(double *)realloc(*margin,sizeof(double)*MAX(cset->m,1));
+  compute_constraint_margins(svmModel,cset->lhs,cset->m,*margin);
+  for(i=0;i<=n;i++) 
+    slack[i]=0;
+  for(j=0;j<cset->m;j++) {
+    i=cset->lhs[j]->slackid;
+    if((i >= 1) && (i <= n))  /* not the constraints init_struct_constraints() may add */
+      slack[i]=MAX(slack[i],working_set_slack(sparm,w,sizePsi,svmCnorm,
+					      cset->rhs[j],(*margin)[j],i));
+  }
+}
+
+
 MATRIX *init_kernel_matrix(CONSTSET *cset, KERNEL_PARM *kparm) 
      /* assigns a kernelid to each constraint in cset and creates the
 	corresponding kernel matrix. */
@@ -1004,7 +1642,7 @@ CCACHE *create_constraint_cache(SAMPLE sample, STRUCT_LEARN_PARM *sparm)
   long        n=sample.n;
   EXAMPLE     *ex=sample.examples;
   CCACHE      *ccache;
-  int         i;
+  long        i;
 
   ccache=(CCACHE *)malloc(sizeof(CCACHE));
   ccache->n=n;
@@ -1024,7 +1662,7 @@ void free_constraint_cache(CCACHE *ccache)
      /* frees all memory allocated for constraint cache */
 {
   CCACHEELEM *celem,*next;
-  int i;
+  long i;
   for(i=0; i<ccache->n; i++) {
     celem=ccache->constlist[i];
     while(celem) {
@@ -1038,7 +1676,7 @@ void free_constraint_cache(CCACHE *ccache)
   free(ccache);
 }
 
-void add_constraint_to_constraint_cache(CCACHE *ccache, MODEL *svmModel, int exnum, SVECTOR *fydelta, double rhs, int maxconst)
+void add_constraint_to_constraint_cache(CCACHE *ccache, MODEL *svmModel, long exnum, SVECTOR *fydelta, double rhs, int maxconst)
      /* add new constraint fydelta*w>rhs for example exnum to cache,
 	if it is more violated than the currently most violated
 	constraint in cache. if this grows the number of constraint
@@ -1084,7 +1722,7 @@ void update_constraint_cache_for_model(CCACHE *ccache, MODEL *svmModel)
      /* update the violation scores according to svmModel and find the
 	most violated constraints for each example */
 { 
-  int     i;
+  long    i;
   double  progress=0,progress_old=0;
   double  maxviol=0;
   double  dist_ydelta;
@@ -1131,7 +1769,7 @@ double find_most_violated_joint_constraint_in_cache(CCACHE *ccache, SVECTOR **lh
 	invalid. */
 {
   double sumviol=0;
-  int i;
+  long i;
   SVECTOR *fydelta;
 
   (*lhs)=NULL;
@@ -35,6 +35,12 @@ extern "C" {
 #define  SLACK_RESCALING    1
 #define  MARGIN_RESCALING   2
 
+/* the n-slack learner (-w 1) recomputes the margins of the working set
+   in parallel, with up to this many threads, each getting at least
+   MARGIN_MIN_PER_THREAD constraints */
+#define  MARGIN_MAX_THREADS     16
+#define  MARGIN_MIN_PER_THREAD  256
+
 #define  PRIMAL_ALG         2
 #define  DUAL_ALG           3
 #define  DUAL_CACHE_ALG     4
@@ -47,7 +53,7 @@ typedef struct ccacheelem {
 } CCACHEELEM;
 
 typedef struct ccache {
-  int        n;              /* number of examples */
+  long       n;              /* number of examples */
   CCACHEELEM **constlist;    /* array of pointers to constraint lists
 				- one list per example. The first
 				element of the list always points to
@@ -58,7 +64,7 @@ typedef struct ccache {
 CCACHE *create_constraint_cache(SAMPLE sample, STRUCT_LEARN_PARM *sparm);
 void free_constraint_cache(CCACHE *ccache);
 void add_constraint_to_constraint_cache(CCACHE *ccache, MODEL *svmModel, 
-					int exnum, SVECTOR *fydelta, 
+					long exnum, SVECTOR *fydelta, 
 					double rhs, int maxconst);
 void update_constraint_cache_for_model(CCACHE *ccache, MODEL *svmModel);
 double find_most_violated_joint_constraint_in_cache(CCACHE *ccache, 
@@ -69,8 +75,23 @@ void svm_learn_struct(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 void svm_learn_struct_joint(SAMPLE sample, STRUCT_LEARN_PARM *sparm,
 		      LEARN_PARM *lparm, KERNEL_PARM *kparm, 
 		      STRUCTMODEL *sm, int alg_type);
+void svm_learn_struct_tron(DOC **lhs, double *rhs, long m, long sizePsi,
+			   long n, double eps, KERNEL_PARM *kparm,
+			   MODEL *svmModel, double *alpha);
 void remove_inactive_constraints(CONSTSET *cset, double *alpha, 
 			         long i, long *alphahist, long mininactive);
+long aggregate_constraints(CONSTSET *cset, double *alpha, 
+			   long currentiter, long *alphahist, 
+			   long maxconst, KERNEL_PARM *kparm);
+void compute_constraint_margins(MODEL *model, DOC **lhs, long m, 
+				double *margin);
+double working_set_slack(STRUCT_LEARN_PARM *sparm, double *w, long sizePsi,
+			 double svmCnorm, double rhs, double margin, 
+			 long slackid);
+void update_slack_index(CONSTSET *cset, MODEL *svmModel, double *w, 
+			long sizePsi, double svmCnorm, 
+			STRUCT_LEARN_PARM *sparm, long n, double **margin,
+			double *slack);
 MATRIX *init_kernel_matrix(CONSTSET *cset, KERNEL_PARM *kparm); 
 MATRIX *update_kernel_matrix(MATRIX *matrix, int newpos, CONSTSET *cset,
 			     KERNEL_PARM *kparm);
@@ -38,6 +38,7 @@ extern "C" {
 
 char trainfile[200];           /* file with training examples */
 char modelfile[200];           /* file for resulting classifier */
+long hardware_counters=0;      /* count cycles, cache misses... per phase */
 
 void   read_input_parameters(int, char **, char *, char *,long *, long *,
 			     STRUCT_LEARN_PARM *, LEARN_PARM *, KERNEL_PARM *,
@@ -69,6 +70,8 @@ int main (int argc, char* argv[])
   if(struct_verbosity>=1) {
     printf("done\n"); fflush(stdout);
   }
+  if(hardware_counters)
+    perf_counters_open();
   
   /* Do the learning and return structmodel. */
   if(alg_type == 1)
@@ -82,6 +85,9 @@ int main (int argc, char* argv[])
   else
     exit(1);
 
+  perf_counters_print(stdout);
+  perf_counters_close();
+
   /* Warning: The model contains references to the original data 'docs'.
      If you want to free the original data, and only keep the model, you 
      have to make a deep copy of 'model'. */
@@ -123,6 +129,9 @@ void read_input_parameters(int argc,char *argv[],char *trainfile,
   struct_parm->loss_type=DEFAULT_RESCALING;
   struct_parm->newconstretrain=100;
   struct_parm->ccache_size=5;
+  struct_parm->tron_solver=0;
+  struct_parm->max_constraints=0;
+  struct_parm->adaptive_precision=0;
 
   strcpy (modelfile, "svm_struct_model");
   strcpy (learn_parm->predfile, "trans_predictions");
@@ -140,6 +149,8 @@ void read_input_parameters(int argc,char *argv[],char *trainfile,
   learn_parm->svm_c=99999999;  /* overridden by struct_parm->C */
   learn_parm->eps=0.001;       /* overridden by struct_parm->epsilon */
   learn_parm->transduction_posratio=-1.0;
+  learn_parm->transduction_switches=1;
+  learn_parm->transduction_annealing=1.5;
   learn_parm->svm_costratio=1.0;
   learn_parm->svm_costratio_unlab=1.0;
   learn_parm->svm_unlabbound=1E-5;
@@ -169,6 +180,10 @@ void read_input_parameters(int argc,char *argv[],char *trainfile,
       case '#': i++; learn_parm->maxiter=atol(argv[i]); break;
       case 'm': i++; learn_parm->kernel_cache_size=atol(argv[i]); break;
       case 'w': i++; (*alg_type)=atol(argv[i]); break;
+      case 'z': i++; struct_parm->tron_solver=atol(argv[i]); break;
+      case 'b': i++; struct_parm->max_constraints=atol(argv[i]); break;
+      case 'j': i++; struct_parm->adaptive_precision=atol(argv[i]); break;
+      case 'x': i++; hardware_counters=atol(argv[i]); break;
       case 'o': i++; struct_parm->loss_type=atol(argv[i]); break;
       case 'n': i++; learn_parm->svm_newvarsinqp=atol(argv[i]); break;
       case 'q': i++; learn_parm->svm_maxqpsize=atol(argv[i]); break;
@@ -239,6 +254,20 @@ void read_input_parameters(int argc,char *argv[],char *trainfile,
     print_help();
     exit(0);
   }
+  if(struct_parm->tron_solver && (((*alg_type) != 1) 
+				   || (struct_parm->slack_norm != 2)
+				   || (kernel_parm->kernel_type != LINEAR))) {
+    printf("\nThe TRON solver (-z 1) needs '-w 1 -p 2' and a linear kernel!\n\n");
+    wait_any_key();
+    print_help();
+    exit(0);
+  }
+  if((struct_parm->max_constraints < 0) || (struct_parm->max_constraints == 1)) {
+    printf("\nThe working set limit (-b) must be 0 (no limit) or at least 2!\n\n");
+    wait_any_key();
+    print_help();
+    exit(0);
+  }
   if(((*alg_type) < 1) || ((*alg_type) > 4)) {
     printf("\nAlgorithm type must be either '1', '2', '3', or '4'!\n\n");
     wait_any_key();
@@ -318,6 +347,9 @@ void print_help()
   printf("         -?          -> this help\n");
   printf("         -v [0..3]   -> verbosity level (default 1)\n");
   printf("         -y [0..3]   -> verbosity level for svm_light (default 0)\n");
+  printf("         -x [0,1]    -> report hardware counters (cycles, instructions,\n");
+  printf("                        LLC misses, branch misses) for each phase of the\n");
+  printf("                        learner (Linux only; default 0)\n");
   printf("Learning options:\n");
   printf("         -c float    -> C: trade-off between training error\n");
   printf("                        and margin (default 0.01)\n");
@@ -348,6 +380,16 @@ void print_help()
   printf("                        2: joint constraint algorithm (primal) [to be published]\n");
   printf("                        3: joint constraint algorithm (dual) [to be published]\n");
   printf("                        4: joint constraint algorithm (dual) with constr. cache\n");
+  printf("         -z [0,1]    -> solver for the QP over the working set with -w 1 -p 2\n");
+  printf("                        and a linear kernel (default 0):\n");
+  printf("                        0: svm-light (dual)\n");
+  printf("                        1: trust-region Newton (dual), warm-started\n");
+  printf("                           from the last solution\n");
+  printf("         -b [0,2..]  -> maximum number of constraints in the working set\n");
+  printf("                        of the joint algorithms; beyond it, the constraints\n");
+  printf("                        with the smallest alphas are replaced by their\n");
+  printf("                        alpha-weighted average, keeping the QP solution\n");
+  printf("                        (default 0: no limit) (-w 2,3,4 only)\n");
   printf("         -q [2..]    -> maximum size of QP-subproblems (default 10)\n");
   printf("         -n [2..q]   -> number of new variables entering the working set\n");
   printf("                        in each iteration (default n = q). Set n<q to prevent\n");
@@ -358,6 +400,11 @@ void print_help()
   printf("                        (default 5) (used with -w 4)\n");
   printf("         -e float    -> eps: Allow that error for termination criterion\n");
   printf("                        (default %f)\n",DEFAULT_EPS);
+  printf("         -j [0,1]    -> precision schedule of -w 1 (default 0):\n");
+  printf("                        0: start at 50 and halve after each level\n");
+  printf("                        1: go below the largest violation found in the\n");
+  printf("                           last full pass, in bigger steps while levels\n");
+  printf("                           take a single pass\n");
   printf("         -h [5..]    -> number of iterations a variable needs to be\n"); 
   printf("                        optimal before considered for shrinking (default 100)\n");
   printf("         -k [1..]    -> number of new constraints to accumulate before\n"); 
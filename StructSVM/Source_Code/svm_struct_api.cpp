@@ -28,11 +28,23 @@
 #include <iomanip>
 #include <string>
 #include <algorithm> //transform()
+#include <queue> //priority_queue
+#include <set>
 #include <math.h>
+#include <stdint.h> //uint32_t
+#include <arpa/inet.h> //htonl()
+#include <pthread.h>
+#include <sys/mman.h> //mmap()
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 using namespace std;
 #include <ext/hash_map> //this location is compiler-dependent
-using __gnu_cxx::hash; //__gnu_cxx is where gcc sticks nonstandard STL stuff
-using __gnu_cxx::hash_map;
+using __gnu_cxx::hash_map; //__gnu_cxx is where gcc sticks nonstandard STL stuff
 #include <boost/tuple/tuple.hpp>
 using boost::tuple;
 #include "svm_struct/svm_struct_common.h"
@@ -84,35 +96,71 @@ void printLabelSeq(LABEL y)
 
 namespace
 {
-class hashString
-{
-	public:
+/*
+tag ids are dense, from 0 in order of first appearance in the training set (or as listed in a model), so the tags
+themselves are just an array; the other direction is an open-addressing table of ids, hashed by tag string with
+linear probing, kept at most a quarter full so a lookup is almost always one probe and one string comparison
 
-		hashString() {}
+the registry only changes while reading the training set or a model
+*/
+vector<tag> idToTag;
+vector<tagID> tagTable; //size a power of 2; NO_TAG marks an empty slot
+const tagID NO_TAG = (tagID)-1;
 
-		size_t operator () (const string& s) const
-		{
-			return hasher(s.c_str());
-		}
+/*
+during classification, we read in the training-set tags from the model, then
+the test-set tags from the input; we want to register the first set but not the second,
+so provide a flag; a registry that isn't writable is never modified, so any number of threads can look tags up
+*/
+bool registryWritable = true;
 
-	private:
+size_t hashTag(const tag& t)
+{
+	size_t h = 2166136261u; //FNV-1a
+	for(size_t i = 0; i < t.length(); i++) h = (h ^ (unsigned char)t[i]) * 16777619u;
+	return h;
+}
 
-		static const hash<const char*> hasher;
-};
-const hash<const char*> hashString::hasher = hash<const char*>();
+/*
+return the slot of tagTable that holds t, or the empty slot where it would go
+*/
+size_t findTagSlot(const tag& t)
+{
+	const size_t mask = tagTable.size() - 1;
+	size_t i = hashTag(t) & mask;
+	while(tagTable[i] != NO_TAG && idToTag[tagTable[i]] != t) i = (i + 1) & mask;
+	return i;
+}
 
-hash_map<tagID, tag> idToTagMap;
-hash_map<string, tagID, hashString> tagToIDMap;
+void rebuildTagTable()
+{
+	size_t size = 16;
+	while(size < 4 * idToTag.size()) size *= 2;
+	tagTable.assign(size, NO_TAG);
+	for(tagID id = 0; id < idToTag.size(); id++)
+		if(!idToTag[id].empty()) tagTable[findTagSlot(idToTag[id])] = id;
+}
 
 /*
-during classification, we read in the training-set tags from the model, then
-the test-set tags from the input; we want to register the first set but not the second,
-so provide a flag
+auxiliary to read_struct_model(): give a tag the id the model has for it, whether or not the registry is writable
 */
-bool registryWritable = true;
+void setTagID(const tag& t, tagID id)
+{
+	if(id >= idToTag.size()) idToTag.resize(id + 1);
+	idToTag[id] = t;
+	numRegisteredTags = idToTag.size();
+	rebuildTagTable();
+}
+
+/*
+auxiliary to svm_struct_classify_api_exit(): forget the model's tags
+*/
+void clearTagRegistry();
 
 }
 
+unsigned int numRegisteredTags = 0;
+
 void setTagRegistryWritable(bool w)
 {
 	registryWritable = w;
@@ -124,36 +172,430 @@ return a newly assigned unique tag ID
 */
 tagID registerTag(const tag& t)
 {
-	hash_map<string, tagID, hashString>::iterator i = tagToIDMap.find(t);
-	if(i != tagToIDMap.end()) //tag has been registered
-		return (*i).second;
+	if(tagTable.empty()) rebuildTagTable();
+	const size_t slot = findTagSlot(t);
+	if(tagTable[slot] != NO_TAG) //tag has been registered
+		return tagTable[slot];
 	else if(registryWritable) //tag has not been registered
 	{
-		idToTagMap[idToTagMap.size()] = t;
-		tagToIDMap[t] = idToTagMap.size() - 1;
-		return idToTagMap.size() - 1;
+		const tagID id = idToTag.size();
+		idToTag.push_back(t);
+		numRegisteredTags = idToTag.size();
+		if(4 * idToTag.size() > tagTable.size()) rebuildTagTable();
+		else tagTable[slot] = id;
+		return id;
 	}
 	else //tag has not been registered, but registry is read-only
 		return -1; //wraps to UINT_MAX
 }
 
+const tag& getTagByID(tagID id) throw(invalid_argument)
+{
+	if(id >= idToTag.size()) throw invalid_argument("getTagByID(): unknown ID");
+	return idToTag[id];
+}
+
+namespace
+{
+void clearTagRegistry()
+{
+	idToTag.clear();
+	tagTable.clear();
+	numRegisteredTags = 0;
+	registryWritable = true;
+}
+}
+
+/************** features **************/
+
+namespace
+{
+/*
+if the training features were cut off by frequency (--f), the surviving input feature numbers
+are renumbered 1..K in increasing order, so psi's per-tag blocks only hold features we learn weights for;
+the map is written to the model and applied to the test input
+
+both are empty if no cutoff was done
+*/
+hash_map<featureID, featureID> featureIDMap; //input feature number -> compacted number
+vector<featureID> inputFeatureIDs; //compacted number - 1 -> input feature number
+
+/*
+second-order models (--t 2) score tag trigrams as well as tag pairs; only the trigrams seen in the training labels get a
+weight (and are written to the model), and decoding only considers those
+*/
+vector<vector<tagID> > trigramPredecessors; //y1 * #tags + y2 -> the y0 of the allowed trigrams (y0, y1, y2), increasing
+vector<featureID> trigramOffsets; //y1 * #tags + y2 -> the number of allowed trigrams before (y1, y2)'s, in the order of (y1, y2, y0)
+featureID numTrigrams = 0;
+
+void addTrigram(tagID y0, tagID y1, tagID y2)
+{
+	vector<tagID>& p = trigramPredecessors[y1 * getNumTags() + y2];
+	const vector<tagID>::iterator i = lower_bound(p.begin(), p.end(), y0);
+	if(i == p.end() || *i != y0) p.insert(i, y0);
+}
+
+/*
+number the allowed trigrams once they've all been added
+*/
+void indexTrigrams()
+{
+	trigramOffsets.resize(trigramPredecessors.size());
+	numTrigrams = 0;
+	for(size_t i = 0; i < trigramPredecessors.size(); i++)
+	{
+		trigramOffsets[i] = numTrigrams;
+		numTrigrams += trigramPredecessors[i].size();
+	}
+}
+
 /*
-return the number of tags that have been registered
-(registering is done while reading input)
+auxiliary to svm_struct_classify_api_exit(): forget the model's feature numbering and trigrams
 */
-unsigned int getNumTags()
+void clearFeatureMaps()
 {
-	return idToTagMap.size();
+	featureIDMap.clear();
+	inputFeatureIDs.clear();
+	trigramPredecessors.clear();
+	trigramOffsets.clear();
+	numTrigrams = 0;
 }
 
-const tag& getTagByID(tagID id) throw(invalid_argument)
+/*
+auxiliary to read_struct_examples(): replace the input feature numbers in a token's
+(0-terminated, sorted) word list by their compacted numbers, dropping unmapped features;
+the renumbering is monotonic, so the list stays sorted
+*/
+void remapFeatureVector(SVECTOR& features)
+{
+	unsigned int numFeats = 0;
+	for(WORD* w = features.words; w->wnum != 0; w++)
+	{
+		hash_map<featureID, featureID>::const_iterator i = featureIDMap.find(w->wnum);
+		if(i != featureIDMap.end())
+		{
+			features.words[numFeats].wnum = (*i).second;
+			features.words[numFeats].weight = w->weight;
+			numFeats++;
+		}
+	}
+	features.words[numFeats].wnum = 0;
+	features.words = (WORD*)realloc(features.words, (numFeats + 1) * sizeof(WORD));
+}
+
+/*
+auxiliary to read_struct_examples(): drop features seen in fewer than minFreq tokens
+and renumber the rest densely, starting at 1; return the new feature space size
+*/
+featureID compactFeatureSpace(vector<shared_ptr<vector<token> > >& tokens, const hash_map<featureID, unsigned long>& featureFreqs, unsigned long minFreq)
+{
+	featureIDMap.clear();
+	inputFeatureIDs.clear();
+	for(hash_map<featureID, unsigned long>::const_iterator i = featureFreqs.begin(); i != featureFreqs.end(); i++)
+		if((*i).second >= minFreq)
+			inputFeatureIDs.push_back((*i).first);
+	sort(inputFeatureIDs.begin(), inputFeatureIDs.end());
+	for(size_t i = 0; i < inputFeatureIDs.size(); i++)
+		featureIDMap[inputFeatureIDs[i]] = i + 1;
+	for(size_t i = 0; i < tokens.size(); i++)
+		if(tokens[i].get() != NULL)
+			for(size_t j = 0; j < tokens[i]->size(); j++)
+				remapFeatureVector((*tokens[i])[j].getFeatureMap());
+	return inputFeatureIDs.size();
+}
+
+}
+
+/********* token feature maps *********/
+
+namespace
+{
+/*
+an explicit approximate feature map for a kernel on token features (--x): with phi(a) * phi(b) ~ k(a, b), the linear
+model over the mapped tokens gives kernel-quality emissions, and the decoders only need w
+
+the training tokens are mapped in init_struct_model(), the test tokens as they are read; the map is written to the model
+*/
+enum {TOKEN_MAP_NONE = 0, TOKEN_MAP_RANDOM_FOURIER = 1, TOKEN_MAP_NYSTROEM = 2};
+struct tokenFeatureMap
+{
+	tokenFeatureMap() : type(TOKEN_MAP_NONE), dim(0), inputSize(0), seed(1) {}
+
+	int type;
+	long dim; //number of output features
+	featureID inputSize; //input feature numbers run from 1 to this
+	KERNEL_PARM kernel; //the kernel approximated (type, degree, gamma, coefficients)
+	unsigned long seed; //for the random Fourier features and landmark sampling
+	vector<SVECTOR*> landmarks; //Nystroem
+	vector<double> projection; //Nystroem: output feature d is the sum over i of projection[d * #landmarks + i] * k(landmark i, x)
+} tokenMap;
+
+/*
+auxiliary to the random feature maps: a well-mixed function of a 64-bit key (splitmix64)
+*/
+uint64_t mixBits(uint64_t z)
+{
+	z += 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/*
+uniform in (0, 1), determined by the key
+*/
+double hashUniform(uint64_t key)
+{
+	return ((mixBits(key) >> 11) + 0.5) / 9007199254740992.0; //2^53
+}
+
+/*
+standard normal, determined by the key (Box-Muller)
+*/
+double hashGaussian(uint64_t key)
+{
+	return sqrt(-2 * log(hashUniform(key))) * cos(2 * M_PI * hashUniform(key ^ 0x5DEECE66DULL));
+}
+
+/*
+auxiliary to buildNystroemMap(): eigendecomposition of the symmetric n x n matrix a (row-major; destroyed) by cyclic Jacobi rotations;
+eigenvector i is column i of v
+*/
+void symmetricEigen(vector<double>& a, unsigned int n, vector<double>& eigenvalues, vector<double>& v)
+{
+	v.assign(n * n, 0.0);
+	for(unsigned int i = 0; i < n; i++) v[i * n + i] = 1;
+	for(unsigned int sweep = 0; sweep < 100; sweep++)
+	{
+		double offDiagonal = 0, diagonal = 0;
+		for(unsigned int i = 0; i < n; i++)
+		{
+			diagonal += sqr(a[i * n + i]);
+			for(unsigned int j = i + 1; j < n; j++) offDiagonal += sqr(a[i * n + j]);
+		}
+		if(offDiagonal <= 1e-22 * diagonal) break;
+		for(unsigned int p = 0; p < n; p++)
+			for(unsigned int q = p + 1; q < n; q++)
+			{
+				const double apq = a[p * n + q];
+				if(fabs(apq) < 1e-300) continue;
+				const double theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+				const double t = ((theta >= 0) ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+				const double c = 1 / sqrt(t * t + 1), s = t * c;
+				for(unsigned int k = 0; k < n; k++) //rotate columns p and q
+				{
+					const double akp = a[k * n + p], akq = a[k * n + q];
+					a[k * n + p] = c * akp - s * akq;
+					a[k * n + q] = s * akp + c * akq;
+				}
+				for(unsigned int k = 0; k < n; k++) //rotate rows p and q
+				{
+					const double apk = a[p * n + k], aqk = a[q * n + k];
+					a[p * n + k] = c * apk - s * aqk;
+					a[q * n + k] = s * apk + c * aqk;
+				}
+				for(unsigned int k = 0; k < n; k++)
+				{
+					const double vkp = v[k * n + p], vkq = v[k * n + q];
+					v[k * n + p] = c * vkp - s * vkq;
+					v[k * n + q] = s * vkp + c * vkq;
+				}
+			}
+	}
+	eigenvalues.resize(n);
+	for(unsigned int i = 0; i < n; i++) eigenvalues[i] = a[i * n + i];
+}
+
+/*
+auxiliary to the Nystroem map: the approximated kernel on a landmark, whose norm is set when it's made (so the landmarks
+are only read while tokens are mapped), and a token vector
+*/
+double tokenKernel(SVECTOR* landmark, SVECTOR* b)
+{
+	b->twonorm_sq = sprod_ss(b, b);
+	return single_kernel(&tokenMap.kernel, landmark, b);
+}
+
+/*
+auxiliary to buildNystroemMap() and read_struct_model()
+*/
+void addLandmark(SVECTOR* landmark)
+{
+	landmark->twonorm_sq = sprod_ss(landmark, landmark);
+	tokenMap.landmarks.push_back(landmark);
+}
+/*
+sample numLandmarks distinct nonempty training tokens and set the projection to K^-1/2 (over the eigenvalues that aren't ~0),
+where K is the kernel matrix of the landmarks
+*/
+void buildNystroemMap(const vector<SVECTOR*>& tokens, unsigned int numLandmarks)
+{
+	vector<SVECTOR*> candidates;
+	for(unsigned int i = 0; i < tokens.size(); i++)
+		if(tokens[i]->words[0].wnum != 0) candidates.push_back(tokens[i]);
+	if(numLandmarks > candidates.size()) numLandmarks = candidates.size();
+	for(unsigned int i = 0; i < numLandmarks; i++) //partial Fisher-Yates shuffle
+	{
+		const unsigned int j = i + (unsigned int)(hashUniform(tokenMap.seed * 0x100000001B3ULL + i) * (candidates.size() - i));
+		swap(candidates[i], candidates[j]);
+		addLandmark(copy_svector(candidates[i]));
+	}
+
+	const unsigned int m = numLandmarks;
+	vector<double> gram(m * m), eigenvalues, eigenvectors;
+	for(unsigned int i = 0; i < m; i++)
+		for(unsigned int j = 0; j <= i; j++)
+			gram[i * m + j] = gram[j * m + i] = tokenKernel(tokenMap.landmarks[i], tokenMap.landmarks[j]);
+	symmetricEigen(gram, m, eigenvalues, eigenvectors);
+	double maxEigenvalue = 0;
+	for(unsigned int i = 0; i < m; i++) maxEigenvalue = max(maxEigenvalue, eigenvalues[i]);
+	tokenMap.projection.clear();
+	for(unsigned int d = 0; d < m; d++)
+		if(eigenvalues[d] > 1e-10 * maxEigenvalue)
+			for(unsigned int i = 0; i < m; i++)
+				tokenMap.projection.push_back(eigenvectors[i * m + d] / sqrt(eigenvalues[d]));
+	tokenMap.dim = (m > 0) ? tokenMap.projection.size() / m : 0;
+}
+
+/*
+replace a token's features by their image under the token feature map (all output features are stored, since they're dense)
+*/
+void applyTokenFeatureMap(SVECTOR& features)
+{
+	vector<double> image(tokenMap.dim, 0.0);
+	if(tokenMap.type == TOKEN_MAP_RANDOM_FOURIER) //sqrt(2 / D) cos(omega_d * x + b_d), omega_d ~ N(0, 2 gamma I), b_d ~ U[0, 2 pi)
+	{
+		const double scale = sqrt(2 * tokenMap.kernel.rbf_gamma);
+		for(long d = 0; d < tokenMap.dim; d++)
+		{
+			const uint64_t rowKey = mixBits(tokenMap.seed ^ ((uint64_t)d << 32));
+			double projection = 2 * M_PI * hashUniform(rowKey);
+			for(const WORD* f = features.words; f->wnum != 0; f++)
+				projection += f->weight * scale * hashGaussian(rowKey + f->wnum);
+			image[d] = sqrt(2.0 / tokenMap.dim) * cos(projection);
+		}
+	}
+	else if(tokenMap.type == TOKEN_MAP_NYSTROEM)
+	{
+		const unsigned int m = tokenMap.landmarks.size();
+		vector<double> kernelValues(m);
+		for(unsigned int i = 0; i < m; i++) kernelValues[i] = tokenKernel(tokenMap.landmarks[i], &features);
+		for(long d = 0; d < tokenMap.dim; d++)
+			for(unsigned int i = 0; i < m; i++)
+				image[d] += tokenMap.projection[d * m + i] * kernelValues[i];
+	}
+	free(features.words);
+	features.words = (WORD*)my_malloc((tokenMap.dim + 1) * sizeof(WORD));
+	for(long d = 0; d < tokenMap.dim; d++)
+	{
+		features.words[d].wnum = d + 1;
+		features.words[d].weight = image[d];
+	}
+	features.words[tokenMap.dim].wnum = 0;
+}
+
+}
+
+/*
+auxiliary to svm_struct_learn/classify_api_exit()
+*/
+void free_token_feature_map()
+{
+	for(unsigned int i = 0; i < tokenMap.landmarks.size(); i++) free_svector(tokenMap.landmarks[i]);
+	tokenMap = tokenFeatureMap();
+}
+
+/*
+on classification, store a token's input features as the model sees them: in the training numbering (dropping features that
+were cut off or have higher numbers than any seen during training), then through the token feature map if the model has one
+
+only reads the model's maps, so tokens can be mapped in several threads at once, except with a Nystroem map, whose kernel
+evaluations count svm-light's kernel statistics
+*/
+void map_token_features(const vector<pair<featureID, double> >& input, SVECTOR& features, STRUCT_LEARN_PARM* sparm)
+{
+	const featureID maxInputFeature = (tokenMap.type != TOKEN_MAP_NONE) ? tokenMap.inputSize : sparm->featureSpaceSize;
+	features.words = (WORD*)realloc(features.words, (input.size() + 1) * sizeof(WORD));
+	unsigned int numFeats = 0;
+	for(size_t i = 0; i < input.size(); i++)
+	{
+		featureID featNum = input[i].first;
+		if(!featureIDMap.empty()) //the model was trained on compacted features
+		{
+			hash_map<featureID, featureID>::const_iterator m = featureIDMap.find(featNum);
+			if(m == featureIDMap.end()) continue;
+			featNum = (*m).second;
+		}
+		else if(featNum > maxInputFeature) continue;
+		features.words[numFeats].wnum = featNum; //feature numbers start at 1 in the input
+		features.words[numFeats++].weight = input[i].second;
+	}
+	features.words[numFeats].wnum = 0; //signal to end word list
+	if(tokenMap.type != TOKEN_MAP_NONE) applyTokenFeatureMap(features);
+}
+
+/*
+auxiliary to init_struct_model(): set up the token feature map for the kernel in kparm from the training tokens, map them,
+and switch the learner to the linear kernel
+*/
+void init_token_feature_map(SAMPLE sample, STRUCT_LEARN_PARM* sparm, KERNEL_PARM* kparm)
 {
-	if(idToTagMap.find(id) == idToTagMap.end()) throw invalid_argument("getTagByID(): unknown ID");
-	return idToTagMap[id];
+	tokenMap.type = sparm->tokenFeatureMap;
+	tokenMap.inputSize = sparm->featureSpaceSize;
+	tokenMap.kernel = *kparm;
+	vector<SVECTOR*> tokens;
+	for(long i = 0; i < sample.n; i++)
+		for(unsigned int j = 0; j < sample.examples[i].x.getLength(); j++)
+			tokens.push_back(&sample.examples[i].x.getToken(j).getFeatureMap());
+	if(tokenMap.type == TOKEN_MAP_RANDOM_FOURIER)
+	{
+		if(kparm->kernel_type != RBF)
+		{
+			fprintf(stderr, "init_struct_model(): random Fourier features (--x 1) approximate the rbf kernel (-t 2) only; exiting\n");
+			exit(-1);
+		}
+		tokenMap.dim = sparm->tokenFeatureMapDim;
+	}
+	else if(tokenMap.type == TOKEN_MAP_NYSTROEM)
+		buildNystroemMap(tokens, sparm->tokenFeatureMapDim);
+	else
+	{
+		fprintf(stderr, "init_struct_model(): unknown token feature map %d; exiting\n", tokenMap.type);
+		exit(-1);
+	}
+	if(tokenMap.dim <= 0)
+	{
+		fprintf(stderr, "init_struct_model(): the token feature map has no dimensions; exiting\n");
+		exit(-1);
+	}
+	for(unsigned int i = 0; i < tokens.size(); i++) applyTokenFeatureMap(*tokens[i]);
+	sparm->featureSpaceSize = tokenMap.dim;
+	kparm->kernel_type = LINEAR; //the kernel is in the tokens now
+	printf("mapped the training tokens to %ld features approximating kernel %ld; learning a linear model\n", tokenMap.dim, tokenMap.kernel.kernel_type);
 }
 
 /************* class token ************/
 
+/*
+deleter for a token's features: the word list and userdefined are malloc'ed
+*/
+void freeTokenFeatures(SVECTOR* features)
+{
+	free(features->words);
+	free(features->userdefined);
+	delete features;
+}
+
+/*
+deleter for the features of a token that doesn't own its word list
+*/
+void freeBorrowedTokenFeatures(SVECTOR* features)
+{
+	delete features;
+}
+
+char noUserdefined[1] = {0}; //for tokens that don't own their word list
+
 token::token()
 {
 	initFeatures();
@@ -164,6 +606,17 @@ token::token(const string& s) : str(s)
 	initFeatures();
 }
 
+token::token(WORD* words)
+{
+	features = shared_ptr<SVECTOR>(new SVECTOR, freeBorrowedTokenFeatures);
+	features->words = words;
+	features->userdefined = noUserdefined;
+	features->next = NULL;
+	features->factor = 1;
+	features->twonorm_sq = -1;
+	features->kernel_id = 0;
+}
+
 token::token(const token& t) : str(t.str)
 {
 	features = t.features;
@@ -181,7 +634,7 @@ should only be called from a constructor
 */
 void token::initFeatures()
 {
-	features = shared_ptr<SVECTOR>(new SVECTOR);
+	features = shared_ptr<SVECTOR>(new SVECTOR, freeTokenFeatures);
 	features->words = (WORD*)my_malloc(sizeof(WORD));
 	features->words[0].wnum = 0;
 	//svmlight yells if userdefined is NULL; it must have at least one element
@@ -236,254 +689,2172 @@ istream& operator >> (istream& in, const strMatcher& m)
 	return in;
 }
 
-/**************************************/
+/********** compressed input **********/
 
-void        svm_struct_learn_api_init(int argc, char* argv[])
+namespace
 {
-  /* Called in learning part before anything else is done to allow
-     any initializations that might be necessary. */
-}
+enum {INPUT_PLAIN, INPUT_GZIP, INPUT_ZSTD, INPUT_DATASET};
 
-void        svm_struct_learn_api_exit()
+/*
+auxiliary to read_struct_examples(): tell the format of an open file by its magic bytes, and rewind it
+*/
+int detectInputFormat(FILE* fp)
 {
-  /* Called in learning part at the very end to allow any clean-up
-     that might be necessary. */
+	unsigned char magic[8];
+	const size_t n = fread(magic, 1, 8, fp);
+	rewind(fp);
+	if(n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) return INPUT_GZIP;
+	if(n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) return INPUT_ZSTD;
+	if(n == 8 && memcmp(magic, "SVMHMMD1", 8) == 0) return INPUT_DATASET; //see datasetHeader
+	return INPUT_PLAIN;
 }
 
-void        svm_struct_classify_api_init(int argc, char* argv[])
-{
-  /* Called in prediction part before anything else is done to allow
-     any initializations that might be necessary. */
-}
+/*
+an input streambuf over a gzip or zstd file
 
-void        svm_struct_classify_api_exit()
+a reader thread reads and decompresses the file into a small ring of large blocks while the parser works through the
+previous ones, so that the I/O and decompression overlap with parsing (a deflate or zstd stream can't itself be
+decompressed in parallel); concatenated gzip members and zstd frames are read one after another
+
+errors in the data are reported when the parser reaches them
+*/
+class decompressingStreambuf : public streambuf
 {
-  /* Called in prediction part at the very end to allow any clean-up
-     that might be necessary. */
-}
+	public:
 
-/**************************************/
+		decompressingStreambuf(FILE* fp, int format);
+		virtual ~decompressingStreambuf();
 
-/*
-this function gets called by both the learning and prediction modules
+		const string& getError() const {return error;} //empty unless the data was bad
 
-automatically generate the feature vector filename from the POS filename: POS_BASE.ext -> POS_BASE_feats.dat
+	protected:
 
-NOTE we want this to be called before init_struct_model() so we'll have defined the input language size
-*/
-SAMPLE      read_struct_examples(const char *filename, STRUCT_LEARN_PARM *sparm)
-{
-	/*
-	if we're reading the training set, fSS hasn't been set; if we're on classification,
-	it was set when we read in the model
-	*/
-	bool onClassification = (sparm->featureSpaceSize != 0);
+		virtual int_type underflow();
 
-  /* Reads struct examples and returns them in sample. The number of
-     examples must be written into sample.n */
-  SAMPLE   sample;
+	private:
 
-  //holding space until we allocate sample.examples; note the shared_ptr default ctor gives a null pointer
-  vector<shared_ptr<vector<token> > > tokens;
-  vector<shared_ptr<vector<tagID> > > tagIDs;
+		static const size_t BLOCK_SIZE = 1 << 20, NUM_BLOCKS = 4, READ_SIZE = 1 << 16;
 
-  ifstream infile(filename);
-  if(!infile)
-  {
-	  fprintf(stderr, "read_struct_examples(): can't open '%s' for reading; exiting\n", filename);
-	  exit(-1);
-  }
+		static void* run(void* self);
+		void decompressGzip();
+		void decompressZstd();
+		/*
+		hand a full block to the parser and get an empty one back; return false if the parser has stopped reading
+		*/
+		bool pushBlock(string& block);
+		void finish(const string& err);
+
+		FILE* fp;
+		const int format;
+		pthread_t reader;
+		pthread_mutex_t mutex;
+		pthread_cond_t blockReady, blockFree;
+		string blocks[NUM_BLOCKS]; //ring of decompressed blocks waiting to be parsed
+		unsigned int firstBlock, numBlocks;
+		bool done, stopped; //the reader has finished; the parser doesn't want more
+		string error;
+		string current; //the block being parsed
+
+		decompressingStreambuf(const decompressingStreambuf&);
+		const decompressingStreambuf& operator = (const decompressingStreambuf&);
+};
 
-  unsigned int lineNum = 0;
-  string line, comment, _tag, word;
-  unsigned int exNum, exIndex, featNum, maxFeatNumFound = 0;
-  double featVal;
-  while(getline(infile, line, '\n') && line.length() > 0) //an empty line ends input
-  {
-#define PARSE_ERROR(infoDesc, lineNo)\
-	{\
-		fprintf(stderr, "parse error reading %s on line %u of '%s'", infoDesc, lineNo, filename);\
-		exit(-1);\
+decompressingStreambuf::decompressingStreambuf(FILE* fp, int format) : fp(fp), format(format), firstBlock(0), numBlocks(0), done(false), stopped(false)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&blockReady, NULL);
+	pthread_cond_init(&blockFree, NULL);
+	setg(NULL, NULL, NULL);
+	if(pthread_create(&reader, NULL, run, this) != 0)
+	{
+		perror("pthread_create");
+		exit(1);
 	}
-		//if there's a comment on the line, remove it into another string
-		size_t commentIndex = line.find("#", line.find_first_of("1234567890")); //a # before the feature list must be a word; don't remove it
-		if(commentIndex != string::npos)
-		{
-			comment = line.substr(commentIndex + 1);
-			line = line.substr(0, commentIndex);
-		}
-		else comment = "";
-		//parse tag
-		istringstream instr(line);
-		if(!(instr >> _tag >> match(" qid:") >> exNum >> match(".") >> exIndex)) PARSE_ERROR("token info", lineNum);
-		//resize temporary storage of tokens and tags
-		if(tokens.size() < exNum) //input example and token numbers start at 1
-		{
-			tokens.resize(exNum);
-			tagIDs.resize(exNum);
+}
+
+decompressingStreambuf::~decompressingStreambuf()
+{
+	pthread_mutex_lock(&mutex);
+	stopped = true; //we may not have read to the end
+	pthread_cond_signal(&blockFree);
+	pthread_mutex_unlock(&mutex);
+	pthread_join(reader, NULL);
+	pthread_cond_destroy(&blockFree);
+	pthread_cond_destroy(&blockReady);
+	pthread_mutex_destroy(&mutex);
+}
+
+void* decompressingStreambuf::run(void* self)
+{
+	decompressingStreambuf* b = static_cast<decompressingStreambuf*>(self);
+	if(b->format == INPUT_GZIP) b->decompressGzip();
+	else b->decompressZstd();
+	return NULL;
+}
+
+bool decompressingStreambuf::pushBlock(string& block)
+{
+	pthread_mutex_lock(&mutex);
+	while(numBlocks == NUM_BLOCKS && !stopped) pthread_cond_wait(&blockFree, &mutex);
+	const bool keepGoing = !stopped;
+	if(keepGoing)
+	{
+		blocks[(firstBlock + numBlocks) % NUM_BLOCKS].swap(block);
+		numBlocks++;
+		pthread_cond_signal(&blockReady);
+	}
+	pthread_mutex_unlock(&mutex);
+	block.clear();
+	return keepGoing;
+}
+
+void decompressingStreambuf::finish(const string& err)
+{
+	pthread_mutex_lock(&mutex);
+	done = true;
+	error = err;
+	pthread_cond_signal(&blockReady);
+	pthread_mutex_unlock(&mutex);
+}
+
+decompressingStreambuf::int_type decompressingStreambuf::underflow()
+{
+	if(gptr() < egptr()) return traits_type::to_int_type(*gptr());
+	pthread_mutex_lock(&mutex);
+	while(numBlocks == 0 && !done) pthread_cond_wait(&blockReady, &mutex);
+	if(numBlocks == 0)
+	{
+		pthread_mutex_unlock(&mutex);
+		return traits_type::eof();
+	}
+	current.swap(blocks[firstBlock]);
+	firstBlock = (firstBlock + 1) % NUM_BLOCKS;
+	numBlocks--;
+	pthread_cond_signal(&blockFree);
+	pthread_mutex_unlock(&mutex);
+	setg(&current[0], &current[0], &current[0] + current.length());
+	return traits_type::to_int_type(*gptr());
+}
+
+void decompressingStreambuf::decompressGzip()
+{
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if(inflateInit2(&z, 15 + 32) != Z_OK) //32: expect a gzip (or zlib) header
+	{
+		finish("can't initialize zlib");
+		return;
+	}
+	vector<unsigned char> in(READ_SIZE);
+	string block(BLOCK_SIZE, '\0');
+	size_t blockLength = 0;
+	bool streamEnded = false;
+	string err;
+	while(err.empty())
+	{
+		if(z.avail_in == 0)
+		{
+			z.next_in = &in[0];
+			z.avail_in = fread(&in[0], 1, in.size(), fp);
+			if(z.avail_in == 0)
+			{
+				if(ferror(fp)) err = "read error";
+				else if(!streamEnded) err = "the gzip data is truncated";
+				break;
+			}
 		}
-		if(tokens[exNum - 1].get() == NULL)
+		if(streamEnded)
 		{
-			tokens[exNum - 1] = shared_ptr<vector<token> >(new vector<token>);
-			tagIDs[exNum - 1] = shared_ptr<vector<tagID> >(new vector<tagID>);
+			if(z.next_in[0] != 0x1f) break; //trailing padding after the last member, which gzip ignores too
+			inflateReset(&z); //another member follows
+			streamEnded = false;
 		}
-		if(tokens[exNum - 1]->size() < exIndex)
+		z.next_out = reinterpret_cast<unsigned char*>(&block[blockLength]);
+		z.avail_out = BLOCK_SIZE - blockLength;
+		const int ret = inflate(&z, Z_NO_FLUSH);
+		blockLength = BLOCK_SIZE - z.avail_out;
+		if(ret == Z_STREAM_END) streamEnded = true;
+		else if(ret != Z_OK && ret != Z_BUF_ERROR) err = string("bad gzip data") + (z.msg ? string(" (") + z.msg + ")" : "");
+		if(blockLength == BLOCK_SIZE)
 		{
-			tokens[exNum - 1]->resize(exIndex);
-			tagIDs[exNum - 1]->resize(exIndex);
+			block.resize(blockLength);
+			if(!pushBlock(block)) break;
+			block.resize(BLOCK_SIZE);
+			blockLength = 0;
 		}
-		(*tagIDs[exNum - 1])[exIndex - 1] = registerTag(_tag); //returns a new id only if the tag hasn't been seen before
-		//parse features
-		SVECTOR& features = (*tokens[exNum - 1])[exIndex - 1].getFeatureMap();
-		unsigned int numFeats = 0;
-		while(instr >> featNum >> match(":") >> featVal)
+	}
+	inflateEnd(&z);
+	block.resize(blockLength);
+	if(blockLength > 0) pushBlock(block);
+	finish(err);
+}
+
+void decompressingStreambuf::decompressZstd()
+{
+#ifdef HAVE_ZSTD
+	ZSTD_DStream* z = ZSTD_createDStream();
+	if(z == NULL || ZSTD_isError(ZSTD_initDStream(z)))
+	{
+		finish("can't initialize zstd");
+		return;
+	}
+	vector<char> in(ZSTD_DStreamInSize());
+	ZSTD_inBuffer input = {&in[0], 0, 0};
+	string block(BLOCK_SIZE, '\0');
+	ZSTD_outBuffer output = {&block[0], BLOCK_SIZE, 0};
+	size_t frameLeft = 0; //nonzero while inside a frame
+	string err;
+	while(err.empty())
+	{
+		if(input.pos == input.size)
+		{
+			input.size = fread(&in[0], 1, in.size(), fp);
+			input.pos = 0;
+			if(input.size == 0)
+			{
+				if(ferror(fp)) err = "read error";
+				else if(frameLeft != 0) err = "the zstd data is truncated";
+				break;
+			}
+		}
+		frameLeft = ZSTD_decompressStream(z, &output, &input);
+		if(ZSTD_isError(frameLeft)) err = string("bad zstd data (") + ZSTD_getErrorName(frameLeft) + ")";
+		if(output.pos == output.size)
+		{
+			if(!pushBlock(block)) break;
+			block.resize(BLOCK_SIZE);
+			output.dst = &block[0];
+			output.pos = 0;
+		}
+	}
+	ZSTD_freeDStream(z);
+	block.resize(output.pos);
+	if(output.pos > 0) pushBlock(block);
+	finish(err);
+#else
+	finish("this program was built without zstd support (build with 'make ZSTD=1')");
+#endif
+}
+}
+
+/*********** out-of-core data ***********/
+
+namespace
+{
+/*
+a dataset file for out-of-core training (--o): the training input is written to it a sentence at a time, and it's then
+memory-mapped, so each pass over the examples pages them in as it gets to them instead of keeping them all in memory
+
+	header (datasetHeader)
+	a record per sentence, 8-byte aligned:
+		uint32 length, uint32 0, uint32 tag id per token (padded to 8 bytes)
+		per token: uint64 number of WORDs including the one ending the list, the WORDs
+	uint64 offset of each record
+	per tag in id order: uint32 length of the name, the name
+
+the WORDs have the in-memory layout, so the tokens use them in place; numbers are in the byte order of the machine and
+WORD is that of the build that wrote the file (which is checked): the file is a cache for training, not an exchange format
+*/
+struct datasetHeader
+{
+	char magic[8]; //DATASET_MAGIC
+	uint32_t wordSize; //sizeof(WORD)
+	uint32_t numTags;
+	uint64_t numExamples;
+	int64_t featureSpaceSize; //largest feature number
+	uint64_t indexOffset, tagsOffset;
+};
+const char DATASET_MAGIC[8] = {'S', 'V', 'M', 'H', 'M', 'M', 'D', '1'};
+/*
+the part of the mapping kept in memory is about three chunks of this size (see adviseDatasetAccess())
+*/
+const size_t DATASET_CHUNK = 16 << 20;
+
+string datasetFilename; //--o; empty if the examples are read into memory
+
+struct mappedDataset
+{
+	char* base;
+	size_t size;
+	size_t lastChunk; //of the record read last
+};
+vector<mappedDataset*> mappedDatasets; //one per out-of-core sample not yet freed; usually just the training set
+
+/*
+auxiliary to read_struct_examples() and writeDataset(): parse an input line (lineNum counts from 0) into its tag, example
+and token numbers, features in input order and numbering, and the token string given in the comment (empty if none)
+*/
+void parseTokenLine(string& line, unsigned long lineNum, const char* filename, string& tagStr, unsigned long& exNum, unsigned long& exIndex,
+	vector<pair<featureID, double> >& features, string& word)
+{
+#define PARSE_ERROR(infoDesc, lineNo)\
+	{\
+		fprintf(stderr, "parse error reading %s on line %lu of '%s'", infoDesc, lineNo, filename);\
+		exit(-1);\
+	}
+	//if there's a comment on the line, remove it into another string
+	string comment;
+	size_t commentIndex = line.find("#", line.find_first_of("1234567890")); //a # before the feature list must be a word; don't remove it
+	if(commentIndex != string::npos)
+	{
+		comment = line.substr(commentIndex + 1);
+		line = line.substr(0, commentIndex);
+	}
+	//parse tag
+	istringstream instr(line);
+	if(!(instr >> tagStr >> match(" qid:") >> exNum >> match(".") >> exIndex)) PARSE_ERROR("token info", lineNum);
+	//parse features
+	featureID featNum;
+	double featVal;
+	features.clear();
+	while(instr >> featNum >> match(":") >> featVal)
+	{
+		if(featNum < 1 || featNum > FNUM_MAX) PARSE_ERROR("feature number (out of range; define LARGE_INDEX in svm_common.h for 64-bit ids)", lineNum);
+		features.push_back(make_pair(featNum, featVal));
+	}
+	if(instr.bad()) PARSE_ERROR("features", lineNum); //read error, as opposed to just reaching end of line
+	//parse the comment (first word, if any, is interpreted as the token string; rest is ignored)
+	word.clear();
+	size_t wordStart = comment.find_first_not_of(" \t\n\r");
+	if(wordStart != string::npos) //the comment contains non-whitespace
+	{
+		comment = comment.substr(wordStart, comment.find_last_not_of(" \t\n\r") + 1); //trim whitespace
+		istringstream incomment(comment);
+		incomment >> word;
+	}
+#undef PARSE_ERROR
+}
+
+/*
+auxiliary to writeDataset(): write size bytes and pad them with zeros to a multiple of 8
+*/
+void writePadded(FILE* fp, const void* data, size_t size, const string& filename)
+{
+	static const char zeros[8] = {0};
+	const size_t padding = (8 - size % 8) % 8;
+	if(fwrite(data, 1, size, fp) != size || fwrite(zeros, 1, padding, fp) != padding)
+	{
+		fprintf(stderr, "writeDataset(): can't write to '%s'; exiting\n", filename.c_str());
+		exit(-1);
+	}
+}
+
+/*
+auxiliary to read_struct_examples(): write the training examples in a stream (up to an empty line) to a dataset file,
+holding only one sentence at a time; the lines of each sentence must be together
+*/
+void writeDataset(istream& infile, const char* filename, const string& outFilename)
+{
+	FILE* fp = fopen(outFilename.c_str(), "wb");
+	if(fp == NULL)
+	{
+		fprintf(stderr, "writeDataset(): can't open '%s' for writing; exiting\n", outFilename.c_str());
+		exit(-1);
+	}
+	datasetHeader header;
+	memset(&header, 0, sizeof(header));
+	writePadded(fp, &header, sizeof(header), outFilename); //filled in at the end
+
+	vector<uint64_t> recordOffsets;
+	vector<bool> written; //by example number
+	unsigned long curEx = 0; //example numbers start at 1
+	vector<tagID> tags; //of the sentence being read
+	vector<vector<WORD> > words;
+	vector<bool> haveToken;
+
+	unsigned long lineNum = 0;
+	string line, _tag, word;
+	unsigned long exNum = 0, exIndex;
+	vector<pair<featureID, double> > features;
+	featureID maxFeatNumFound = 0;
+	while(true)
+	{
+		const bool more = getline(infile, line, '\n') && line.length() > 0; //an empty line ends input
+		if(more)
+		{
+			parseTokenLine(line, lineNum, filename, _tag, exNum, exIndex, features, word);
+			if(exNum == 0 || exIndex == 0)
+			{
+				fprintf(stderr, "writeDataset(): example and token numbers start at 1 (line %lu of '%s'); exiting\n", lineNum, filename);
+				exit(-1);
+			}
+		}
+		if(curEx != 0 && (!more || exNum != curEx)) //the sentence is complete
 		{
-			if(onClassification) //avoid features with higher numbers than what we saw during training
+			recordOffsets.push_back(ftello(fp));
+			const uint32_t head[2] = {(uint32_t)tags.size(), 0};
+			writePadded(fp, head, sizeof(head), outFilename);
+			writePadded(fp, &tags[0], tags.size() * sizeof(tagID), outFilename);
+			for(size_t j = 0; j < words.size(); j++)
 			{
-				if(featNum <= sparm->featureSpaceSize)
+				if(!haveToken[j])
 				{
-					features.words = (WORD*)realloc(features.words, ++numFeats * sizeof(WORD));
-					features.words[numFeats - 1].wnum = featNum; //feature numbers start at 1 in the input
-					features.words[numFeats - 1].weight = featVal;
+					fprintf(stderr, "writeDataset(): '%s' has no token %lu in example %lu; exiting\n", filename, (unsigned long)j + 1, curEx);
+					exit(-1);
 				}
+				const uint64_t numWords = words[j].size();
+				writePadded(fp, &numWords, sizeof(numWords), outFilename);
+				writePadded(fp, &words[j][0], numWords * sizeof(WORD), outFilename);
 			}
-			else
+		}
+		if(!more) break;
+		if(exNum != curEx) //start a sentence
+		{
+			if(exNum < written.size() && written[exNum])
 			{
-				features.words = (WORD*)realloc(features.words, ++numFeats * sizeof(WORD));
-				features.words[numFeats - 1].wnum = featNum; //feature numbers start at 1 in the input
-				features.words[numFeats - 1].weight = featVal;
-				if(featNum > maxFeatNumFound) maxFeatNumFound = featNum;
+				fprintf(stderr, "writeDataset(): the lines of example %lu in '%s' aren't together (needed for --o); exiting\n", exNum, filename);
+				exit(-1);
 			}
+			if(written.size() <= exNum) written.resize(exNum + 1);
+			written[exNum] = true;
+			curEx = exNum;
+			tags.clear();
+			words.clear();
+			haveToken.clear();
+		}
+		if(words.size() < exIndex)
+		{
+			tags.resize(exIndex);
+			words.resize(exIndex);
+			haveToken.resize(exIndex);
 		}
-		features.words = (WORD*)realloc(features.words, ++numFeats * sizeof(WORD));
-		features.words[numFeats - 1].wnum = 0; //signal to end word list
-		if(instr.bad()) PARSE_ERROR("features", lineNum); //read error, as opposed to just reaching end of line
-		//parse the comment (first word, if any, is interpreted as the token string; rest is ignored)
-		size_t wordStart = comment.find_first_not_of(" \t\n\r");
-		if(wordStart != string::npos) //the comment contains non-whitespace
+		tags[exIndex - 1] = registerTag(_tag);
+		vector<WORD>& w = words[exIndex - 1];
+		w.resize(features.size() + 1);
+		memset(&w[0], 0, w.size() * sizeof(WORD)); //no stray bytes in the padding
+		for(size_t i = 0; i < features.size(); i++)
 		{
-			comment = comment.substr(wordStart, comment.find_last_not_of(" \t\n\r") + 1); //trim whitespace
-			istringstream incomment(comment);
-			if(incomment >> word) (*tokens[exNum - 1])[exIndex - 1].setString(word);
+			w[i].wnum = features[i].first;
+			w[i].weight = features[i].second;
+			if(features[i].first > maxFeatNumFound) maxFeatNumFound = features[i].first;
 		}
+		w.back().wnum = 0; //signal to end word list
+		haveToken[exIndex - 1] = true;
 		lineNum++;
-#undef PARSE_ERROR
-  }
-  infile.close();
+	}
+	if(maxFeatNumFound == 0)
+	{
+		fprintf(stderr, "read_struct_examples(): fishy input: no features found; exiting\n");
+		exit(-1);
+	}
 
-	if(!onClassification) //if during training, figure out the feature space size
+	header.indexOffset = ftello(fp);
+	if(!recordOffsets.empty()) writePadded(fp, &recordOffsets[0], recordOffsets.size() * sizeof(uint64_t), outFilename);
+	header.tagsOffset = ftello(fp);
+	for(tagID i = 0; i < getNumTags(); i++)
 	{
-  		if(maxFeatNumFound == 0)
-  		{
-		  	fprintf(stderr, "read_struct_examples(): fishy input: no features found; exiting\n");
-	  		exit(-1);
-  		}
-		sparm->featureSpaceSize = maxFeatNumFound; //feature numbers start at 1
+		const tag& t = getTagByID(i);
+		const uint32_t length = t.length();
+		if(fwrite(&length, sizeof(length), 1, fp) != 1 || fwrite(t.data(), 1, length, fp) != length)
+		{
+			fprintf(stderr, "writeDataset(): can't write to '%s'; exiting\n", outFilename.c_str());
+			exit(-1);
+		}
+	}
+	memcpy(header.magic, DATASET_MAGIC, sizeof(header.magic));
+	header.wordSize = sizeof(WORD);
+	header.numTags = getNumTags();
+	header.numExamples = recordOffsets.size();
+	header.featureSpaceSize = maxFeatNumFound;
+	if(fseeko(fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, fp) != 1 || fclose(fp) != 0)
+	{
+		fprintf(stderr, "writeDataset(): can't write to '%s'; exiting\n", outFilename.c_str());
+		exit(-1);
 	}
+}
 
-  sample.n = tokens.size();
-  sample.examples = new EXAMPLE[sample.n]; //initialize the PATTERNs and LABELs from our temporary storage
-  for(unsigned int i = 0; i < tokens.size(); i++)
-  {
-	  sample.examples[i].x.setEmissionsVector(tokens[i]);
-	  sample.examples[i].y.setTagsVector(tagIDs[i]);
-  }
-  return(sample);
+/*
+auxiliary to read_struct_examples(): map a dataset file, register its tags, and return examples that read their sentences
+from it when they're used
+*/
+SAMPLE mapDataset(const char* filename, STRUCT_LEARN_PARM* sparm)
+{
+	const int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "mapDataset(): can't open '%s' for reading; exiting\n", filename);
+		exit(-1);
+	}
+	const size_t size = st.st_size;
+	void* base = (size >= sizeof(datasetHeader)) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	datasetHeader header;
+	if(base != MAP_FAILED) memcpy(&header, base, sizeof(header));
+	if(base == MAP_FAILED || memcmp(header.magic, DATASET_MAGIC, sizeof(header.magic)) != 0 || header.wordSize != sizeof(WORD)
+		|| header.indexOffset > size || header.numExamples > (size - header.indexOffset) / sizeof(uint64_t) || header.tagsOffset > size)
+	{
+		fprintf(stderr, "mapDataset(): '%s' isn't a dataset file written by this build (--o); exiting\n", filename);
+		exit(-1);
+	}
+	madvise(base, size, MADV_SEQUENTIAL);
+	mappedDataset* mapping = new mappedDataset;
+	mapping->base = (char*)base;
+	mapping->size = size;
+	mapping->lastChunk = (size_t)-1;
+	mappedDatasets.push_back(mapping);
+
+	//the registry is empty, so the tags get the ids they had when the file was written
+	const char* p = mapping->base + header.tagsOffset;
+	for(uint32_t i = 0; i < header.numTags; i++)
+	{
+		uint32_t length;
+		if(p + sizeof(length) > mapping->base + size) break;
+		memcpy(&length, p, sizeof(length));
+		p += sizeof(length);
+		if(length > (size_t)(mapping->base + size - p) || registerTag(tag(p, length)) != i)
+		{
+			fprintf(stderr, "mapDataset(): bad tag list in '%s'; exiting\n", filename);
+			exit(-1);
+		}
+		p += length;
+	}
+	if(getNumTags() != header.numTags)
+	{
+		fprintf(stderr, "mapDataset(): bad tag list in '%s'; exiting\n", filename);
+		exit(-1);
+	}
+	sparm->featureSpaceSize = header.featureSpaceSize;
+	sparm->outOfCore = 1;
+
+	SAMPLE sample;
+	sample.n = header.numExamples;
+	sample.examples = new EXAMPLE[sample.n];
+	sample.mapping = mapping;
+	const uint64_t* recordOffsets = (const uint64_t*)(mapping->base + header.indexOffset);
+	for(long i = 0; i < sample.n; i++)
+	{
+		if(recordOffsets[i] >= header.indexOffset)
+		{
+			fprintf(stderr, "mapDataset(): bad record offset in '%s'; exiting\n", filename);
+			exit(-1);
+		}
+		sample.examples[i].x.setRecord(mapping->base + recordOffsets[i]);
+		sample.examples[i].y.setRecord(mapping->base + recordOffsets[i]);
+	}
+	return(sample);
 }
 
 /*
-this is called BEFORE init_struct_constraints() but AFTER read_struct_examples()
+auxiliary to pattern::readRecord(): each pass reads the examples in order, so when it gets to a new chunk of the file, have
+the next chunk read ahead and let go of the ones before the previous: the resident part of the mapping stays at a few
+chunks however large the file is (the pages stay in the page cache as long as the system has room for them)
 */
-void init_struct_model(SAMPLE sample, STRUCTMODEL *sm, STRUCT_LEARN_PARM *sparm, LEARN_PARM* lparm, KERNEL_PARM* kparm)
+void adviseDatasetAccess(const char* record)
 {
-  /* Initialize structmodel sm. The weight vector w does not need to be
-     initialized, but you need to provide the maximum size of the
-     feature space in sizePsi. This is the maximum number of different
-     weights that can be learned. Later, the weight vector w will
-     contain the learned weights for the model. */
+	size_t m = 0;
+	while(m < mappedDatasets.size() && !(record >= mappedDatasets[m]->base && record < mappedDatasets[m]->base + mappedDatasets[m]->size)) m++;
+	if(m == mappedDatasets.size()) return;
+	mappedDataset& d = *mappedDatasets[m];
+	const size_t chunk = (record - d.base) / DATASET_CHUNK;
+	if(chunk == d.lastChunk) return;
+	const size_t next = (chunk + 1) * DATASET_CHUNK;
+	if(next < d.size) madvise(d.base + next, min(DATASET_CHUNK, d.size - next), MADV_WILLNEED);
+	if(chunk == d.lastChunk + 1) //the usual case
+	{
+		if(chunk >= 2) madvise(d.base + (chunk - 2) * DATASET_CHUNK, DATASET_CHUNK, MADV_DONTNEED);
+	}
+	else //a new pass, or out of order
+	{
+		if(chunk >= 1) madvise(d.base, (chunk - 1) * DATASET_CHUNK, MADV_DONTNEED);
+		if(next + DATASET_CHUNK < d.size)
+			madvise(d.base + next + DATASET_CHUNK, d.size - next - DATASET_CHUNK, MADV_DONTNEED);
+	}
+	d.lastChunk = chunk;
+}
 
-  /*
-  for an HMM, depends on the sizes of phi(X) and Y, the feature space and the label set
-  */
-  sm->sizePsi = getNumTags() * (getNumTags() + sparm->featureSpaceSize);
+/*
+auxiliary to free_struct_sample(): unmap the dataset file of one sample (the others stay mapped)
+*/
+void unmapDataset(mappedDataset* mapping)
+{
+	mappedDatasets.erase(remove(mappedDatasets.begin(), mappedDatasets.end(), mapping), mappedDatasets.end());
+	munmap(mapping->base, mapping->size);
+	delete mapping;
+}
 }
 
-CONSTSET    init_struct_constraints(SAMPLE sample, STRUCTMODEL *sm, STRUCT_LEARN_PARM *sparm)
+void pattern::readRecord() const
 {
-  /* Initializes the optimization problem. Typically, you do not need
-     to change this function, since you want to start with an empty
-     set of constraints. However, if for example you have constraints
-     that certain weights need to be positive, you might put that in
-     here. The constraints are represented as lhs[i]*w >= rhs[i]. lhs
-     is an array of feature vectors, rhs is an array of doubles. m is
-     the number of constraints. The function returns the initial
-     set of constraints. */
-  CONSTSET c;
-  long     sizePsi=sm->sizePsi;
-  long     i;
-  WORD     words[2];
+	adviseDatasetAccess(record);
+	const uint32_t length = *(const uint32_t*)record;
+	const char* p = record + 8 + (length * sizeof(tagID) + 7) / 8 * 8; //the tokens follow the tags
+	shared_ptr<vector<token> > e(new vector<token>);
+	e->reserve(length);
+	for(uint32_t i = 0; i < length; i++)
+	{
+		const uint64_t numWords = *(const uint64_t*)p;
+		e->push_back(token((WORD*)(p + sizeof(uint64_t))));
+		p += sizeof(uint64_t) + numWords * sizeof(WORD);
+	}
+	emissions = e;
+	record = NULL;
+}
 
-  if(1) { /* normal case: start with empty set of constraints */
-    c.lhs=NULL;
-    c.rhs=NULL;
-    c.m=0;
+void label::readRecord() const
+{
+	const uint32_t length = *(const uint32_t*)record;
+	const tagID* t = (const tagID*)(record + 8);
+	tags = shared_ptr<vector<tagID> >(new vector<tagID>(t, t + length));
+	record = NULL;
+}
+
+/**************************************/
+
+void        svm_struct_learn_api_init(int argc, char* argv[])
+{
+  /* Called in learning part before anything else is done to allow
+     any initializations that might be necessary. */
+}
+
+void        svm_struct_learn_api_exit()
+{
+  /* Called in learning part at the very end to allow any clean-up
+     that might be necessary. */
+  free_token_feature_map();
+}
+
+void        svm_struct_classify_api_init(int argc, char* argv[])
+{
+  /* Called in prediction part before anything else is done to allow
+     any initializations that might be necessary. */
+}
+
+void free_ensemble_models(); //see classify_struct_example_ensemble()
+
+void        svm_struct_classify_api_exit()
+{
+  /* Called in prediction part at the very end to allow any clean-up
+     that might be necessary. */
+  /* svm-hmm: leaves the globals as they were before read_struct_model(),
+     so that another model can be read */
+  free_ensemble_models();
+  free_token_feature_map();
+  clearFeatureMaps();
+  clearTagRegistry();
+  invalidate_decoder_caches();
+}
+
+/**************************************/
+
+/*
+this function gets called by both the learning and prediction modules
+
+automatically generate the feature vector filename from the POS filename: POS_BASE.ext -> POS_BASE_feats.dat
+
+NOTE we want this to be called before init_struct_model() so we'll have defined the input language size
+*/
+SAMPLE      read_struct_examples(const char *filename, STRUCT_LEARN_PARM *sparm)
+{
+  const bool onClassification = (sparm->featureSpaceSize != 0); //see the other read_struct_examples()
+  //gzip and zstd files are decompressed on the fly
+  FILE* fp = fopen(filename, "rb");
+  const int format = (fp != NULL) ? detectInputFormat(fp) : INPUT_PLAIN;
+  //out of core: write the input to a dataset file unless it is one, and map that
+  const bool toDataset = !onClassification && !datasetFilename.empty() && format != INPUT_DATASET;
+  if(format == INPUT_DATASET || toDataset)
+  {
+	  if(onClassification)
+	  {
+		  fprintf(stderr, "read_struct_examples(): '%s' is a dataset file for training (--o); exiting\n", filename);
+		  exit(-1);
+	  }
+	  if(sparm->featureMinFreq > 0 || sparm->tokenFeatureMap != TOKEN_MAP_NONE)
+	  {
+		  fprintf(stderr, "read_struct_examples(): --f and --x change the examples in memory and can't be used out of core; exiting\n");
+		  exit(-1);
+	  }
   }
-  else { /* add constraints so that all learned weights are
-            positive. WARNING: Currently, they are positive only up to
-            precision epsilon set by -e. */
-    c.lhs=(DOC**)my_malloc(sizeof(DOC *)*sizePsi);
-    c.rhs=(double*)my_malloc(sizeof(double)*sizePsi);
-    for(i=0; i<sizePsi; i++) {
-      words[0].wnum=i+1;
-      words[0].weight=1.0;
-      words[1].wnum=0;
-      /* the following slackid is a hack. we will run into problems
-         if we have more than MAX_NUM_EXAMPLES slack sets (ie examples).
-         MAX_NUM_EXAMPLES is defined in svm_struct_api_types.h */
-      c.lhs[i]=create_example(i,0,MAX_NUM_EXAMPLES+i,1,create_svector(words,"",1.0));
-      c.rhs[i]=0.0;
-    }
+  if(format == INPUT_DATASET)
+  {
+	  fclose(fp);
+	  return(mapDataset(filename, sparm));
   }
-  return(c);
+
+  SAMPLE sample;
+  if(format != INPUT_PLAIN)
+  {
+	  {
+		  decompressingStreambuf buf(fp, format);
+		  istream infile(&buf);
+		  if(toDataset) writeDataset(infile, filename, datasetFilename);
+		  else sample = read_struct_examples(infile, filename, sparm);
+		  if(!buf.getError().empty())
+		  {
+			  fprintf(stderr, "read_struct_examples(): reading '%s': %s; exiting\n", filename, buf.getError().c_str());
+			  exit(-1);
+		  }
+	  }
+	  fclose(fp);
+  }
+  else
+  {
+	  if(fp != NULL) fclose(fp);
+	  ifstream infile(filename);
+	  if(!infile)
+	  {
+		  fprintf(stderr, "read_struct_examples(): can't open '%s' for reading; exiting\n", filename);
+		  exit(-1);
+	  }
+	  if(toDataset) writeDataset(infile, filename, datasetFilename);
+	  else sample = read_struct_examples(infile, filename, sparm);
+	  infile.close();
+  }
+  if(toDataset) return(mapDataset(datasetFilename.c_str(), sparm));
+  return(sample);
 }
 
-/*
-return the index into a feature vector that denotes the y1 -> y2 transition,
-with an offset of 1 to work with svmlight
-*/
-inline unsigned int get_transition_feature_id(tagID y1, tagID y2)
-{
-	return y1 * getNumTags() + y2 + 1;
+/*
+read examples from a stream up to an empty line or the end of the stream; filename is used in error messages
+
+the example numbers (qids) start at 1 in each call
+*/
+SAMPLE      read_struct_examples(istream& infile, const char *filename, STRUCT_LEARN_PARM *sparm)
+{
+	/*
+	if we're reading the training set, fSS hasn't been set; if we're on classification,
+	it was set when we read in the model
+	*/
+	bool onClassification = (sparm->featureSpaceSize != 0);
+
+  /* Reads struct examples and returns them in sample. The number of
+     examples must be written into sample.n */
+  SAMPLE   sample;
+
+  //holding space until we allocate sample.examples; note the shared_ptr default ctor gives a null pointer
+  vector<shared_ptr<vector<token> > > tokens;
+  vector<shared_ptr<vector<tagID> > > tagIDs;
+
+  unsigned long lineNum = 0;
+  string line, _tag, word;
+  unsigned long exNum, exIndex;
+  featureID featNum, maxFeatNumFound = 0;
+  double featVal;
+  vector<pair<featureID, double> > lineFeatures;
+  const bool cutoffFeatures = !onClassification && sparm->featureMinFreq > 0;
+  hash_map<featureID, unsigned long> featureFreqs; //number of tokens each feature occurs in (only with a cutoff)
+  while(getline(infile, line, '\n') && line.length() > 0) //an empty line ends input
+  {
+		parseTokenLine(line, lineNum, filename, _tag, exNum, exIndex, lineFeatures, word);
+		//resize temporary storage of tokens and tags
+		if(tokens.size() < exNum) //input example and token numbers start at 1
+		{
+			tokens.resize(exNum);
+			tagIDs.resize(exNum);
+		}
+		if(tokens[exNum - 1].get() == NULL)
+		{
+			tokens[exNum - 1] = shared_ptr<vector<token> >(new vector<token>);
+			tagIDs[exNum - 1] = shared_ptr<vector<tagID> >(new vector<tagID>);
+		}
+		if(tokens[exNum - 1]->size() < exIndex)
+		{
+			tokens[exNum - 1]->resize(exIndex);
+			tagIDs[exNum - 1]->resize(exIndex);
+		}
+		(*tagIDs[exNum - 1])[exIndex - 1] = registerTag(_tag); //returns a new id only if the tag hasn't been seen before
+		//store features
+		SVECTOR& features = (*tokens[exNum - 1])[exIndex - 1].getFeatureMap();
+		if(onClassification) map_token_features(lineFeatures, features, sparm);
+		else
+		{
+			features.words = (WORD*)realloc(features.words, (lineFeatures.size() + 1) * sizeof(WORD));
+			for(size_t i = 0; i < lineFeatures.size(); i++)
+			{
+				featNum = lineFeatures[i].first;
+				featVal = lineFeatures[i].second;
+				features.words[i].wnum = featNum; //feature numbers start at 1 in the input
+				features.words[i].weight = featVal;
+				if(featNum > maxFeatNumFound) maxFeatNumFound = featNum;
+				if(cutoffFeatures && featVal != 0) featureFreqs[featNum]++;
+			}
+			features.words[lineFeatures.size()].wnum = 0; //signal to end word list
+		}
+		if(!word.empty()) (*tokens[exNum - 1])[exIndex - 1].setString(word);
+		lineNum++;
+  }
+
+	if(!onClassification) //if during training, figure out the feature space size
+	{
+  		if(maxFeatNumFound == 0)
+  		{
+		  	fprintf(stderr, "read_struct_examples(): fishy input: no features found; exiting\n");
+	  		exit(-1);
+  		}
+		sparm->featureSpaceSize = maxFeatNumFound; //feature numbers start at 1
+		if(cutoffFeatures)
+		{
+			sparm->featureSpaceSize = compactFeatureSpace(tokens, featureFreqs, sparm->featureMinFreq);
+			printf("(kept %ld of %lu features found in at least %lu tokens; max feature number was %ld)...",
+				sparm->featureSpaceSize, (unsigned long)featureFreqs.size(), sparm->featureMinFreq, maxFeatNumFound);
+			if(sparm->featureSpaceSize == 0)
+			{
+				fprintf(stderr, "read_struct_examples(): no features left after the frequency cutoff; exiting\n");
+				exit(-1);
+			}
+		}
+	}
+
+  //example numbers that didn't occur (eg a stream that doesn't start at qid 1) leave empty slots; skip them
+  sample.n = 0;
+  for(size_t i = 0; i < tokens.size(); i++)
+	  if(tokens[i].get() != NULL) sample.n++;
+  sample.examples = new EXAMPLE[sample.n]; //initialize the PATTERNs and LABELs from our temporary storage
+  sample.mapping = NULL;
+  for(size_t i = 0, k = 0; i < tokens.size(); i++)
+	  if(tokens[i].get() != NULL)
+	  {
+		  sample.examples[k].x.setEmissionsVector(tokens[i]);
+		  sample.examples[k].y.setTagsVector(tagIDs[i]);
+		  k++;
+	  }
+  return(sample);
+}
+
+/*
+this is called BEFORE init_struct_constraints() but AFTER read_struct_examples()
+*/
+void init_struct_model(SAMPLE sample, STRUCTMODEL *sm, STRUCT_LEARN_PARM *sparm, LEARN_PARM* lparm, KERNEL_PARM* kparm)
+{
+  /* Initialize structmodel sm. The weight vector w does not need to be
+     initialized, but you need to provide the maximum size of the
+     feature space in sizePsi. This is the maximum number of different
+     weights that can be learned. Later, the weight vector w will
+     contain the learned weights for the model. */
+
+  /*
+  for an HMM, depends on the sizes of phi(X) and Y, the feature space and the label set
+  */
+  if(sparm->tokenFeatureMap != TOKEN_MAP_NONE) init_token_feature_map(sample, sparm, kparm);
+  const featureID numTags = getNumTags();
+  /*
+  every feature number of psi, plus one slack feature per example after it (L2 slacks), must fit in a FNUM;
+  numTags * (numTags + F) <= maxSizePsi  <=>  F <= maxSizePsi / numTags - numTags
+  */
+  const featureID maxSizePsi = FNUM_MAX - sample.n - 1;
+  if(sparm->transitionOrder == 2)
+  {
+  	trigramPredecessors.assign(numTags * numTags, vector<tagID>());
+  	for(long i = 0; i < sample.n; i++)
+  	{
+  		const LABEL& y = sample.examples[i].y;
+  		for(unsigned int j = 2; j < y.getLength(); j++)
+  			addTrigram(y.getTag(j - 2), y.getTag(j - 1), y.getTag(j));
+  	}
+  	indexTrigrams();
+  }
+  else numTrigrams = 0;
+  if(numTags == 0 || numTrigrams > maxSizePsi || sparm->featureSpaceSize > (maxSizePsi - numTrigrams) / numTags - numTags)
+  {
+	  fprintf(stderr, "init_struct_model(): %ld tags x (%ld tags + %ld features)%s doesn't fit into a feature number of %d bytes"
+		  " (define LARGE_INDEX in svm_common.h for 64-bit ids); exiting\n", numTags, numTags, sparm->featureSpaceSize,
+		  (sparm->transitionOrder == 2) ? " + tag trigrams" : "", (int)sizeof(FNUM));
+	  exit(-1);
+  }
+  sm->sizePsi = numTags * (numTags + sparm->featureSpaceSize) + numTrigrams;
+}
+
+CONSTSET    init_struct_constraints(SAMPLE sample, STRUCTMODEL *sm, STRUCT_LEARN_PARM *sparm)
+{
+  /* Initializes the optimization problem. Typically, you do not need
+     to change this function, since you want to start with an empty
+     set of constraints. However, if for example you have constraints
+     that certain weights need to be positive, you might put that in
+     here. The constraints are represented as lhs[i]*w >= rhs[i]. lhs
+     is an array of feature vectors, rhs is an array of doubles. m is
+     the number of constraints. The function returns the initial
+     set of constraints. */
+  CONSTSET c;
+  long     sizePsi=sm->sizePsi;
+  long     i;
+  WORD     words[2];
+
+  if(1) { /* normal case: start with empty set of constraints */
+    c.lhs=NULL;
+    c.rhs=NULL;
+    c.m=0;
+  }
+  else { /* add constraints so that all learned weights are
+            positive. WARNING: Currently, they are positive only up to
+            precision epsilon set by -e. */
+    c.lhs=(DOC**)my_malloc(sizeof(DOC *)*sizePsi);
+    c.rhs=(double*)my_malloc(sizeof(double)*sizePsi);
+    for(i=0; i<sizePsi; i++) {
+      words[0].wnum=i+1;
+      words[0].weight=1.0;
+      words[1].wnum=0;
+      /* give each positivity constraint its own slack set after the
+         ones of the examples (slackids 1..n) */
+      c.lhs[i]=create_example(i,0,sample.n+1+i,1,create_svector(words,"",1.0));
+      c.rhs[i]=0.0;
+    }
+  }
+  return(c);
+}
+
+/*
+return the index into a feature vector that denotes the y1 -> y2 transition,
+with an offset of 1 to work with svmlight
+*/
+inline featureID get_transition_feature_id(tagID y1, tagID y2)
+{
+	return (featureID)y1 * getNumTags() + y2 + 1;
+}
+
+/*
+return the index into a feature vector that denotes the start of the output features for tag y,
+with an offset of 1 to work with svmlight
+*/
+featureID get_output_feature_start_id(tagID y, STRUCT_LEARN_PARM* sparm)
+{
+	static const featureID psqr = sqr((featureID)getNumTags()) + 1;
+	return psqr + sparm->featureSpaceSize * y;
+}
+
+/*
+return the index into a feature vector that denotes the allowed transition trigramPredecessors[y1 * #tags + y2][i] -> y1 -> y2
+of a second-order model, with an offset of 1 to work with svmlight; the allowed trigrams come after the emission features,
+so a second-order model has the layout of a first-order one up to there
+*/
+inline featureID get_allowed_trigram_feature_id(tagID y1, tagID y2, size_t i, STRUCT_LEARN_PARM* sparm)
+{
+	const featureID numTags = getNumTags();
+	return numTags * (numTags + sparm->featureSpaceSize) + trigramOffsets[y1 * numTags + y2] + i + 1;
+}
+
+/*
+return the feature index of the y0 -> y1 -> y2 transition of a second-order model, or 0 if the trigram isn't allowed
+(it has no weight)
+*/
+inline featureID get_trigram_feature_id(tagID y0, tagID y1, tagID y2, STRUCT_LEARN_PARM* sparm)
+{
+	const vector<tagID>& p = trigramPredecessors[y1 * getNumTags() + y2];
+	const vector<tagID>::const_iterator i = lower_bound(p.begin(), p.end(), y0);
+	return (i != p.end() && *i == y0) ? get_allowed_trigram_feature_id(y1, y2, i - p.begin(), sparm) : 0;
+}
+
+/*
+auxiliary to classify_struct_example(): return the log-probability, according to weight vector w,
+of the state transition y1 -> y2
+*/
+inline double get_transition_probability(const double* w, tagID y1, tagID y2)
+{
+	return w[get_transition_feature_id(y1, y2)];
+}
+
+/*
+auxiliary to classify_struct_example(): return the log-probability, according to weight vector w,
+of state y outputting a token with x's feature vector
+*/
+inline double get_output_probability(const double* w, tagID y, const token& x, STRUCT_LEARN_PARM* sparm)
+{
+	//we want the dot product of x's features with the appropriate subvector of w
+	const featureID startIndex = get_output_feature_start_id(y, sparm);
+	return x.dotProduct(&w[startIndex - 1]); //the feature numbers in x start at 1
+}
+
+/*********** sequence lattice ***********/
+
+namespace
+{
+/*
+dynamic programs over the lattice of a sentence, specialized at compile time by three policies:
+
+- a semiring, which says what a lattice cell holds and how an arc extends it: max-plus with backpointers (Viterbi and
+  max-marginals), the k best paths, or log-sum-exp (for posteriors)
+- a cost augmentation, which adds a loss term to the score of each tag at each position: none, Hamming, or a loss
+  weighted by the correct tag (for loss-augmented decoding during training)
+- the scores, which give the states at each position (tags, or clusters of tags) and the emission and transition scores
+
+an arc from state k at position j - 1 to state t at position j gives the score ((cell + cost(j, t)) + transition(j, k, t)) + emission(j, t),
+added in that order; at the first position, a state scores cost(0, t) + emission(0, t)
+
+a lattice can be restricted to a list of states at each position (increasing), in which case only those cells and the arcs
+between them are scored
+*/
+
+typedef vector<vector<tagID> > tagLattice; //position -> the states allowed there, increasing
+
+struct noCost
+{
+	double operator () (unsigned int, tagID) const {return 0;}
+};
+
+/*
+1 for each tag that differs from y's
+*/
+struct hammingCost
+{
+	explicit hammingCost(const LABEL& y) : y(y) {}
+	double operator () (unsigned int j, tagID t) const {return (t != y.getTag(j)) ? 1 : 0;}
+
+	const LABEL& y;
+};
+
+/*
+mislabeling a token whose tag in y is y_j costs weights[y_j]
+*/
+struct weightedTagCost
+{
+	weightedTagCost(const LABEL& y, const vector<double>& weights) : y(y), weights(weights) {}
+	double operator () (unsigned int j, tagID t) const {return (t != y.getTag(j)) ? weights[y.getTag(j)] : 0;}
+
+	const LABEL& y;
+	const vector<double>& weights;
+};
+
+inline double logAdd(double a, double b)
+{
+	if(a < b) swap(a, b);
+	return (b == -HUGE_VAL) ? a : a + log1p(exp(b - a));
+}
+
+/*
+the scores of a first-order model over the tags of x: w's transitions, and the emissions of x's tokens, each computed the
+first time a lattice asks for it, so that passes over parts of the lattice share them
+*/
+class tagScores
+{
+	public:
+
+		tagScores(PATTERN x, const double* w, STRUCT_LEARN_PARM* sparm)
+			: x(x), w(w), sparm(sparm), numTags(getNumTags()), emissions(x.getLength() * numTags), known(x.getLength() * numTags, false), numComputed(0)
+		{}
+
+		unsigned int getLength() const {return x.getLength();}
+		unsigned int getNumStates() const {return numTags;}
+		double getEmission(unsigned int j, tagID t)
+		{
+			const unsigned int i = j * numTags + t;
+			if(!known[i])
+			{
+				emissions[i] = get_output_probability(w, t, x.getToken(j), sparm);
+				known[i] = true;
+				numComputed++;
+			}
+			return emissions[i];
+		}
+		double getTransition(unsigned int, tagID k, tagID t) const {return get_transition_probability(w, k, t);}
+
+		/*
+		use a score computed elsewhere for an emission
+		*/
+		void setEmission(unsigned int j, tagID t, double e)
+		{
+			emissions[j * numTags + t] = e;
+			known[j * numTags + t] = true;
+		}
+		/*
+		the number of emissions computed (not set) so far
+		*/
+		unsigned long getNumComputed() const {return numComputed;}
+
+	protected:
+
+		const PATTERN x;
+		const double* w;
+		STRUCT_LEARN_PARM* sparm;
+		const unsigned int numTags;
+		vector<double> emissions; //position * #tags + tag
+		vector<bool> known;
+		unsigned long numComputed;
+};
+
+/*
+best score of a path to the cell, and the previous state on it (ties go to the lowest previous state)
+*/
+struct maxPlusSemiring
+{
+	struct cell
+	{
+		double score;
+		tagID back;
+	};
+
+	static void start(cell& c, double score) {c.score = score; c.back = 0;}
+	static void clear(cell& c) {c.score = -HUGE_VAL; c.back = 0;}
+	static void extend(cell& c, const cell& prev, tagID k, double cost, double transition, double emission)
+	{
+		const double score = prev.score + cost + transition + emission;
+		if(score > c.score)
+		{
+			c.score = score;
+			c.back = k;
+		}
+	}
+	static double getScore(const cell& c) {return c.score;}
+	static double combine(double a, double b) {return max(a, b);} //for backward scores
+};
+
+/*
+log of the sum over paths to the cell of exp(path score)
+*/
+struct logSumExpSemiring
+{
+	struct cell
+	{
+		double score;
+	};
+
+	static void start(cell& c, double score) {c.score = score;}
+	static void clear(cell& c) {c.score = -HUGE_VAL;}
+	static void extend(cell& c, const cell& prev, tagID, double cost, double transition, double emission)
+	{
+		c.score = logAdd(c.score, prev.score + cost + transition + emission);
+	}
+	static double getScore(const cell& c) {return c.score;}
+	static double combine(double a, double b) {return logAdd(a, b);}
+};
+
+/*
+the K best path scores to the cell in decreasing order, each with the previous state and the rank of the path to it
+*/
+template <unsigned int K>
+struct kBestSemiring
+{
+	struct cell
+	{
+		unsigned int size;
+		double score[K];
+		tagID back[K];
+		unsigned int backRank[K];
+	};
+
+	static void start(cell& c, double score)
+	{
+		c.size = 1;
+		c.score[0] = score;
+		c.back[0] = 0;
+		c.backRank[0] = 0;
+	}
+	static void clear(cell& c) {c.size = 0;}
+	static void extend(cell& c, const cell& prev, tagID k, double cost, double transition, double emission)
+	{
+		for(unsigned int r = 0; r < prev.size; r++)
+		{
+			const double score = prev.score[r] + cost + transition + emission;
+			if(c.size == K && !(score > c.score[K - 1])) break; //prev's scores decrease, so the rest won't make it either
+			unsigned int i = min(c.size, K - 1);
+			for(; i > 0 && score > c.score[i - 1]; i--) //ties keep the earlier path first
+			{
+				c.score[i] = c.score[i - 1];
+				c.back[i] = c.back[i - 1];
+				c.backRank[i] = c.backRank[i - 1];
+			}
+			c.score[i] = score;
+			c.back[i] = k;
+			c.backRank[i] = r;
+			if(c.size < K) c.size++;
+		}
+	}
+	static double getScore(const cell& c) {return (c.size > 0) ? c.score[0] : -HUGE_VAL;}
+};
+
+/*
+the forward pass of Semiring over the lattice of Scores (restricted to allowed if it isn't NULL), with the scores
+augmented by Cost
+*/
+template <class Semiring, class Cost, class Scores>
+class sequenceLattice
+{
+	public:
+
+		typedef typename Semiring::cell cell;
+
+		sequenceLattice(Scores& scores, const Cost& cost, const tagLattice* allowed = NULL)
+			: scores(scores), cost(cost), allowed(allowed), length(scores.getLength()), numStates(scores.getNumStates()),
+			  cells(length * numStates), numArcs(0)
+		{
+			for(unsigned int i = 0; i < cells.size(); i++) Semiring::clear(cells[i]);
+			if(length == 0) return;
+			for(unsigned int a = 0; a < getNumAllowed(0); a++)
+			{
+				const tagID t = getAllowed(0, a);
+				Semiring::start(cells[t], cost(0, t) + scores.getEmission(0, t));
+			}
+			for(unsigned int j = 1; j < length; j++)
+			{
+				const unsigned int n = getNumAllowed(j), nPrev = getNumAllowed(j - 1);
+				numArcs += n * nPrev;
+				for(unsigned int a = 0; a < n; a++)
+				{
+					const tagID t = getAllowed(j, a);
+					cell& c = cells[j * numStates + t];
+					const double tagCost = cost(j, t), emission = scores.getEmission(j, t);
+					for(unsigned int b = 0; b < nPrev; b++)
+					{
+						const tagID k = getAllowed(j - 1, b);
+						Semiring::extend(c, cells[(j - 1) * numStates + k], k, tagCost, scores.getTransition(j, k, t), emission);
+					}
+				}
+			}
+		}
+
+		unsigned int getLength() const {return length;}
+		const cell& getCell(unsigned int j, tagID t) const {return cells[j * numStates + t];}
+		/*
+		the number of arcs scored
+		*/
+		unsigned long getNumArcs() const {return numArcs;}
+
+		/*
+		the last position's state with the best score (the lowest on ties)
+		*/
+		tagID getBestFinalState() const
+		{
+			tagID best = getAllowed(length - 1, 0);
+			for(unsigned int a = 1; a < getNumAllowed(length - 1); a++)
+				if(Semiring::getScore(getCell(length - 1, getAllowed(length - 1, a))) > Semiring::getScore(getCell(length - 1, best)))
+					best = getAllowed(length - 1, a);
+			return best;
+		}
+
+		/*
+		for max-plus: the best path
+		*/
+		LABEL getBestLabeling() const
+		{
+			LABEL y;
+			y.setLength(length);
+			if(length == 0) return y;
+			tagID t = getBestFinalState();
+			for(int j = (int)length - 1; j >= 0; j--)
+			{
+				y.setTag(j, t);
+				t = getCell(j, t).back;
+			}
+			return y;
+		}
+		/*
+		for max-plus: the score of the best path
+		*/
+		double getBestScore() const {return (length > 0) ? Semiring::getScore(getCell(length - 1, getBestFinalState())) : 0;}
+
+		/*
+		for scalar semirings: the combined score of the paths from each cell to the end, not counting the cell's own score,
+		at position * #states + state (-inf for cells outside the lattice)
+		*/
+		void getBackwardScores(vector<double>& backward) const
+		{
+			backward.assign(length * numStates, -HUGE_VAL);
+			if(length == 0) return;
+			for(unsigned int a = 0; a < getNumAllowed(length - 1); a++) backward[(length - 1) * numStates + getAllowed(length - 1, a)] = 0;
+			for(int j = (int)length - 2; j >= 0; j--)
+				for(unsigned int a = 0; a < getNumAllowed(j); a++)
+				{
+					const tagID t = getAllowed(j, a);
+					double score = -HUGE_VAL;
+					for(unsigned int b = 0; b < getNumAllowed(j + 1); b++)
+					{
+						const tagID k = getAllowed(j + 1, b);
+						score = Semiring::combine(score, cost(j + 1, k) + scores.getTransition(j + 1, t, k) + scores.getEmission(j + 1, k)
+							+ backward[(j + 1) * numStates + k]);
+					}
+					backward[j * numStates + t] = score;
+				}
+		}
+
+		/*
+		for max-plus: for each position j and state t, the best score of a path through t at j, at j * #states + t
+		*/
+		void getMaxMarginals(vector<double>& marginals) const
+		{
+			getBackwardScores(marginals);
+			for(unsigned int j = 0; j < length; j++)
+				for(tagID t = 0; t < numStates; t++)
+					marginals[j * numStates + t] += Semiring::getScore(getCell(j, t));
+		}
+
+	private:
+
+		unsigned int getNumAllowed(unsigned int j) const {return (allowed != NULL) ? (*allowed)[j].size() : numStates;}
+		tagID getAllowed(unsigned int j, unsigned int a) const {return (allowed != NULL) ? (*allowed)[j][a] : a;}
+
+		Scores& scores;
+		const Cost cost;
+		const tagLattice* allowed;
+		const unsigned int length, numStates;
+		vector<cell> cells; //position * #states + state
+		unsigned long numArcs;
+};
+
+/*
+the best labeling of x under the scores augmented by cost (Viterbi)
+*/
+template <class Cost>
+LABEL bestLabeling(PATTERN x, STRUCTMODEL* sm, STRUCT_LEARN_PARM* sparm, const Cost& cost)
+{
+	tagScores scores(x, sm->w, sparm);
+	return sequenceLattice<maxPlusSemiring, Cost, tagScores>(scores, cost).getBestLabeling();
+}
+
+/*
+up to K best labelings of x under the scores augmented by cost, in decreasing order of score (the scores go to scores)
+*/
+template <unsigned int K, class Cost>
+vector<LABEL> kBestLabelings(PATTERN x, STRUCTMODEL* sm, STRUCT_LEARN_PARM* sparm, const Cost& cost, vector<double>& scores)
+{
+	typedef kBestSemiring<K> semiring;
+	tagScores tags(x, sm->w, sparm);
+	const sequenceLattice<semiring, Cost, tagScores> lattice(tags, cost);
+	vector<LABEL> labelings;
+	scores.clear();
+	const unsigned int length = lattice.getLength();
+	if(length == 0) return labelings;
+	//merge the last position's lists
+	typename semiring::cell ends;
+	semiring::clear(ends);
+	for(tagID t = 0; t < getNumTags(); t++)
+		semiring::extend(ends, lattice.getCell(length - 1, t), t, 0, 0, 0);
+	for(unsigned int i = 0; i < ends.size; i++)
+	{
+		LABEL y;
+		y.setLength(length);
+		tagID t = ends.back[i];
+		unsigned int rank = ends.backRank[i];
+		for(int j = (int)length - 1; j >= 0; j--)
+		{
+			y.setTag(j, t);
+			const typename semiring::cell& c = lattice.getCell(j, t);
+			t = c.back[rank];
+			rank = c.backRank[rank];
+		}
+		labelings.push_back(y);
+		scores.push_back(ends.score[i]);
+	}
+	return labelings;
+}
+
+/*
+for each position j and tag t, the probability that t is j's tag when labelings are weighted by exp(score augmented by
+cost), at j * #tags + t; return the log of the sum of the weights
+*/
+template <class Cost>
+double tagPosteriors(PATTERN x, STRUCTMODEL* sm, STRUCT_LEARN_PARM* sparm, const Cost& cost, vector<double>& posteriors)
+{
+	tagScores tags(x, sm->w, sparm);
+	const sequenceLattice<logSumExpSemiring, Cost, tagScores> lattice(tags, cost);
+	lattice.getBackwardScores(posteriors);
+	const unsigned int numTags = getNumTags(), length = lattice.getLength();
+	if(length == 0) return 0;
+	double logZ = -HUGE_VAL;
+	for(tagID t = 0; t < numTags; t++) logZ = logAdd(logZ, lattice.getCell(length - 1, t).score);
+	for(unsigned int j = 0; j < length; j++)
+		for(tagID t = 0; t < numTags; t++)
+			posteriors[j * numTags + t] = exp(lattice.getCell(j, t).score + posteriors[j * numTags + t] - logZ);
+	return logZ;
+}
+
+}
+
+/************** decoding **************/
+
+namespace
+{
+/*
+classification options (set by parse_struct_parameters_classify(), which doesn't get a sparm)
+*/
+enum {DECODER_VITERBI = 0, DECODER_COARSE_TO_FINE = 1, DECODER_ASTAR = 2};
+int decoder = DECODER_VITERBI; //--d
+unsigned int numTagClusters = 0; //--k; 0 means about sqrt(number of tags)
+double pruneMargin = 0; //--m; 0 is lossless, larger values prune more
+int checkLattice = 0; //--c
+
+/*
+lattice statistics over all the sentences decoded with a pruning or search decoder
+*/
+struct decodingStats
+{
+	decodingStats() : numClusters(0), numCells(0), numCellsKept(0), numTransitions(0), numTransitionsScored(0), numEmissions(0), numEmissionsScored(0) {}
+
+	unsigned int numClusters;
+	unsigned long numCells, numCellsKept; //(position, tag) pairs in the full lattice, and kept by pruning or expanded by A*
+	unsigned long numTransitions, numTransitionsScored; //tag pairs at neighboring positions: in the full lattice, and scored by all passes
+	unsigned long numEmissions, numEmissionsScored; //(position, tag) dot products: in the full lattice, and computed by all passes
+} decStats;
+
+/*
+a partition of the tags into clusters of tags with similar weights, with cluster-level scores
+that bound those of each member from above
+*/
+struct tagClusters
+{
+	vector<vector<tagID> > members; //cluster -> its tags, increasing
+	vector<double> transitions; //max score of a transition from a tag of cluster c1 to one of c2, at c1 * K + c2
+	vector<double> emissionMax, emissionMin; //elementwise max/min of the members' emission weights, at c * F + featNum - 1
+};
+
+/*
+decoder state computed from w when first needed; it has to be recomputed whenever w changes (see invalidate_decoder_caches())
+*/
+tagClusters decoderClusters; //coarse-to-fine
+bool decoderClustersValid = false;
+vector<double> maxTransitionOut, maxTransitionIn; //A*: best transition out of and into each tag
+bool transitionBoundsValid = false;
+
+}
+
+/*
+svm-hmm: drop the decoder state computed from the weights (the coarse-to-fine tag clusters and the A* transition bounds);
+call it before classifying with weights that changed since the last classify_struct_example()
+*/
+void invalidate_decoder_caches()
+{
+	decoderClustersValid = false;
+	transitionBoundsValid = false;
+}
+
+/*
+auxiliary to clusterTags(): coordinate d of tag y's weights, made of its outgoing transitions,
+its incoming transitions and its emission weights
+*/
+inline double get_tag_coordinate(const double* w, tagID y, featureID d, STRUCT_LEARN_PARM* sparm)
+{
+	const featureID numTags = getNumTags();
+	if(d < numTags) return get_transition_probability(w, y, d);
+	else if(d < 2 * numTags) return get_transition_probability(w, d - numTags, y);
+	else return w[get_output_feature_start_id(y, sparm) + d - 2 * numTags];
+}
+
+/*
+auxiliary to clusterTags(): squared euclidean distance of tag y's weights from a centroid
+*/
+double sqrDistanceToCentroid(const double* w, tagID y, const vector<double>& centroid, STRUCT_LEARN_PARM* sparm)
+{
+	double dist = 0;
+	for(featureID d = 0; d < (featureID)centroid.size(); d++)
+		dist += sqr(get_tag_coordinate(w, y, d, sparm) - centroid[d]);
+	return dist;
+}
+
+/*
+auxiliary to classify_struct_example_coarse_to_fine(): group the tags with k-means (farthest-point initialization,
+so the result is deterministic) and compute the cluster bounds
+*/
+void clusterTags(const double* w, STRUCT_LEARN_PARM* sparm, unsigned int numClusters, tagClusters& tc)
+{
+	const unsigned int numTags = getNumTags();
+	const featureID F = sparm->featureSpaceSize, dim = 2 * (featureID)numTags + F;
+	if(numClusters == 0) numClusters = (unsigned int)ceil(sqrt((double)numTags));
+	if(numClusters > numTags) numClusters = numTags;
+
+	vector<unsigned int> clusterOf(numTags, 0);
+	vector<double> minDist(numTags, HUGE_VAL);
+	vector<vector<double> > centroids(numClusters, vector<double>(dim));
+	tagID next = 0;
+	for(unsigned int c = 0; c < numClusters; c++)
+	{
+		for(featureID d = 0; d < dim; d++) centroids[c][d] = get_tag_coordinate(w, next, d, sparm);
+		double farthest = -1;
+		for(tagID y = 0; y < numTags; y++)
+		{
+			const double dist = sqrDistanceToCentroid(w, y, centroids[c], sparm);
+			if(dist < minDist[y])
+			{
+				minDist[y] = dist;
+				clusterOf[y] = c;
+			}
+			if(minDist[y] > farthest)
+			{
+				farthest = minDist[y];
+				next = y;
+			}
+		}
+	}
+	for(unsigned int iter = 0; iter < 20; iter++)
+	{
+		vector<unsigned int> counts(numClusters, 0);
+		for(tagID y = 0; y < numTags; y++) counts[clusterOf[y]]++;
+		for(unsigned int c = 0; c < numClusters; c++)
+			if(counts[c] > 0) fill(centroids[c].begin(), centroids[c].end(), 0.0); //an empty cluster keeps its old centroid
+		for(tagID y = 0; y < numTags; y++)
+			for(featureID d = 0; d < dim; d++)
+				centroids[clusterOf[y]][d] += get_tag_coordinate(w, y, d, sparm) / counts[clusterOf[y]];
+		bool changed = false;
+		for(tagID y = 0; y < numTags; y++)
+		{
+			unsigned int nearest = 0;
+			double nearestDist = HUGE_VAL;
+			for(unsigned int c = 0; c < numClusters; c++)
+			{
+				const double dist = sqrDistanceToCentroid(w, y, centroids[c], sparm);
+				if(dist < nearestDist)
+				{
+					nearestDist = dist;
+					nearest = c;
+				}
+			}
+			if(nearest != clusterOf[y])
+			{
+				clusterOf[y] = nearest;
+				changed = true;
+			}
+		}
+		if(!changed) break;
+	}
+
+	//renumber the nonempty clusters 0..K-1
+	vector<int> newIndex(numClusters, -1);
+	tc.members.clear();
+	for(tagID y = 0; y < numTags; y++)
+	{
+		if(newIndex[clusterOf[y]] < 0)
+		{
+			newIndex[clusterOf[y]] = tc.members.size();
+			tc.members.push_back(vector<tagID>());
+		}
+		clusterOf[y] = newIndex[clusterOf[y]];
+		tc.members[clusterOf[y]].push_back(y);
+	}
+	const unsigned int K = tc.members.size();
+	tc.transitions.assign(K * K, -HUGE_VAL);
+	for(tagID y1 = 0; y1 < numTags; y1++)
+		for(tagID y2 = 0; y2 < numTags; y2++)
+		{
+			double& t = tc.transitions[clusterOf[y1] * K + clusterOf[y2]];
+			t = max(t, get_transition_probability(w, y1, y2));
+		}
+	tc.emissionMax.assign(K * F, -HUGE_VAL);
+	tc.emissionMin.assign(K * F, HUGE_VAL);
+	for(tagID y = 0; y < numTags; y++)
+	{
+		const double* wy = &w[get_output_feature_start_id(y, sparm)];
+		double* wmax = &tc.emissionMax[clusterOf[y] * F];
+		double* wmin = &tc.emissionMin[clusterOf[y] * F];
+		for(featureID f = 0; f < F; f++)
+		{
+			wmax[f] = max(wmax[f], wy[f]);
+			wmin[f] = min(wmin[f], wy[f]);
+		}
+	}
+}
+
+/*
+auxiliary to classify_struct_example_coarse_to_fine(): an upper bound on the output score of every tag in cluster c for token x
+(positive feature values take the cluster's max weight, negative ones its min)
+*/
+double get_output_bound(const tagClusters& tc, unsigned int c, const token& x, STRUCT_LEARN_PARM* sparm)
+{
+	const double* wmax = &tc.emissionMax[0] + c * sparm->featureSpaceSize - 1; //the feature numbers in x start at 1
+	const double* wmin = &tc.emissionMin[0] + c * sparm->featureSpaceSize - 1;
+	double bound = 0;
+	for(const WORD* f = x.getFeatureMap().words; f->wnum != 0; f++)
+		bound += f->weight * ((f->weight > 0) ? wmax[f->wnum] : wmin[f->wnum]);
+	return bound;
+}
+
+namespace
+{
+/*
+auxiliary to classify_struct_example_coarse_to_fine(): the scores of the lattice over x's tag clusters, each bounding
+from above the scores of the cluster's members (see sequenceLattice)
+*/
+class clusterBoundScores
+{
+	public:
+
+		clusterBoundScores(PATTERN x, const tagClusters& tc, STRUCT_LEARN_PARM* sparm)
+			: tc(tc), length(x.getLength()), numClusters(tc.members.size()), emissions(length * numClusters)
+		{
+			for(unsigned int j = 0; j < length; j++)
+				for(unsigned int c = 0; c < numClusters; c++)
+					emissions[j * numClusters + c] = get_output_bound(tc, c, x.getToken(j), sparm);
+		}
+
+		unsigned int getLength() const {return length;}
+		unsigned int getNumStates() const {return numClusters;}
+		double getEmission(unsigned int j, tagID c) const {return emissions[j * numClusters + c];}
+		double getTransition(unsigned int, tagID c, tagID d) const {return tc.transitions[c * numClusters + d];}
+
+	private:
+
+		const tagClusters& tc;
+		const unsigned int length, numClusters;
+		vector<double> emissions; //position * #clusters + cluster
+};
+}
+
+/*
+coarse-to-fine decoding: run Viterbi forward and backward over the tag clusters with bounding scores, giving for each
+(position, cluster) an upper bound on the score of every path through any of its tags at that position (the max-marginal);
+decode the fine lattice restricted to the best cluster at each position to get the score of an actual path, drop the clusters
+whose bound is below it (plus pruneMargin), and run exact Viterbi over the tags left
+
+with pruneMargin = 0 the result is the Viterbi path
+*/
+LABEL classify_struct_example_coarse_to_fine(PATTERN x, STRUCTMODEL *sm, STRUCT_LEARN_PARM *sparm)
+{
+	if(!decoderClustersValid)
+	{
+		clusterTags(sm->w, sparm, numTagClusters, decoderClusters);
+		decStats.numClusters = decoderClusters.members.size();
+		decoderClustersValid = true;
+	}
+	const tagClusters& clusters = decoderClusters;
+	const unsigned int length = x.getLength(), numTags = getNumTags(), K = clusters.members.size();
+	LABEL y;
+	if(length == 0) return y;
+
+	//coarse pass: the clusters' max-marginals
+	clusterBoundScores coarseScores(x, clusters, sparm);
+	const noCost cost;
+	const sequenceLattice<maxPlusSemiring, noCost, clusterBoundScores> coarse(coarseScores, cost);
+	vector<double> bounds;
+	coarse.getMaxMarginals(bounds);
+
+	//lower bound from the best cluster at each position
+	vector<unsigned int> bestCluster(length, 0);
+	tagLattice lattice(length);
+	for(unsigned int j = 0; j < length; j++)
+	{
+		for(unsigned int c = 1; c < K; c++)
+			if(bounds[j * K + c] > bounds[j * K + bestCluster[j]])
+				bestCluster[j] = c;
+		lattice[j] = clusters.members[bestCluster[j]];
+	}
+	tagScores scores(x, sm->w, sparm); //shared by both fine passes
+	const sequenceLattice<maxPlusSemiring, noCost, tagScores> best(scores, cost, &lattice);
+	const double lowerBound = best.getBestScore();
+
+	//prune and decode the fine lattice; the tolerance covers rounding differences between bounds and scores
+	const double threshold = lowerBound + pruneMargin - 1e-9 * (1 + fabs(lowerBound));
+	for(unsigned int j = 0; j < length; j++)
+	{
+		lattice[j].clear();
+		for(unsigned int c = 0; c < K; c++)
+			if(c == bestCluster[j] || bounds[j * K + c] >= threshold)
+				lattice[j].insert(lattice[j].end(), clusters.members[c].begin(), clusters.members[c].end());
+		sort(lattice[j].begin(), lattice[j].end());
+		decStats.numCellsKept += lattice[j].size();
+	}
+	const sequenceLattice<maxPlusSemiring, noCost, tagScores> fine(scores, cost, &lattice);
+	y = fine.getBestLabeling();
+
+	decStats.numCells += length * numTags;
+	decStats.numTransitions += (length - 1) * numTags * numTags;
+	decStats.numTransitionsScored += coarse.getNumArcs() + best.getNumArcs() + fine.getNumArcs();
+	decStats.numEmissions += length * numTags;
+	decStats.numEmissionsScored += length * K + scores.getNumComputed();
+	return y;
+}
+
+namespace
+{
+/*
+auxiliary to classify_struct_example_astar(): a partial path ending at (position, tag),
+ordered by its score plus the heuristic bound on its best completion
+*/
+struct searchNode
+{
+	searchNode(double f, double g, unsigned int j, tagID y) : f(f), g(g), j(j), y(y) {}
+
+	bool operator < (const searchNode& n) const {return (f != n.f) ? f < n.f : j < n.j;} //prefer deeper nodes on ties
+
+	double f, g; //bound on the full path's score; score of the path so far
+	unsigned int j;
+	tagID y;
+};
+}
+
+/*
+A* decoding: best-first search over (position, tag) cells, scoring a partial path by its score plus an upper bound on the
+score of its best completion; the first path to reach the last position is the Viterbi path
+
+the bound for (j, y) comes from a backward max pass over per-position bounds: the best completion from position j + 1 on
+scores at most M[j + 1] = max(y') {e(j + 1, y') + h(j + 1, y')} plus the best transition out of y, and at most
+max(y') {maxIn(y') + e(j + 1, y') + h(j + 1, y')}; both take O(T) per position, and the bound is consistent, so each
+cell is expanded at most once
+*/
+LABEL classify_struct_example_astar(PATTERN x, STRUCTMODEL *sm, STRUCT_LEARN_PARM *sparm)
+{
+	const unsigned int length = x.getLength(), numTags = getNumTags();
+	vector<double>& maxOut = maxTransitionOut;
+	vector<double>& maxIn = maxTransitionIn;
+	if(!transitionBoundsValid)
+	{
+		maxOut.assign(numTags, -HUGE_VAL);
+		maxIn.assign(numTags, -HUGE_VAL);
+		for(tagID y1 = 0; y1 < numTags; y1++)
+			for(tagID y2 = 0; y2 < numTags; y2++)
+			{
+				maxOut[y1] = max(maxOut[y1], get_transition_probability(sm->w, y1, y2));
+				maxIn[y2] = max(maxIn[y2], get_transition_probability(sm->w, y1, y2));
+			}
+		transitionBoundsValid = true;
+	}
+
+	//heuristic, at j * numTags + y
+	tagScores scores(x, sm->w, sparm);
+	vector<double> heuristic(length * numTags, 0.0);
+	for(int j = length - 2; j > -1; j--)
+	{
+		double bestNext = -HUGE_VAL, bestNextWithIn = -HUGE_VAL;
+		for(tagID y = 0; y < numTags; y++)
+		{
+			const double next = scores.getEmission(j + 1, y) + heuristic[(j + 1) * numTags + y];
+			bestNext = max(bestNext, next);
+			bestNextWithIn = max(bestNextWithIn, maxIn[y] + next);
+		}
+		for(tagID y = 0; y < numTags; y++)
+			heuristic[j * numTags + y] = min(maxOut[y] + bestNext, bestNextWithIn);
+	}
+
+	vector<double> bestScore(length * numTags, -HUGE_VAL); //best score found so far of a path ending at each cell
+	vector<tagID> backptrs(length * numTags); //the previous tag on that path
+	vector<bool> expanded(length * numTags, false);
+	priority_queue<searchNode> agenda;
+	for(tagID y = 0; y < numTags; y++)
+	{
+		bestScore[y] = scores.getEmission(0, y);
+		agenda.push(searchNode(bestScore[y] + heuristic[y], bestScore[y], 0, y));
+	}
+	tagID lastTag = 0;
+	while(!agenda.empty())
+	{
+		const searchNode n = agenda.top();
+		agenda.pop();
+		const unsigned int cell = n.j * numTags + n.y;
+		if(expanded[cell] || n.g < bestScore[cell]) continue; //superseded by a better path to the same cell
+		expanded[cell] = true;
+		decStats.numCellsKept++;
+		if(n.j == length - 1)
+		{
+			lastTag = n.y;
+			break;
+		}
+		decStats.numTransitionsScored += numTags;
+		for(tagID y = 0; y < numTags; y++)
+		{
+			const unsigned int nextCell = cell + numTags - n.y + y;
+			const double score = n.g + scores.getTransition(n.j + 1, n.y, y) + scores.getEmission(n.j + 1, y);
+			if(!expanded[nextCell] && score > bestScore[nextCell])
+			{
+				bestScore[nextCell] = score;
+				backptrs[nextCell] = n.y;
+				agenda.push(searchNode(score + heuristic[nextCell], score, n.j + 1, y));
+			}
+		}
+	}
+
+	LABEL y;
+	y.setLength(length);
+	y.setTag(length - 1, lastTag);
+	for(int j = length - 2; j > -1; j--)
+		y.setTag(j, backptrs[(j + 1) * numTags + y.getTag(j + 1)]);
+
+	decStats.numCells += length * numTags;
+	decStats.numTransitions += (length - 1) * numTags * numTags;
+	decStats.numEmissions += length * numTags;
+	decStats.numEmissionsScored += length * numTags;
+	return y;
+}
+
+namespace
+{
+/*
+ensemble classification options: extra models to decode each sentence with, alongside the one given on the command line
+*/
+enum {VOTE_NONE = 0, VOTE_MAJORITY = 1, VOTE_SCORE = 2};
+vector<string> ensembleModelFiles; //--e
+vector<string> ensembleOutputFiles; //--o; default MODEL_BASE.outtags
+int ensembleVoting = VOTE_NONE; //--v
+string ensembleVoteFile; //--w
+
+/*
+the loaded ensemble: model 0 is the one given on the command line; with score voting, the last model is the average of the others
+
+the emission weights of all models are stacked by feature, so that a token's features are gathered once for all of them
+*/
+struct modelEnsemble
+{
+	vector<STRUCTMODEL> models;
+	vector<FILE*> outfiles; //for models 1..N-1
+	FILE* voteFile;
+	vector<double> stackedEmissionWeights; //at (featNum - 1) * models.size() * numTags + m * numTags + y
+
+	vector<LABEL> lastLabels; //for eval_prediction(): the last sentence's predictions of the N models, then the voted one
+	unsigned long numTokens, numTokensAllAgree;
+	vector<unsigned long> numCorrectTags; //per model, then voted
+} ens;
+
+/*
+auxiliary to read_ensemble_models(): split a comma-separated list
+*/
+vector<string> splitList(const string& s)
+{
+	vector<string> items;
+	istringstream instr(s);
+	string item;
+	while(getline(instr, item, ','))
+		if(!item.empty()) items.push_back(item);
+	return items;
+}
+
+}
+
+/*
+auxiliary to classify_struct_example_ensemble(): load the extra models, which must have the same tags and features as sm,
+open their output files and stack the emission weights
+*/
+void read_ensemble_models(STRUCTMODEL* sm, STRUCT_LEARN_PARM* sparm)
+{
+	const unsigned int numTags = getNumTags();
+	const vector<tag> tags = idToTag;
+	const vector<featureID> features = inputFeatureIDs;
+	ens.models.push_back(*sm);
+	for(unsigned int i = 0; i < ensembleModelFiles.size(); i++)
+	{
+		STRUCT_LEARN_PARM msparm;
+		STRUCTMODEL model = read_struct_model(const_cast<char*>(ensembleModelFiles[i].c_str()), &msparm);
+		if(idToTag != tags || msparm.featureSpaceSize != sparm->featureSpaceSize || inputFeatureIDs != features || model.sizePsi != sm->sizePsi)
+		{
+			fprintf(stderr, "classify_struct_example(): model '%s' doesn't have the same tags and features as the first one; exiting\n", ensembleModelFiles[i].c_str());
+			exit(-1);
+		}
+		ens.models.push_back(model);
+		const string outfile = (i < ensembleOutputFiles.size()) ? ensembleOutputFiles[i]
+			: ensembleModelFiles[i].substr(0, ensembleModelFiles[i].rfind('.')) + ".outtags";
+		FILE* fp = fopen(outfile.c_str(), "w");
+		if(fp == NULL)
+		{
+			perror(outfile.c_str());
+			exit(1);
+		}
+		ens.outfiles.push_back(fp);
+	}
+	ens.voteFile = NULL;
+	if(ensembleVoting != VOTE_NONE)
+	{
+		if(ensembleVoteFile.empty())
+		{
+			fprintf(stderr, "classify_struct_example(): voting (--v) needs a file for the voted predictions (--w); exiting\n");
+			exit(-1);
+		}
+		if((ens.voteFile = fopen(ensembleVoteFile.c_str(), "w")) == NULL)
+		{
+			perror(ensembleVoteFile.c_str());
+			exit(1);
+		}
+	}
+	if(ensembleVoting == VOTE_SCORE) //decode with the average weight vector, ie the sum of the models' scores
+	{
+		STRUCTMODEL average = *sm;
+		average.svm_model = NULL;
+		average.w = (double*)my_malloc((sm->sizePsi + 1) * sizeof(double));
+		for(featureID i = 0; i <= sm->sizePsi; i++)
+		{
+			average.w[i] = 0;
+			for(unsigned int m = 0; m < ens.models.size(); m++)
+				average.w[i] += ens.models[m].w[i] / ens.models.size();
+		}
+		ens.models.push_back(average);
+	}
+
+	const unsigned int numModels = ens.models.size();
+	ens.stackedEmissionWeights.resize(sparm->featureSpaceSize * numModels * numTags);
+	for(unsigned int m = 0; m < numModels; m++)
+		for(tagID y = 0; y < numTags; y++)
+		{
+			const double* wy = &ens.models[m].w[get_output_feature_start_id(y, sparm)];
+			for(featureID f = 0; f < sparm->featureSpaceSize; f++)
+				ens.stackedEmissionWeights[f * numModels * numTags + m * numTags + y] = wy[f];
+		}
+	ens.numTokens = ens.numTokensAllAgree = 0;
+	ens.numCorrectTags.assign(ensembleModelFiles.size() + 1 + (ensembleVoting != VOTE_NONE), 0);
+}
+
+/*
+auxiliary to svm_struct_classify_api_exit()
+*/
+void free_ensemble_models()
+{
+	for(unsigned int i = 0; i < ens.outfiles.size(); i++) fclose(ens.outfiles[i]);
+	if(ens.voteFile) fclose(ens.voteFile);
+	for(unsigned int m = 1; m < ens.models.size(); m++) //model 0 belongs to the caller
+	{
+		if(ens.models[m].svm_model) free_struct_model(ens.models[m]);
+		else free(ens.models[m].w); //the average
+	}
+	ens.models.clear();
+}
+
+/*
+decode x with every model of the ensemble: gather each token's features once against the stacked emission weights,
+then run Viterbi per model; write the other models' and the voted predictions and return model 0's
+*/
+LABEL classify_struct_example_ensemble(PATTERN x, STRUCTMODEL *sm, STRUCT_LEARN_PARM *sparm)
+{
+	if(ens.models.empty()) read_ensemble_models(sm, sparm);
+	const unsigned int length = x.getLength(), numTags = getNumTags(), numModels = ens.models.size(), numCols = numModels * numTags;
+
+	//one sparse gather per token for all models
+	vector<double> scores(length * numCols, 0.0);
+	for(unsigned int j = 0; j < length; j++)
+	{
+		double* sj = &scores[j * numCols];
+		for(const WORD* f = x.getToken(j).getFeatureMap().words; f->wnum != 0; f++)
+		{
+			const double* row = &ens.stackedEmissionWeights[(f->wnum - 1) * numCols];
+			for(unsigned int k = 0; k < numCols; k++)
+				sj[k] += f->weight * row[k];
+		}
+	}
+
+	ens.lastLabels.resize(numModels);
+	for(unsigned int m = 0; m < numModels; m++)
+	{
+		tagScores modelScores(x, ens.models[m].w, sparm);
+		for(unsigned int j = 0; j < length; j++)
+			for(tagID y = 0; y < numTags; y++)
+				modelScores.setEmission(j, y, scores[j * numCols + m * numTags + y]);
+		const noCost cost;
+		ens.lastLabels[m] = sequenceLattice<maxPlusSemiring, noCost, tagScores>(modelScores, cost).getBestLabeling();
+	}
+	const unsigned int numVoters = ensembleModelFiles.size() + 1;
+	for(unsigned int m = 1; m < numVoters; m++)
+		write_label(ens.outfiles[m - 1], ens.lastLabels[m]);
+
+	if(ensembleVoting == VOTE_MAJORITY) //per token; ties go to the earlier model
+	{
+		LABEL vote;
+		vote.setLength(length);
+		for(unsigned int j = 0; j < length; j++)
+		{
+			unsigned int maxVotes = 0;
+			for(unsigned int m = 0; m < numVoters; m++)
+			{
+				unsigned int votes = 0;
+				for(unsigned int n = 0; n < numVoters; n++)
+					if(ens.lastLabels[n].getTag(j) == ens.lastLabels[m].getTag(j)) votes++;
+				if(votes > maxVotes)
+				{
+					maxVotes = votes;
+					vote.setTag(j, ens.lastLabels[m].getTag(j));
+				}
+			}
+		}
+		ens.lastLabels.push_back(vote);
+	}
+	if(ens.voteFile) write_label(ens.voteFile, ens.lastLabels.back());
+
+	ens.numTokens += length;
+	for(unsigned int j = 0; j < length; j++)
+	{
+		bool allAgree = true;
+		for(unsigned int m = 1; allAgree && m < numVoters; m++)
+			allAgree = (ens.lastLabels[m].getTag(j) == ens.lastLabels[0].getTag(j));
+		if(allAgree) ens.numTokensAllAgree++;
+	}
+	return ens.lastLabels[0];
 }
 
+namespace
+{
 /*
-return the index into a feature vector that denotes the start of the output features for tag y,
-with an offset of 1 to work with svmlight
+auxiliary to bestLabelingSecondOrder(): the first-order relaxation of a second-order model, which gives each tag pair (k, t)
+the transition score of (k, t) plus that of its best allowed trigram (i, k, t) (just the pair's at position 1)
 */
-unsigned int get_output_feature_start_id(tagID y, STRUCT_LEARN_PARM* sparm)
+class relaxedSecondOrderScores : public tagScores
 {
-	static const unsigned int psqr = sqr(getNumTags()) + 1;
-	return psqr + sparm->featureSpaceSize * y;
+	public:
+
+		relaxedSecondOrderScores(PATTERN x, const double* w, STRUCT_LEARN_PARM* sparm) : tagScores(x, w, sparm), bestTrigram(numTags * numTags, -HUGE_VAL)
+		{
+			for(tagID k = 0; k < numTags; k++)
+				for(tagID t = 0; t < numTags; t++)
+					for(size_t i = 0; i < trigramPredecessors[k * numTags + t].size(); i++)
+						bestTrigram[k * numTags + t] = max(bestTrigram[k * numTags + t], w[get_allowed_trigram_feature_id(k, t, i, sparm)]);
+		}
+
+		double getTransition(unsigned int j, tagID k, tagID t) const
+		{
+			return get_transition_probability(w, k, t) + ((j >= 2) ? bestTrigram[k * numTags + t] : 0.0);
+		}
+
+	private:
+
+		vector<double> bestTrigram; //y1 * #tags + y2
+};
 }
 
 /*
-auxiliary to classify_struct_example(): return the log-probability, according to weight vector w,
-of the state transition y1 -> y2
+the best labeling of x under a second-order model, with the scores augmented by cost (see sequenceLattice), over the
+allowed trigrams only; exact, but the lattice is pruned first:
+
+- a first-order relaxation gives each tag pair (k, t) the transition score of (k, t) plus the best trigram (i, k, t)
+  (just the pair's at position 1), so its forward + backward max-marginals bound from above the score of any labeling
+  through a cell
+- the relaxation's Viterbi labeling, scored exactly, is a lower bound on the best labeling
+- cells whose bound is below that can't be on the best labeling and are dropped; Viterbi then runs over the pairs of
+  cells left at neighboring positions, extending each only by its allowed trigrams
+
+the relaxation takes two first-order passes, and the exact pass is cubic only in the tags left per position
 */
-inline double get_transition_probability(const double* w, tagID y1, tagID y2)
+template <class Cost>
+LABEL bestLabelingSecondOrder(PATTERN x, STRUCTMODEL* sm, STRUCT_LEARN_PARM* sparm, const Cost& cost)
 {
-	return w[get_transition_feature_id(y1, y2)];
+	const double* w = sm->w;
+	const unsigned int length = x.getLength(), numTags = getNumTags();
+	if(length == 0) return LABEL();
+
+	//the relaxation's max-marginals and best labeling
+	relaxedSecondOrderScores relaxed(x, w, sparm);
+	const sequenceLattice<maxPlusSemiring, Cost, relaxedSecondOrderScores> lattice(relaxed, cost);
+	vector<double> bounds;
+	lattice.getMaxMarginals(bounds);
+	LABEL y = lattice.getBestLabeling();
+
+	//the relaxation's best labeling, scored exactly (-inf if it has a trigram that isn't allowed)
+	double lowerBound = 0;
+	for(unsigned int j = 0; j < length; j++)
+	{
+		const tagID yj = y.getTag(j);
+		lowerBound += cost(j, yj) + relaxed.getEmission(j, yj);
+		if(j >= 1) lowerBound += get_transition_probability(w, y.getTag(j - 1), yj);
+		if(j >= 2)
+		{
+			const featureID id = get_trigram_feature_id(y.getTag(j - 2), y.getTag(j - 1), yj, sparm);
+			lowerBound += (id != 0) ? w[id] : -HUGE_VAL;
+		}
+	}
+	if(length == 1) return y;
+
+	//prune: keep the cells whose bound reaches the lower bound (less a little for rounding, as the sums are ordered differently)
+	const double threshold = lowerBound - 1e-9 * (1 + fabs(lowerBound));
+	vector<vector<tagID> > tags(length);
+	vector<int> index(length * numTags, -1); //position * #tags + tag -> index into tags[position], or -1 if dropped
+	for(unsigned int j = 0; j < length; j++)
+		for(tagID t = 0; t < numTags; t++)
+		{
+			const double bound = bounds[j * numTags + t];
+			if(bound > -HUGE_VAL && !(bound < threshold))
+			{
+				index[j * numTags + t] = tags[j].size();
+				tags[j].push_back(t);
+			}
+		}
+	decStats.numCells += length * numTags;
+	for(unsigned int j = 0; j < length; j++)
+	{
+		decStats.numCellsKept += tags[j].size();
+		if(tags[j].empty()) return y; //no labeling uses only allowed trigrams; keep the relaxation's
+	}
+
+	//Viterbi over pairs of kept cells: scores[j][a * #kept(j) + b] is the best path ending in tags[j - 1][a], tags[j][b]
+	vector<vector<double> > scores(length);
+	vector<vector<int> > backs(length); //index into tags[j - 2] of the tag before the pair
+	const unsigned int n0 = tags[0].size(), n1 = tags[1].size();
+	scores[1].resize(n0 * n1);
+	for(unsigned int a = 0; a < n0; a++)
+		for(unsigned int b = 0; b < n1; b++)
+		{
+			const tagID k = tags[0][a], t = tags[1][b];
+			scores[1][a * n1 + b] = ((cost(0, k) + relaxed.getEmission(0, k)) + cost(1, t) + get_transition_probability(w, k, t)) + relaxed.getEmission(1, t);
+		}
+	decStats.numTransitions += numTags * numTags + (unsigned long)(length - 2) * numTags * numTags * numTags;
+	decStats.numTransitionsScored += n0 * n1;
+	for(unsigned int j = 2; j < length; j++)
+	{
+		const unsigned int nPrev = tags[j - 1].size(), n = tags[j].size();
+		scores[j].assign(nPrev * n, -HUGE_VAL);
+		backs[j].assign(nPrev * n, -1);
+		for(unsigned int a = 0; a < nPrev; a++)
+			for(unsigned int b = 0; b < n; b++)
+			{
+				const tagID k = tags[j - 1][a], t = tags[j][b];
+				const vector<tagID>& p = trigramPredecessors[k * numTags + t];
+				const double arc = cost(j, t), pair = get_transition_probability(w, k, t), emission = relaxed.getEmission(j, t);
+				double& best = scores[j][a * n + b];
+				for(size_t i = 0; i < p.size(); i++)
+				{
+					const int c = index[(j - 2) * numTags + p[i]];
+					if(c < 0) continue;
+					decStats.numTransitionsScored++;
+					const double score = scores[j - 1][c * nPrev + a] + arc + (pair + w[get_allowed_trigram_feature_id(k, t, i, sparm)]) + emission;
+					if(score > best)
+					{
+						best = score;
+						backs[j][a * n + b] = c;
+					}
+				}
+			}
+	}
+
+	//the best final pair, and back from it
+	const unsigned int nLast = tags[length - 1].size(), nBeforeLast = tags[length - 2].size();
+	unsigned int bestPair = 0;
+	for(unsigned int p = 1; p < nBeforeLast * nLast; p++)
+		if(scores[length - 1][p] > scores[length - 1][bestPair]) bestPair = p;
+	if(!(scores[length - 1][bestPair] > -HUGE_VAL)) return y; //as above
+	unsigned int a = bestPair / nLast, b = bestPair % nLast;
+	for(int j = (int)length - 1; j >= 1; j--)
+	{
+		y.setTag(j, tags[j][b]);
+		y.setTag(j - 1, tags[j - 1][a]);
+		if(j >= 2)
+		{
+			const unsigned int c = backs[j][a * tags[j].size() + b];
+			b = a;
+			a = c;
+		}
+	}
+	return y;
 }
 
+namespace
+{
 /*
-auxiliary to classify_struct_example(): return the log-probability, according to weight vector w,
-of state y outputting a token with x's feature vector
+auxiliary to classify_struct_example() (--c): check the semirings and costs of the sequence lattice against each other
+on x, whose Viterbi labeling is y: the tag posteriors at each position sum to 1, the k-best paths come in decreasing
+order of score and the single best one is y with Viterbi's score, and a per-tag cost with unit weights decodes like
+Hamming
 */
-inline double get_output_probability(const double* w, tagID y, const token& x, STRUCT_LEARN_PARM* sparm)
+void checkSequenceLattice(PATTERN x, const LABEL& y, STRUCTMODEL* sm, STRUCT_LEARN_PARM* sparm)
 {
-	//we want the dot product of x's features with the appropriate subvector of w
-	const unsigned int startIndex = get_output_feature_start_id(y, sparm);
-	return x.dotProduct(&w[startIndex - 1]); //the feature numbers in x start at 1
+	const unsigned int length = x.getLength(), numTags = getNumTags();
+	if(length == 0) return;
+	vector<double> posteriors;
+	tagPosteriors(x, sm, sparm, noCost(), posteriors);
+	for(unsigned int j = 0; j < length; j++)
+	{
+		double sum = 0;
+		for(tagID t = 0; t < numTags; t++) sum += posteriors[j * numTags + t];
+		if(fabs(sum - 1) > 1e-6)
+		{
+			fprintf(stderr, "checkSequenceLattice(): the tag posteriors at position %u sum to %.9g; exiting\n", j, sum);
+			exit(-1);
+		}
+	}
+
+	tagScores scores(x, sm->w, sparm);
+	const double viterbiScore = sequenceLattice<maxPlusSemiring, noCost, tagScores>(scores, noCost()).getBestScore();
+	vector<double> bestScores;
+	const vector<LABEL> best = kBestLabelings<1>(x, sm, sparm, noCost(), bestScores);
+	if(best.size() != 1 || !(best[0] == y) || bestScores[0] != viterbiScore)
+	{
+		fprintf(stderr, "checkSequenceLattice(): the 1-best path isn't the Viterbi path; exiting\n");
+		exit(-1);
+	}
+	const vector<LABEL> kBest = kBestLabelings<4>(x, sm, sparm, noCost(), bestScores);
+	for(unsigned int i = 1; i < kBest.size(); i++)
+		if(bestScores[i] > bestScores[i - 1] || kBest[i] == kBest[i - 1])
+		{
+			fprintf(stderr, "checkSequenceLattice(): the k-best paths aren't distinct and in decreasing order of score; exiting\n");
+			exit(-1);
+		}
+	if(!(kBest[0] == y))
+	{
+		fprintf(stderr, "checkSequenceLattice(): the k-best paths don't start with the Viterbi path; exiting\n");
+		exit(-1);
+	}
+
+	const vector<double> unitWeights(numTags, 1.0);
+	if(!(bestLabeling(x, sm, sparm, weightedTagCost(y, unitWeights)) == bestLabeling(x, sm, sparm, hammingCost(y))))
+	{
+		fprintf(stderr, "checkSequenceLattice(): the unit-weighted per-tag cost doesn't decode like Hamming; exiting\n");
+		exit(-1);
+	}
+}
 }
 
 LABEL       classify_struct_example(PATTERN x, STRUCTMODEL *sm, STRUCT_LEARN_PARM *sparm)
@@ -497,81 +2868,175 @@ LABEL       classify_struct_example(PATTERN x, STRUCTMODEL *sm, STRUCT_LEARN_PAR
      recognized by the function empty_label(y). */
   LABEL y;
 
+	if(sparm->transitionOrder == 2)
+	{
+		if(!ensembleModelFiles.empty() || decoder != DECODER_VITERBI || checkLattice)
+		{
+			fprintf(stderr, "classify_struct_example(): a second-order model (--t 2) can only be decoded with --d 0, no ensemble and no --c; exiting\n");
+			exit(-1);
+		}
+		return bestLabelingSecondOrder(x, sm, sparm, noCost());
+	}
+	if(checkLattice && (!ensembleModelFiles.empty() || decoder != DECODER_VITERBI))
+	{
+		fprintf(stderr, "classify_struct_example(): --c checks the Viterbi decoder (--d 0, no ensemble) only; exiting\n");
+		exit(-1);
+	}
+	if(!ensembleModelFiles.empty()) return classify_struct_example_ensemble(x, sm, sparm);
+	if(decoder == DECODER_COARSE_TO_FINE) return classify_struct_example_coarse_to_fine(x, sm, sparm);
+	if(decoder == DECODER_ASTAR) return classify_struct_example_astar(x, sm, sparm);
+
 	/* use Viterbi to calculate, in order, each token's most likely state */
+	y = bestLabeling(x, sm, sparm, noCost());
+	if(checkLattice) checkSequenceLattice(x, y, sm, sparm);
+
+  return(y);
+}
 
-	static double* stateProbabilities[2] = {NULL, NULL}; //one for the current tag position and one for the previous
-	static bool init = true;
-	if(init)
+/******* class incrementalTagger ******/
+
+incrementalTagger::incrementalTagger(STRUCTMODEL* sm, STRUCT_LEARN_PARM* sparm) : sm(sm), sparm(sparm), numRecomputed(0)
+{
+	if(sparm->transitionOrder == 2)
 	{
-		stateProbabilities[0] = new double[getNumTags()];
-		stateProbabilities[1] = new double[getNumTags()];
-		init = false;
+		fprintf(stderr, "incrementalTagger: second-order models (--t 2) aren't supported; exiting\n");
+		exit(-1);
 	}
-	bool vecnum; //which of the two is the current 'current' vector
+}
 
-	double maxProb = -1;
-	unsigned int maxIndex;
-	/* initial probability P(x_0 | y_0 = y) for all y */
-	vecnum = 0;
-	for(unsigned int i = 0; i < getNumTags(); i++)
+LABEL incrementalTagger::tag(const PATTERN& x)
+{
+	vector<token> tokens;
+	for(unsigned int i = 0; i < x.getLength(); i++) tokens.push_back(x.getToken(i));
+	positions.clear();
+	tags.clear();
+	return retag(0, 0, tokens);
+}
+
+LABEL incrementalTagger::retag(unsigned int start, unsigned int numRemoved, const vector<token>& inserted)
+{
+	if(start > positions.size() || numRemoved > positions.size() - start)
+	{
+		fprintf(stderr, "incrementalTagger::retag(): can't remove tokens %u..%u of %u; exiting\n", start, start + numRemoved, (unsigned int)positions.size());
+		exit(-1);
+	}
+	positions.erase(positions.begin() + start, positions.begin() + start + numRemoved);
+	tags.erase(tags.begin() + start, tags.begin() + start + numRemoved);
+	vector<shared_ptr<positionCache> > newPositions;
+	for(unsigned int i = 0; i < inserted.size(); i++)
 	{
-		stateProbabilities[vecnum][i] = get_output_probability(sm->w, (tagID)i, x.getToken(0), sparm);
-		if(stateProbabilities[vecnum][i] > maxProb)
+		shared_ptr<positionCache> p(new positionCache);
+		p->x = inserted[i];
+		for(tagID y = 0; y < getNumTags(); y++)
+			p->emissions.push_back(get_output_probability(sm->w, y, p->x, sparm));
+		newPositions.push_back(p);
+	}
+	positions.insert(positions.begin() + start, newPositions.begin(), newPositions.end());
+	tags.insert(tags.begin() + start, inserted.size(), 0);
+
+	numRecomputed = 0;
+	const unsigned int length = positions.size(), end = start + inserted.size();
+	//forward scores change from the edit on, until they are the same as before past it
+	unsigned int tagsEnd = start;
+	while(tagsEnd < length)
+		if(!updateForward(tagsEnd++) && tagsEnd > end)
 		{
-			maxProb = stateProbabilities[vecnum][i];
-			maxIndex = i;
+			tagsEnd--;
+			break;
 		}
-	}
+	//backward scores change from the end of the edit back, until they are the same as before in front of it
+	int tagsBegin = (int)end - 1;
+	while(tagsBegin >= 0)
+		if(!updateBackward(tagsBegin--) && tagsBegin + 1 < (int)start)
+		{
+			tagsBegin++;
+			break;
+		}
+	updateTags(tagsBegin + 1, tagsEnd);
+	return getLabel();
+}
+
+namespace
+{
+/*
+auxiliary to updateForward() and updateBackward(): whether new scores are the same as the cached ones, up to rounding
+*/
+bool sameScores(const vector<double>& s1, const vector<double>& s2)
+{
+	if(s1.size() != s2.size()) return false;
+	for(unsigned int i = 0; i < s1.size(); i++)
+		if(fabs(s1[i] - s2[i]) > 1e-12 * (1 + fabs(s2[i]))) return false;
+	return true;
+}
+}
 
-	vector<vector<tagID> > mostLikelyPaths; //from index (j - 1, i) we can trace back the most likely path ending at state i at position j
-	/* recursion: find argmax(y) {P(x_i = x'_i | y_i) P(y_i = y | y_i-1)} */
-	double tempProb;
-	for(unsigned int j = 1; j < x.getLength(); j++) /* loop over words in the sentence */
+bool incrementalTagger::updateForward(unsigned int j)
+{
+	const unsigned int numTags = getNumTags();
+	positionCache& p = *positions[j];
+	vector<double> scores(numTags);
+	double maxScore = -HUGE_VAL;
+	for(tagID y = 0; y < numTags; y++)
 	{
-		vecnum = !vecnum;
-		mostLikelyPaths.push_back(vector<tagID>());
-		maxProb = -1;
-		//loop over the tag in the current spot
-		for(unsigned int i = 0; i < getNumTags(); i++)
+		double prevScore = 0;
+		if(j > 0)
 		{
-			stateProbabilities[vecnum][i] = -1;
-			double outputProb = get_output_probability(sm->w, i, x.getToken(j), sparm);
-			//loop over the tag in the previous spot
-			for(unsigned int k = 0; k < getNumTags(); k++)
-			{
-				//add log-"probabilities" to get a comparison equivalent to multiplying probabilities
-				tempProb = stateProbabilities[!vecnum][k]							//value of previous subsequence
-								+ get_transition_probability(sm->w, k, i)			//transition cost
-								+ outputProb;												//output cost
-				if(tempProb > stateProbabilities[vecnum][i])
-				{
-					stateProbabilities[vecnum][i] = tempProb;
-					maxIndex = k;
-				}
-			}
-			mostLikelyPaths.back().push_back((tagID)maxIndex); //push a reference to the previous label in the most likely path to this one
+			const vector<double>& prev = positions[j - 1]->forward;
+			prevScore = -HUGE_VAL;
+			for(tagID k = 0; k < numTags; k++)
+				prevScore = max(prevScore, prev[k] + get_transition_probability(sm->w, k, y));
 		}
+		scores[y] = prevScore + p.emissions[y];
+		maxScore = max(maxScore, scores[y]);
 	}
+	for(tagID y = 0; y < numTags; y++) scores[y] -= maxScore;
+	numRecomputed++;
+	const bool changed = !sameScores(scores, p.forward);
+	p.forward.swap(scores);
+	return changed;
+}
 
-	//find the final state whose max-prob sequence has highest probability
-	maxIndex = 0;
-	maxProb = stateProbabilities[vecnum][0];
-	for(unsigned int i = 1; i < getNumTags(); i++)
-		if(stateProbabilities[vecnum][i] > maxProb)
+bool incrementalTagger::updateBackward(unsigned int j)
+{
+	const unsigned int numTags = getNumTags();
+	positionCache& p = *positions[j];
+	vector<double> scores(numTags, 0.0);
+	if(j + 1 < positions.size())
+	{
+		const positionCache& next = *positions[j + 1];
+		double maxScore = -HUGE_VAL;
+		for(tagID y = 0; y < numTags; y++)
 		{
-			maxProb = stateProbabilities[vecnum][i];
-			maxIndex = i;
+			scores[y] = -HUGE_VAL;
+			for(tagID k = 0; k < numTags; k++)
+				scores[y] = max(scores[y], get_transition_probability(sm->w, y, k) + next.emissions[k] + next.backward[k]);
+			maxScore = max(maxScore, scores[y]);
 		}
-	//build y in reverse by looking backward through the table to find the max-prob path
-	y.setLength(x.getLength());
-	y.setTag(y.getLength() - 1, (tagID)maxIndex);
-	for(int j = x.getLength() - 2; j > -1; j--)
+		for(tagID y = 0; y < numTags; y++) scores[y] -= maxScore;
+	}
+	numRecomputed++;
+	const bool changed = !sameScores(scores, p.backward);
+	p.backward.swap(scores);
+	return changed;
+}
+
+void incrementalTagger::updateTags(unsigned int begin, unsigned int end)
+{
+	for(unsigned int j = begin; j < end; j++)
 	{
-		y.setTag(j, mostLikelyPaths[j][maxIndex]);
-		maxIndex = mostLikelyPaths[j][maxIndex];
+		const positionCache& p = *positions[j];
+		tags[j] = 0;
+		for(tagID y = 1; y < getNumTags(); y++)
+			if(p.forward[y] + p.backward[y] > p.forward[tags[j]] + p.backward[tags[j]])
+				tags[j] = y;
 	}
+}
 
-  return(y);
+LABEL incrementalTagger::getLabel() const
+{
+	LABEL y;
+	y.setTagsVector(shared_ptr<vector<tagID> >(new vector<tagID>(tags)));
+	return y;
 }
 
 LABEL       find_most_violated_constraint_slackrescaling(PATTERN x, LABEL y, STRUCTMODEL *sm, STRUCT_LEARN_PARM *sparm)
@@ -613,80 +3078,9 @@ LABEL       find_most_violated_constraint_marginrescaling(PATTERN x, LABEL y, ST
      as recognized by the function empty_label(y). */
   LABEL ybar;
 
-  /* use Viterbi to calculate the cost for each possible state at each position in the input in turn */
-
-	static double* stateCosts[2] = {NULL, NULL}; //one for the current tag position and one for the previous
-	static bool init = true;
-	if(init)
-	{
-		stateCosts[0] = new double[getNumTags()];
-		stateCosts[1] = new double[getNumTags()];
-		init = false;
-	}
-	bool vecnum; //which cost vector is acting as the 'current' one
-
-	//calculate costs for the first position
-	vecnum = 0;
-	for(unsigned int j = 0; j < getNumTags(); j++)
-		/*
-		calculate the total additional cost of adding this tag to the sequence
-		(note we don't subtract w * psi(x, y), since that's the same for every ybar)
-		*/
-		stateCosts[vecnum][j] = ((j != y.getTag(0)) ? 1 : 0) 														//mislabeling cost (loss)
-										+ get_output_probability(sm->w, (tagID)j, x.getToken(0), sparm);		//output cost
-
-	vector<vector<tagID> > mostCostlyPaths; //from index (j - 1, i) we can trace back the most likely path ending at state i at position j
-	double tempCost, outputProb;
-	unsigned int maxIndex;
-	for(unsigned int i = 1; i < x.getLength(); i++) /* loop over words in the sentence */
-	{
-		vecnum = !vecnum;
-		mostCostlyPaths.push_back(vector<tagID>());
-		/* calculate the cost of labeling x_i with postag j */
-		//run through tags at present position
-		for(unsigned int j = 0; j < getNumTags(); j++)
-		{
-			outputProb = get_output_probability(sm->w, j, x.getToken(i), sparm); //probability that x[i] is output from state j
-			//run through tags at previous position
-			for(unsigned int k = 0; k < getNumTags(); k++)
-			{
-				/*
-				calculate the total additional cost of adding this tag to the sequence
-				(note we don't subtract w * psi(x, y), since that's the same for every ybar)
-				*/
-				tempCost = stateCosts[!vecnum][k]									//cost of previous subsequence
-								+ ((j != y.getTag(i)) ? 1 : 0) 						//mislabeling cost (loss)
-								+ get_transition_probability(sm->w, k, j)			//transition cost
-								+ outputProb;												//output cost
-				if(k == 0 || tempCost > stateCosts[vecnum][j])
-				{
-					stateCosts[vecnum][j] = tempCost;
-					maxIndex = k;
-				}
-			}
-			mostCostlyPaths.back().push_back((tagID)maxIndex); //push a reference to the previous tag in this tag's most costly path
-		}
-	}
-
-	//find the last-position tag with the highest-cost path
-	double maxCost = stateCosts[vecnum][0];
-	maxIndex = 0;
-	for(unsigned int j = 1; j < getNumTags(); j++)
-	{
-		if(stateCosts[vecnum][j] > maxCost)
-		{
-			maxCost = stateCosts[vecnum][j];
-			maxIndex = j;
-		}
-	}
-	//build the costliest overall path backward from its end via the table
-	ybar.setLength(x.getLength());
-	ybar.setTag(ybar.getLength() - 1, (tagID)maxIndex);
-	for(int i = x.getLength() - 2; i > -1; i--)
-	{
-		ybar.setTag(i, mostCostlyPaths[i][maxIndex]);
-		maxIndex = mostCostlyPaths[i][maxIndex];
-	}
+  /* use Viterbi to find the labeling with the highest score plus loss (note we don't subtract w * psi(x, y), since that's the same for every ybar) */
+	if(sparm->transitionOrder == 2) ybar = bestLabelingSecondOrder(x, sm, sparm, hammingCost(y));
+	else ybar = bestLabeling(x, sm, sparm, hammingCost(y));
 
 	//	if(y == ybar) return label(); //special case: return empty label
   return(ybar);
@@ -731,7 +3125,7 @@ unsigned int sparseVecLength(const SVECTOR& v)
 /*
 stick src on the end of dest, adding offset to each feature number in src
 */
-void appendFeatureVectorWithFeatNumOffset(SVECTOR& dest, const SVECTOR& src, unsigned int offset)
+void appendFeatureVectorWithFeatNumOffset(SVECTOR& dest, const SVECTOR& src, featureID offset)
 {
 	unsigned int sizeDest = sparseVecLength(dest), sizeSrc = sparseVecLength(src);
 	WORD* temp = dest.words;
@@ -781,8 +3175,8 @@ SVECTOR     *psi(PATTERN x, LABEL y, STRUCTMODEL *sm, STRUCT_LEARN_PARM *sparm)
 	*/
 
 	//count state transitions and build a total feature vector for each tag that's used in sentence x
-	hash_map<unsigned int, unsigned int> transitions; //one entry per tag->tag transition found in the input; the value is the count
-	static SVECTOR** featuresByTag = new SVECTOR*[getNumTags()]; //tag ID -> map of feature IDs to sum of values for all words with said tag
+	hash_map<featureID, unsigned int> transitions; //one entry per tag->tag transition found in the input; the value is the count
+	vector<SVECTOR*> featuresByTag(getNumTags()); //tag ID -> map of feature IDs to sum of values for all words with said tag
 
 	for(unsigned int i = 0; i < getNumTags(); i++)
 	{
@@ -815,7 +3209,7 @@ SVECTOR     *psi(PATTERN x, LABEL y, STRUCTMODEL *sm, STRUCT_LEARN_PARM *sparm)
 	for(unsigned int i = 0; i < getNumTags(); i++)
 		for(unsigned int j = 0; j < getNumTags(); j++)
 		{
-			unsigned int id = get_transition_feature_id(i, j);
+			featureID id = get_transition_feature_id(i, j);
 			if(transitions.find(id) != transitions.end())
 			{
 				fvec->words[fvecIndex].wnum = id; //feature numbers start at 1; this is handled in get_*_id()
@@ -831,6 +3225,34 @@ SVECTOR     *psi(PATTERN x, LABEL y, STRUCTMODEL *sm, STRUCT_LEARN_PARM *sparm)
 		if(featuresByTag[i]->words[0].wnum != 0) //there are tokens with this label
 			appendFeatureVectorWithFeatNumOffset(*fvec, *featuresByTag[i], get_output_feature_start_id((tagID)i, sparm) - 1);
 
+	//second-order models: the count of each tag trigram used, after everything else
+	if(sparm->transitionOrder == 2 && y.getLength() > 2)
+	{
+		vector<featureID> ids;
+		for(unsigned int i = 2; i < y.getLength(); i++)
+		{
+			const featureID id = get_trigram_feature_id(y.getTag(i - 2), y.getTag(i - 1), y.getTag(i), sparm);
+			if(id != 0) ids.push_back(id); //a trigram that isn't allowed has no feature
+		}
+		sort(ids.begin(), ids.end());
+		vector<WORD> counts;
+		for(size_t i = 0; i < ids.size(); i++)
+			if(counts.empty() || counts.back().wnum != ids[i])
+			{
+				WORD f;
+				f.wnum = ids[i];
+				f.weight = 1;
+				counts.push_back(f);
+			}
+			else counts.back().weight++;
+		WORD end;
+		end.wnum = 0;
+		counts.push_back(end);
+		SVECTOR trigrams;
+		trigrams.words = &counts[0];
+		appendFeatureVectorWithFeatNumOffset(*fvec, trigrams, 0);
+	}
+
 	//cleanup
 	for(unsigned int i = 0; i < getNumTags(); i++)
 		free_svector(featuresByTag[i]);
@@ -933,6 +3355,38 @@ void        print_struct_testing_stats(SAMPLE sample, STRUCTMODEL *sm,
 
 	double avgLoss = (double)(teststats->numTokens - teststats->numCorrectTags) / teststats->numTokens;
 	printf("average loss per word: %.4lf\n", avgLoss);
+	if(!ensembleModelFiles.empty())
+	{
+		const unsigned int numVoters = ensembleModelFiles.size() + 1;
+		for(unsigned int m = 1; m < numVoters; m++)
+			printf("average loss per word of '%s': %.4lf\n", ensembleModelFiles[m - 1].c_str(),
+				(double)(teststats->numTokens - ens.numCorrectTags[m]) / teststats->numTokens);
+		if(ensembleVoting != VOTE_NONE)
+			printf("average loss per word of the %s vote: %.4lf\n", (ensembleVoting == VOTE_MAJORITY) ? "majority" : "score",
+				(double)(teststats->numTokens - ens.numCorrectTags.back()) / teststats->numTokens);
+		printf("all %u models agree on %lu of %lu tokens (%.2f%%)\n", numVoters, ens.numTokensAllAgree, ens.numTokens,
+			100.0 * ens.numTokensAllAgree / ens.numTokens);
+	}
+	else if(sparm->transitionOrder == 2)
+	{
+		printf("second-order decoding: kept %lu of %lu lattice cells (%.2f%%), scored %lu of %lu tag pairs and trigrams (%.2f%%)\n",
+			decStats.numCellsKept, decStats.numCells, 100.0 * decStats.numCellsKept / max(decStats.numCells, 1UL),
+			decStats.numTransitionsScored, decStats.numTransitions, 100.0 * decStats.numTransitionsScored / max(decStats.numTransitions, 1UL));
+	}
+	else if(decoder == DECODER_COARSE_TO_FINE)
+	{
+		printf("coarse-to-fine decoding over %u tag clusters: kept %lu of %lu lattice cells (%.2f%%)\n",
+			decStats.numClusters, decStats.numCellsKept, decStats.numCells, 100.0 * decStats.numCellsKept / decStats.numCells);
+		printf("scored %lu of %lu transitions (%.2f%%) and %lu of %lu emissions (%.2f%%), including the coarse pass\n",
+			decStats.numTransitionsScored, decStats.numTransitions, 100.0 * decStats.numTransitionsScored / max(decStats.numTransitions, 1UL),
+			decStats.numEmissionsScored, decStats.numEmissions, 100.0 * decStats.numEmissionsScored / decStats.numEmissions);
+	}
+	else if(decoder == DECODER_ASTAR)
+	{
+		printf("A* decoding: expanded %lu of %lu lattice cells (%.2f%%), scored %lu of %lu transitions (%.2f%%)\n",
+			decStats.numCellsKept, decStats.numCells, 100.0 * decStats.numCellsKept / decStats.numCells,
+			decStats.numTransitionsScored, decStats.numTransitions, 100.0 * decStats.numTransitionsScored / max(decStats.numTransitions, 1UL));
+	}
 }
 
 void        eval_prediction(long exnum, EXAMPLE ex, LABEL ypred,
@@ -951,6 +3405,19 @@ void        eval_prediction(long exnum, EXAMPLE ex, LABEL ypred,
   for(unsigned int i = 0; i < ex.x.getLength(); i++)
   	if(ex.y.getTag(i) == ypred.getTag(i))
   		teststats->numCorrectTags++;
+  //the other models of an ensemble, and the vote (the average model's prediction when score voting)
+  if(!ensembleModelFiles.empty())
+  {
+  	const unsigned int numVoters = ensembleModelFiles.size() + 1;
+  	for(unsigned int i = 0; i < ex.x.getLength(); i++)
+  	{
+  		for(unsigned int m = 1; m < numVoters; m++)
+  			if(ex.y.getTag(i) == ens.lastLabels[m].getTag(i))
+  				ens.numCorrectTags[m]++;
+  		if(ensembleVoting != VOTE_NONE && ex.y.getTag(i) == ens.lastLabels.back().getTag(i))
+  			ens.numCorrectTags.back()++;
+  	}
+  }
 }
 
 /*
@@ -973,21 +3440,119 @@ void write_struct_model(char *file, STRUCTMODEL *sm, STRUCT_LEARN_PARM *sparm)
   outfile << "feature space size: " << sparm->featureSpaceSize << endl;
   //write the tags we picked up from the input
   outfile << "labels:";
-  for(hash_map<tagID, tag>::iterator i = idToTagMap.begin(); i != idToTagMap.end(); i++)
-  	outfile << " " << (*i).first << "=" << (*i).second;
+  for(tagID i = 0; i < getNumTags(); i++)
+  	outfile << " " << i << "=" << getTagByID(i);
   outfile << endl;
   //write the (sparse) weight vector
   outfile << "weight vector size: " << sm->sizePsi << endl;
   outfile << "weight vector:";
-  for(unsigned int i = 0; i < (unsigned int)sm->sizePsi; i++)
+  for(featureID i = 0; i <= sm->sizePsi; i++) //feature numbers run from 1 to sizePsi
   	if(sm->w[i] != 0)
   		outfile << " " << i << ":" << setprecision(8) << sm->w[i];
   outfile << endl;
   outfile << "loss type (1 = slack rescaling, 2 = margin rescaling): " << sparm->loss_type << endl;
   outfile << "loss function (should be 1 for svm-hmm): " << sparm->loss_function << endl;
+  //optional: the transition order and, for second-order models, the allowed trigrams as (y0 * #tags + y1) * #tags + y2
+  if(sparm->transitionOrder == 2)
+  {
+  	outfile << "transition order: 2" << endl;
+  	outfile << "trigrams:";
+  	for(tagID y1 = 0; y1 < getNumTags(); y1++)
+  		for(tagID y2 = 0; y2 < getNumTags(); y2++)
+  		{
+  			const vector<tagID>& p = trigramPredecessors[y1 * getNumTags() + y2];
+  			for(size_t i = 0; i < p.size(); i++)
+  				outfile << " " << ((featureID)p[i] * getNumTags() + y1) * getNumTags() + y2;
+  		}
+  	outfile << endl;
+  }
+  //optional: the input feature number for each compacted feature number 1..featureSpaceSize
+  if(!inputFeatureIDs.empty())
+  {
+  	outfile << "feature map:";
+  	for(size_t i = 0; i < inputFeatureIDs.size(); i++)
+  		outfile << " " << inputFeatureIDs[i];
+  	outfile << endl;
+  }
+  //optional: the token feature map (--x); the landmarks and projection rows are written in full precision
+  if(tokenMap.type != TOKEN_MAP_NONE)
+  {
+  	char buf[40];
+  	const KERNEL_PARM& k = tokenMap.kernel;
+  	outfile << "token feature map: " << tokenMap.type << " " << tokenMap.dim << " " << tokenMap.inputSize << " " << k.kernel_type << " " << k.poly_degree;
+  	outfile << " " << format_shortest_double(buf, k.rbf_gamma) << " " << format_shortest_double(buf, k.coef_lin);
+  	outfile << " " << format_shortest_double(buf, k.coef_const) << " " << tokenMap.seed << endl;
+  	for(size_t i = 0; i < tokenMap.landmarks.size(); i++)
+  	{
+  		outfile << "landmark:";
+  		for(const WORD* f = tokenMap.landmarks[i]->words; f->wnum != 0; f++)
+  			outfile << " " << f->wnum << ":" << format_shortest_double(buf, f->weight);
+  		outfile << endl;
+  	}
+  	for(long d = 0; d < tokenMap.dim && !tokenMap.landmarks.empty(); d++)
+  	{
+  		outfile << "projection:";
+  		for(size_t i = 0; i < tokenMap.landmarks.size(); i++)
+  			outfile << " " << format_shortest_double(buf, tokenMap.projection[d * tokenMap.landmarks.size() + i]);
+  		outfile << endl;
+  	}
+  }
+  //a linear model is fully described by w, so the support vectors are optional
+  bool writeSvmModel = sparm->writeSvmModel || sm->svm_model->kernel_parm.kernel_type != LINEAR;
+  if(!sparm->writeSvmModel && writeSvmModel)
+  	fprintf(stderr, "write_struct_model(): the svm model is needed for non-linear kernels; writing it anyway\n");
+  if(!writeSvmModel)
+  	outfile << "svm model: none" << endl;
   outfile.close();
-  printf("writing svm model to '%s'\n", structModelFilename2svmModelFilename(file).c_str());
-  write_model(const_cast<char*>(structModelFilename2svmModelFilename(file).c_str()), sm->svm_model); //write svm model
+  if(writeSvmModel)
+  {
+  	printf("writing svm model to '%s'\n", structModelFilename2svmModelFilename(file).c_str());
+  	write_model(const_cast<char*>(structModelFilename2svmModelFilename(file).c_str()), sm->svm_model); //write svm model
+  }
+}
+
+/*
+auxiliary to read_struct_model(): build a linear svm model whose weight vector is w,
+for models written without support vectors
+*/
+MODEL* create_linear_svm_model(double* w, long sizePsi)
+{
+	MODEL* svmModel = (MODEL*)my_malloc(sizeof(MODEL));
+	memset(svmModel, 0, sizeof(MODEL));
+	svmModel->kernel_parm.kernel_type = LINEAR;
+	strcpy(svmModel->kernel_parm.custom, "empty");
+	svmModel->sv_num = 1; //no support vectors
+	svmModel->supvec = (DOC**)my_malloc(sizeof(DOC*));
+	svmModel->supvec[0] = NULL;
+	svmModel->alpha = (double*)my_malloc(sizeof(double));
+	svmModel->alpha[0] = 0;
+	svmModel->index = NULL;
+	svmModel->totwords = sizePsi;
+	svmModel->lin_weights = w; //free_model() frees w along with the model
+	return svmModel;
+}
+
+namespace
+{
+bool throwModelErrors = false; //see struct_model_errors_throw()
+
+/*
+auxiliary to read_struct_model()
+*/
+void modelReadError(const string& msg)
+{
+	if(throwModelErrors) throw runtime_error(msg);
+	fprintf(stderr, "%s\n", msg.c_str());
+	exit(-1);
+}
+}
+
+/*
+have read_struct_model() throw runtime_error instead of exiting on a bad model (for programs that embed the tagger)
+*/
+void struct_model_errors_throw(int t)
+{
+	throwModelErrors = (t != 0);
 }
 
 /*
@@ -1000,9 +3565,11 @@ STRUCTMODEL read_struct_model(char *file, STRUCT_LEARN_PARM *sparm)
 
   STRUCTMODEL model;
 
-#define ERROR_READING(what) fprintf(stderr, "read_struct_model(): error reading " #what "\n"); exit(-1)
+#define ERROR_READING(what) modelReadError(string("read_struct_model(): error reading ") + #what)
 
   ifstream infile(file);
+  sparm->transitionOrder = 1; //unless the model says otherwise
+  sparm->tokenFeatureMap = TOKEN_MAP_NONE;
   //read number of features per word
   if(!(infile >> match("feature space size: ") >> sparm->featureSpaceSize))
   {
@@ -1029,21 +3596,32 @@ STRUCTMODEL read_struct_model(char *file, STRUCT_LEARN_PARM *sparm)
 	  {
 		  ERROR_READING("labels");
 	  }
-	  idToTagMap[id] = label;
-	  tagToIDMap[label] = id;
+	  setTagID(label, id);
   }
+  for(tagID i = 0; i < getNumTags(); i++)
+	  if(getTagByID(i).empty())
+	  {
+		  ERROR_READING("labels"); //the ids must be dense
+	  }
   //read the (sparse) weight vector
   if(!(infile >> match("weight vector size: ") >> model.sizePsi))
   {
 	  ERROR_READING("weight vector size");
   }
-  model.w = (double*)my_malloc(model.sizePsi * sizeof(double));
-  memset(model.w, 0, model.sizePsi * sizeof(double)); //all entries default to 0
+  if(model.sizePsi < 0 || model.sizePsi >= FNUM_MAX)
+  {
+	  ostringstream msg;
+	  msg << "read_struct_model(): weight vector size " << model.sizePsi << " doesn't fit into a feature number of " << sizeof(FNUM)
+		  << " bytes (define LARGE_INDEX in svm_common.h for 64-bit ids); exiting";
+	  modelReadError(msg.str());
+  }
+  model.w = (double*)my_malloc((model.sizePsi + 1) * sizeof(double)); //feature numbers run from 1 to sizePsi
+  memset(model.w, 0, (model.sizePsi + 1) * sizeof(double)); //all entries default to 0
   if(!(infile >> match("\nweight vector: ")))
   {
 	  ERROR_READING("weight vector");
   }
-  unsigned int featNum;
+  featureID featNum;
   double featVal;
   string featLine;
   if(!getline(infile, featLine, '\n'))
@@ -1052,7 +3630,13 @@ STRUCTMODEL read_struct_model(char *file, STRUCT_LEARN_PARM *sparm)
   }
   istringstream instr(featLine);
   while(instr >> featNum >> match(":") >> featVal)
+  {
+  	if(featNum < 0 || featNum > model.sizePsi)
+  	{
+  		ERROR_READING("weight vector");
+  	}
   	model.w[featNum] = featVal;
+  }
   //read the learning parameters
   if(!(infile >> match("loss type (1 = slack rescaling, 2 = margin rescaling): ") >> sparm->loss_type))
   {
@@ -1063,21 +3647,193 @@ STRUCTMODEL read_struct_model(char *file, STRUCT_LEARN_PARM *sparm)
 	  	ERROR_READING("loss function");
   }
 
+  //optional lines: the feature map, the token feature map, and a note that the support vectors weren't written (linear model)
+  bool haveSvmModel = true;
+  string optLine;
+  getline(infile, optLine, '\n'); //rest of the loss function line
+  while(getline(infile, optLine, '\n'))
+  {
+  	if(optLine == "svm model: none")
+  		haveSvmModel = false;
+  	else if(optLine.compare(0, 17, "transition order:") == 0)
+  	{
+  		istringstream inopt(optLine.substr(17));
+  		if(!(inopt >> sparm->transitionOrder) || (sparm->transitionOrder != 1 && sparm->transitionOrder != 2))
+  		{
+  			ERROR_READING("transition order");
+  		}
+  	}
+  	else if(optLine.compare(0, 9, "trigrams:") == 0)
+  	{
+  		istringstream inopt(optLine.substr(9));
+  		const featureID numTags = getNumTags();
+  		trigramPredecessors.assign(numTags * numTags, vector<tagID>());
+  		while(inopt >> featNum)
+  		{
+  			if(featNum < 0 || featNum >= numTags * numTags * numTags)
+  			{
+  				ERROR_READING("trigrams");
+  			}
+  			addTrigram(featNum / (numTags * numTags), featNum / numTags % numTags, featNum % numTags);
+  		}
+  		indexTrigrams();
+  	}
+  	else if(optLine.compare(0, 12, "feature map:") == 0)
+  	{
+  		istringstream inopt(optLine.substr(12));
+  		featureIDMap.clear();
+  		inputFeatureIDs.clear();
+  		while(inopt >> featNum)
+  		{
+  			inputFeatureIDs.push_back(featNum);
+  			featureIDMap[featNum] = inputFeatureIDs.size();
+  		}
+  	}
+  	else if(optLine.compare(0, 18, "token feature map:") == 0)
+  	{
+  		istringstream inopt(optLine.substr(18));
+  		KERNEL_PARM& k = tokenMap.kernel;
+  		if(!(inopt >> tokenMap.type >> tokenMap.dim >> tokenMap.inputSize >> k.kernel_type >> k.poly_degree >> k.rbf_gamma >> k.coef_lin >> k.coef_const >> tokenMap.seed)
+  			|| tokenMap.dim != sparm->featureSpaceSize || tokenMap.type < TOKEN_MAP_RANDOM_FOURIER || tokenMap.type > TOKEN_MAP_NYSTROEM)
+  		{
+  			ERROR_READING("token feature map");
+  		}
+  		sparm->tokenFeatureMap = tokenMap.type;
+  	}
+  	else if(optLine.compare(0, 9, "landmark:") == 0)
+  	{
+  		istringstream inopt(optLine.substr(9));
+  		vector<WORD> words;
+  		WORD f;
+  		while(inopt >> featNum >> match(":") >> featVal)
+  		{
+  			f.wnum = featNum;
+  			f.weight = featVal;
+  			words.push_back(f);
+  		}
+  		f.wnum = 0;
+  		words.push_back(f);
+  		addLandmark(create_svector(&words[0], const_cast<char*>(""), 1.0));
+  	}
+  	else if(optLine.compare(0, 11, "projection:") == 0)
+  	{
+  		istringstream inopt(optLine.substr(11));
+  		while(inopt >> featVal) tokenMap.projection.push_back(featVal);
+  	}
+  }
+  //the input of the token feature map, if any, is what the feature map produces
+  const featureID mappedFeatureSpaceSize = (tokenMap.type != TOKEN_MAP_NONE) ? tokenMap.inputSize : sparm->featureSpaceSize;
+  if(!inputFeatureIDs.empty() && (featureID)inputFeatureIDs.size() != mappedFeatureSpaceSize)
+  {
+  	ERROR_READING("feature map");
+  }
+  if(tokenMap.type == TOKEN_MAP_NYSTROEM && (long)tokenMap.projection.size() != tokenMap.dim * (long)tokenMap.landmarks.size())
+  {
+  	ERROR_READING("token feature map");
+  }
+  {
+  	const featureID numTags = getNumTags();
+  	if(model.sizePsi != numTags * (numTags + sparm->featureSpaceSize) + ((sparm->transitionOrder == 2) ? numTrigrams : 0)
+  		|| (sparm->transitionOrder == 2 && trigramPredecessors.size() != (size_t)(numTags * numTags)))
+  	{
+  		ERROR_READING("weight vector size");
+  	}
+  }
+  if(haveSvmModel && !ifstream(structModelFilename2svmModelFilename(file).c_str()))
+  {
+  	ERROR_READING("svm model");
+  }
+
 #undef ERROR_READING
 
   infile.close();
   setTagRegistryWritable(false); //make sure tags read in through the test set won't be used during classification
-  model.svm_model = read_model(const_cast<char*>(structModelFilename2svmModelFilename(file).c_str())); //read svm model
+  if(haveSvmModel)
+  	model.svm_model = read_model(const_cast<char*>(structModelFilename2svmModelFilename(file).c_str())); //read svm model
+  else model.svm_model = create_linear_svm_model(model.w, model.sizePsi);
   return model;
 }
 
+namespace
+{
+/*
+prediction output format (--b)
+
+the binary format starts with a header: the 8 bytes "SVMHMMT1", then as 32-bit unsigned integers in the machine's
+byte order 1 (to tell the byte order), the number of bytes per tag id (1, 2 or 4, the fewest that hold every id),
+the number of tags, and for each tag id in turn the length of its name followed by the name;
+each label is then its length as a 32-bit unsigned integer followed by that many tag ids, so sentence i starts
+4 * i + (tag id bytes) * (number of tags before it) bytes after the header
+*/
+enum {OUTPUT_TEXT = 0, OUTPUT_BINARY = 1};
+int outputFormat = OUTPUT_TEXT; //--b
+
+vector<string> tagOutputStrings; //tag id -> "TAG "; the registry doesn't change once the model is read
+set<FILE*> binaryHeaderWritten; //the prediction files we've written a header to
+string outputBuffer; //the label being written
+
+void checkWrite(FILE* fp, const void* data, size_t size)
+{
+	if(size > 0 && fwrite(data, size, 1, fp) != 1)
+	{
+		perror("write_label()");
+		exit(1);
+	}
+}
+
+void appendUInt(string& s, uint32_t u, unsigned int numBytes)
+{
+	s.append(reinterpret_cast<const char*>(&u) + ((numBytes < 4 && htonl(1) == 1) ? 4 - numBytes : 0), numBytes); //the low bytes
+}
+
+unsigned int getTagIDBytes()
+{
+	return (getNumTags() <= 0x100) ? 1 : (getNumTags() <= 0x10000) ? 2 : 4;
+}
+
+void write_binary_header(FILE* fp)
+{
+	string& h = outputBuffer;
+	h.assign("SVMHMMT1");
+	appendUInt(h, 1, 4);
+	appendUInt(h, getTagIDBytes(), 4);
+	appendUInt(h, getNumTags(), 4);
+	for(tagID t = 0; t < getNumTags(); t++)
+	{
+		const tag& name = getTagByID(t);
+		appendUInt(h, name.length(), 4);
+		h.append(name);
+	}
+	checkWrite(fp, h.data(), h.length());
+	binaryHeaderWritten.insert(fp);
+}
+}
+
 void        write_label(FILE *fp, LABEL y)
 {
   /* Writes label y to file handle fp. Used only to output classification results. */
-  fprintf(fp, "{ ");
-  for(unsigned int i = 0; i < y.getLength(); i++)
-  	fprintf(fp, "%s ", getTagByID(y.getTag(i)).c_str());
-  fprintf(fp, "}");
+	//each label is put together in a buffer and written at once, with the tag strings looked up by id in a dense table
+	string& out = outputBuffer;
+	if(outputFormat == OUTPUT_BINARY)
+	{
+		if(binaryHeaderWritten.find(fp) == binaryHeaderWritten.end()) write_binary_header(fp);
+		const unsigned int numBytes = getTagIDBytes();
+		out.clear();
+		appendUInt(out, y.getLength(), 4);
+		for(unsigned int i = 0; i < y.getLength(); i++) appendUInt(out, y.getTag(i), numBytes);
+	}
+	else
+	{
+		if(tagOutputStrings.size() != getNumTags())
+		{
+			tagOutputStrings.resize(getNumTags());
+			for(tagID t = 0; t < getNumTags(); t++) tagOutputStrings[t] = getTagByID(t) + " ";
+		}
+		out.assign("{ ");
+		for(unsigned int i = 0; i < y.getLength(); i++) out.append(tagOutputStrings[y.getTag(i)]);
+		out.append("}");
+	}
+	checkWrite(fp, out.data(), out.length());
 }
 
 void        free_pattern(PATTERN x)
@@ -1095,6 +3851,8 @@ void        free_struct_model(STRUCTMODEL sm)
 {
   /* Frees the memory of model. */
   /* if(sm.w) GC_FREE(sm.w); */ /* this is free'd in free_model */
+  //unless read_struct_model() read the support vectors, in which case w is separate from the svm model's weights
+  if(sm.w && (!sm.svm_model || sm.w != sm.svm_model->lin_weights)) free(sm.w);
   if(sm.svm_model) free_model(sm.svm_model, 1);
   /* add free calls for user defined data here */
 }
@@ -1102,7 +3860,8 @@ void        free_struct_model(STRUCTMODEL sm)
 void        free_struct_sample(SAMPLE s)
 {
   /* Frees the memory of sample s. */
-  //no-op; we don't know whether the examples were allocated via malloc() or new[]
+  delete [] s.examples; //allocated by read_struct_examples(); the tokens and tags go with them
+  if(s.mapping != NULL) unmapDataset((mappedDataset*)s.mapping); //they were out of core
 }
 
 void        print_struct_help()
@@ -1112,11 +3871,41 @@ void        print_struct_help()
   printf("         --* string  -> custom parameters that can be adapted for struct\n");
   printf("                        learning. The * can be replaced by any character\n");
   printf("                        and there can be multiple options starting with --.\n");
+  printf("         --f int     -> drop features occurring in fewer than this many training\n");
+  printf("                        tokens and renumber the rest densely (default 0: keep\n");
+  printf("                        the input numbering). The mapping is stored in the model.\n");
+  printf("         --x [0..2]  -> approximate the kernel (-t -d -g -s -r) on the token\n");
+  printf("                        features by an explicit feature map and learn a linear\n");
+  printf("                        model on the mapped tokens (default 0: off):\n");
+  printf("                        1: random Fourier features (rbf kernel only)\n");
+  printf("                        2: Nystroem, with landmarks sampled from the training\n");
+  printf("                           tokens (any kernel)\n");
+  printf("         --n int     -> number of random features or landmarks for --x\n");
+  printf("                        (default 256)\n");
+  printf("         --s [0,1]   -> write the svm-light support vectors to MODEL_svmModel.dat\n");
+  printf("                        (default 1). With 0 and a linear kernel, only the weight\n");
+  printf("                        vector is written, which is all classification needs.\n");
+  printf("         --o file    -> train out of core: write the training examples to this\n");
+  printf("                        dataset file and memory-map it, so they're read from it\n");
+  printf("                        in each pass instead of being kept in memory, and psi(x,y)\n");
+  printf("                        is recomputed instead of cached. A dataset file can be\n");
+  printf("                        given as the training file to reuse it. Not with --f, --x.\n");
+  printf("         --t [1,2]   -> order of the tag transitions (default 1). With 2, each tag\n");
+  printf("                        trigram seen in the training labels gets a weight too, and\n");
+  printf("                        decoding (exact, over the lattice pruned by first-order\n");
+  printf("                        bounds) only uses those trigrams. Classification reads\n");
+  printf("                        the order from the model (--d 0 only, no --e).\n");
 }
 
 void         parse_struct_parameters(STRUCT_LEARN_PARM *sparm)
 {
 	sparm->featureSpaceSize = 0; //this is checked when reading the examples
+	sparm->writeSvmModel = 1;
+	sparm->featureMinFreq = 0;
+	sparm->tokenFeatureMap = 0;
+	sparm->tokenFeatureMapDim = 256;
+	sparm->outOfCore = 0; //set when the examples are mapped
+	sparm->transitionOrder = 1;
 
   /* Parses the command line parameters that start with -- */
   for(unsigned int i=0;(i<sparm->custom_argc) && ((sparm->custom_argv[i])[0] == '-');i++) {
@@ -1125,9 +3914,20 @@ void         parse_struct_parameters(STRUCT_LEARN_PARM *sparm)
 	      case 'a': i++; /* strcpy(learn_parm->alphafile,argv[i]); */ break;
 	      case 'e': i++; /* sparm->epsilon=atof(sparm->custom_argv[i]); */ break;
 	      case 'k': i++; /* sparm->newconstretrain=atol(sparm->custom_argv[i]); */ break;
+	      case 'f': i++; sparm->featureMinFreq = atol(sparm->custom_argv[i]); break;
+	      case 's': i++; sparm->writeSvmModel = atoi(sparm->custom_argv[i]); break;
+	      case 'x': i++; sparm->tokenFeatureMap = atoi(sparm->custom_argv[i]); break;
+	      case 'n': i++; sparm->tokenFeatureMapDim = atol(sparm->custom_argv[i]); break;
+	      case 'o': i++; datasetFilename = sparm->custom_argv[i]; break;
+	      case 't': i++; sparm->transitionOrder = atoi(sparm->custom_argv[i]); break;
 	      default: printf("\nUnrecognized option %s!\n\n",sparm->custom_argv[i]); exit(0);
       }
   }
+  if(sparm->transitionOrder != 1 && sparm->transitionOrder != 2)
+  {
+	  fprintf(stderr, "parse_struct_parameters(): the transition order (--t) must be 1 or 2; exiting\n");
+	  exit(-1);
+  }
 }
 
 void        print_struct_help_classify()
@@ -1137,6 +3937,31 @@ void        print_struct_help_classify()
   printf("         --* string -> custom parameters that can be adapted for struct\n");
   printf("                       learning. The * can be replaced by any character\n");
   printf("                       and there can be multiple options starting with --.\n");
+  printf("         --d [0..2] -> decoder: 0 = Viterbi (default), 1 = coarse-to-fine\n");
+  printf("                       Viterbi over clusters of similar tags, which prunes\n");
+  printf("                       tags per position before the exact pass, 2 = A*\n");
+  printf("                       search with bounds from a backward pass (exact)\n");
+  printf("         --k int    -> number of tag clusters for --d 1 (default 0: about the\n");
+  printf("                       square root of the number of tags)\n");
+  printf("         --m float  -> pruning margin for --d 1: also drop clusters whose bound\n");
+  printf("                       is less than this above the best path found in the\n");
+  printf("                       coarse pass (default 0: lossless)\n");
+  printf("         --e list   -> ensemble: also tag with these models (comma-separated), which\n");
+  printf("                       need the tags and features of model_file; each sentence\n");
+  printf("                       is read and its features gathered once for all models\n");
+  printf("                       (decodes with Viterbi; --d is ignored)\n");
+  printf("         --o list   -> prediction files for the --e models (default\n");
+  printf("                       MODEL_BASE.outtags for each)\n");
+  printf("         --v [0..2] -> ensemble voting: 0 = none (default), 1 = per-token majority\n");
+  printf("                       (ties go to the earlier model), 2 = score (Viterbi with\n");
+  printf("                       the summed scores of all models)\n");
+  printf("         --w file   -> prediction file for the vote\n");
+  printf("         --b [0,1]  -> prediction file format: 0 = text labels (default), 1 =\n");
+  printf("                       binary: a header with the tag names, then each label as\n");
+  printf("                       its length and its tag ids (see write_label())\n");
+  printf("         --c [0,1]  -> check the decoding semirings against Viterbi on each\n");
+  printf("                       sentence: posteriors sum to 1 at each position, the\n");
+  printf("                       1-best path is Viterbi's (--d 0 only; exits on failure)\n");
 }
 
 void         parse_struct_parameters_classify(char *attribute, char *value)
@@ -1148,6 +3973,33 @@ void         parse_struct_parameters_classify(char *attribute, char *value)
   switch (attribute[2]) 
     { 
       /* case 'x': strcpy(xvalue,value); break; */
+      case 'd': decoder = atoi(value);
+	       if(decoder != DECODER_VITERBI && decoder != DECODER_COARSE_TO_FINE && decoder != DECODER_ASTAR)
+	       {
+	         fprintf(stderr, "parse_struct_parameters_classify(): unknown decoder %d; exiting\n", decoder);
+	         exit(-1);
+	       }
+	       break;
+      case 'k': numTagClusters = atoi(value); break;
+      case 'm': pruneMargin = atof(value); break;
+      case 'e': ensembleModelFiles = splitList(value); break;
+      case 'o': ensembleOutputFiles = splitList(value); break;
+      case 'v': ensembleVoting = atoi(value);
+	       if(ensembleVoting != VOTE_NONE && ensembleVoting != VOTE_MAJORITY && ensembleVoting != VOTE_SCORE)
+	       {
+	         fprintf(stderr, "parse_struct_parameters_classify(): unknown ensemble voting %d; exiting\n", ensembleVoting);
+	         exit(-1);
+	       }
+	       break;
+      case 'w': ensembleVoteFile = value; break;
+      case 'c': checkLattice = atoi(value); break;
+      case 'b': outputFormat = atoi(value);
+	       if(outputFormat != OUTPUT_TEXT && outputFormat != OUTPUT_BINARY)
+	       {
+	         fprintf(stderr, "parse_struct_parameters_classify(): unknown output format %d; exiting\n", outputFormat);
+	         exit(-1);
+	       }
+	       break;
       default: printf("\nUnrecognized option %s!\n\n",attribute);
 	       exit(0);
     }
@@ -32,6 +32,8 @@ void        svm_struct_learn_api_exit();
 void        svm_struct_classify_api_init(int argc, char* argv[]);
 void        svm_struct_classify_api_exit();
 SAMPLE      read_struct_examples(const char *filename, STRUCT_LEARN_PARM *sparm);
+SAMPLE      read_struct_examples(istream& in, const char *filename,
+				 STRUCT_LEARN_PARM *sparm); /* svm-hmm: read up to an empty line */
 void        init_struct_model(SAMPLE sample, STRUCTMODEL *sm,
 			      STRUCT_LEARN_PARM *sparm, LEARN_PARM* lparm, KERNEL_PARM* kparm);
 CONSTSET    init_struct_constraints(SAMPLE sample, STRUCTMODEL *sm,
@@ -44,6 +46,7 @@ LABEL       find_most_violated_constraint_marginrescaling(PATTERN x, LABEL y,
 						     STRUCT_LEARN_PARM *sparm);
 LABEL       classify_struct_example(PATTERN x, STRUCTMODEL *sm,
 				    STRUCT_LEARN_PARM *sparm);
+void        invalidate_decoder_caches(); /* svm-hmm: call when sm->w changes */
 int         empty_label(LABEL y);
 SVECTOR     *psi(PATTERN x, LABEL y, STRUCTMODEL *sm,
 	        STRUCT_LEARN_PARM *sparm);
@@ -64,6 +67,13 @@ void        eval_prediction(long exnum, EXAMPLE ex, LABEL prediction,
 void        write_struct_model(char *file,STRUCTMODEL *sm,
 			       STRUCT_LEARN_PARM *sparm);
 STRUCTMODEL read_struct_model(char *file, STRUCT_LEARN_PARM *sparm);
+void        struct_model_errors_throw(int t); /* svm-hmm: have read_struct_model()
+						 throw instead of exit */
+void        map_token_features(const vector<pair<featureID, double> >& input,
+			       SVECTOR& features, STRUCT_LEARN_PARM *sparm);
+				 /* svm-hmm: a token's input features as
+				    read_struct_examples() stores them on
+				    classification */
 void        write_label(FILE *fp, LABEL y);
 void        free_pattern(PATTERN x);
 void        free_label(LABEL y);
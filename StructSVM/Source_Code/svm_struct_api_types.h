@@ -22,6 +22,8 @@
 
 #include <vector>
 using std::vector;
+#include <utility>
+using std::pair;
 #include <string>
 using std::string;
 #include <iostream>
@@ -51,22 +53,22 @@ extern "C"
 # define DEFAULT_ALG_TYPE    4
 /* store Psi(x,y) once instead of recomputing it every time: */
 # define USE_FYCACHE         1
-/* max number of input examples: a hack */
-#define MAX_NUM_EXAMPLES 10000000
 
 typedef string tag; //tag, label, state
 typedef unsigned int tagID; //smaller to store than the full string
+typedef long featureID; //index into psi and w; always computed in (64-bit) long, then checked against FNUM_MAX
 
 /*
 if t is in the map,
 return a newly assigned unique tag ID
 */
 extern tagID registerTag(const tag& t);
+extern unsigned int numRegisteredTags; //see getNumTags()
 /*
 return the number of tags that have been registered
-(registering is done while reading input)
+(registering is done while reading input); tag ids are 0 .. getNumTags() - 1
 */
-extern unsigned int getNumTags();
+inline unsigned int getNumTags() {return numRegisteredTags;}
 extern const tag& getTagByID(tagID id) throw(invalid_argument);
 
 /*
@@ -98,12 +100,17 @@ class token
 
 		token();
 		explicit token(const string& s);
+		/*
+		a token whose feature list (ending with wnum 0) belongs to someone else, eg a mapped dataset
+		*/
+		explicit token(WORD* words);
 		token(const token& t);
 		~token();
 
 		const string& getString() const {return str;}
 		//the only way to manipulate the feature list
 		SVECTOR& getFeatureMap() {return *features;}
+		const SVECTOR& getFeatureMap() const {return *features;}
 
 		void setString(const string& s) {str = s;}
 
@@ -132,24 +139,34 @@ typedef class pattern {
      for storing a natural language sentence in NLP parsing */
 	public:
 
-		pattern() : emissions(new vector<token>()) {}
-		pattern(const pattern& p) : emissions(p.emissions) {}
+		pattern() : emissions(new vector<token>()), record(NULL) {}
+		pattern(const pattern& p) : emissions(p.emissions), record(p.record) {}
 		~pattern() {}
 
-  		unsigned int getLength() const {return emissions->size();}
-  		const token& getToken(unsigned int index) const {return (*emissions)[index];}
-  		token& getToken(unsigned int index) {return (*emissions)[index];}
-  		token& getLastToken() {return emissions->back();}
+  		unsigned int getLength() const {return (record != NULL) ? *(const unsigned int*)record : emissions->size();}
+  		const token& getToken(unsigned int index) const {return getEmissions()[index];}
+  		token& getToken(unsigned int index) {return getEmissions()[index];}
+  		token& getLastToken() {return getEmissions().back();}
 
-  		void appendToken(const token& t) {emissions->push_back(t);}
+  		void appendToken(const token& t) {getEmissions().push_back(t);}
 
-  		void setEmissionsVector(shared_ptr<vector<token> > e) {emissions = e;}
+  		void setEmissionsVector(shared_ptr<vector<token> > e) {emissions = e; record = NULL;}
+  		/*
+  		out-of-core training: take the tokens from a sentence record of a mapped dataset (see read_struct_examples())
+  		when they're first used; a copy of a pattern that hasn't been read reads them for itself, so the tokens
+  		are only kept as long as the copy that uses them (eg the argument of psi())
+  		*/
+  		void setRecord(const char* r) {emissions.reset(); record = r;}
 
-  		const pattern& operator = (const pattern& p) {emissions = p.emissions; return *this;}
+  		const pattern& operator = (const pattern& p) {emissions = p.emissions; record = p.record; return *this;}
 
   	private:
 
-  		shared_ptr<vector<token> > emissions;
+  		vector<token>& getEmissions() const {if(record != NULL) readRecord(); return *emissions;}
+  		void readRecord() const;
+
+  		mutable shared_ptr<vector<token> > emissions;
+  		mutable const char* record; //NULL once the tokens are read
 } PATTERN;
 
 typedef class label {
@@ -158,29 +175,37 @@ typedef class label {
 
 	public:
 
-		label() : tags(new vector<tagID>()) {}
-		label(const label& l) : tags(l.tags) {}
+		label() : tags(new vector<tagID>()), record(NULL) {}
+		label(const label& l) : tags(l.tags), record(l.record) {}
 		~label() {}
 
-		bool isEmpty() const {return tags->empty();} //see empty_label() in pos_tagging_api.cpp
+		bool isEmpty() const {return getLength() == 0;} //see empty_label() in pos_tagging_api.cpp
 		bool operator == (const label& l) const;
 
-		unsigned int getLength() const {return tags->size();}
-		tagID getTag(unsigned int index) const {return (*tags)[index];}
-		tagID& getTag(unsigned int index) {return (*tags)[index];}
-		tagID& getLastTag() {return tags->back();}
+		unsigned int getLength() const {return (record != NULL) ? *(const unsigned int*)record : tags->size();}
+		tagID getTag(unsigned int index) const {return getTags()[index];}
+		tagID& getTag(unsigned int index) {return getTags()[index];}
+		tagID& getLastTag() {return getTags().back();}
 
-		void appendTag(tagID id) {tags->push_back(id);}
+		void appendTag(tagID id) {getTags().push_back(id);}
 		//be careful calling these!
-		void setLength(unsigned int len) {tags->resize(len);}
-		void setTag(unsigned int index, const tagID id) {(*tags)[index] = id;}
-		void setTagsVector(shared_ptr<vector<tagID> > t) {tags = t;}
+		void setLength(unsigned int len) {getTags().resize(len);}
+		void setTag(unsigned int index, const tagID id) {getTags()[index] = id;}
+		void setTagsVector(shared_ptr<vector<tagID> > t) {tags = t; record = NULL;}
+		/*
+		out-of-core training: take the tags from a sentence record of a mapped dataset when they're first used (see pattern)
+		*/
+		void setRecord(const char* r) {tags.reset(); record = r;}
 
-		const label& operator = (const label& l) {tags = l.tags; return *this;}
+		const label& operator = (const label& l) {tags = l.tags; record = l.record; return *this;}
 
 	private:
 
-		shared_ptr<vector<tagID> > tags;
+		vector<tagID>& getTags() const {if(record != NULL) readRecord(); return *tags;}
+		void readRecord() const;
+
+		mutable shared_ptr<vector<tagID> > tags;
+		mutable const char* record; //NULL once the tags are read
 } LABEL;
 
 typedef struct structmodel {
@@ -213,10 +238,102 @@ typedef struct struct_learn_parm {
   int    loss_function;        /* select between different loss
 				  functions via -l command line
 				  option */
+  int    tron_solver;          /* solve the working set problem of
+				  -w 1 -p 2 with the trust-region Newton
+				  method instead of svm-light (-z
+				  command line option) */
+  int    adaptive_precision;   /* set the working precision of -w 1
+				  from the violations of the last full
+				  pass instead of halving it from 100
+				  (-j command line option) */
+  long   max_constraints;      /* cap on the working set of the joint
+				  algorithms; constraints with the
+				  smallest alphas are aggregated beyond
+				  it (-b command line option; 0 = no
+				  cap) */
   /* further parameters that are passed to init_struct_model() */
-  unsigned int featureSpaceSize; //number of features for a word
+  featureID featureSpaceSize;  //number of features for a word
+  int    writeSvmModel;        /* write the svm-light support vectors next
+				  to the model (--s option); a linear model
+				  can be classified from w alone */
+  unsigned long featureMinFreq; /* drop features found in fewer training
+				  tokens and compact the feature numbers
+				  (--f option); 0 = keep input numbering */
+  int    tokenFeatureMap;      /* approximate the kernel on the token
+				  features by an explicit map (--x option):
+				  0 = none, 1 = random Fourier features,
+				  2 = Nystroem; for classification, read
+				  from the model */
+  unsigned long tokenFeatureMapDim; /* number of random features or
+				  landmarks (--n option) */
+  int    outOfCore;            /* the examples are read from a mapped
+				  dataset file as they're used (--o
+				  option), so psi(x,y) isn't cached */
+  int    transitionOrder;      /* 1 = tag bigram transitions, 2 = also
+				  tag trigrams (--t option; for
+				  classification, read from the model) */
 } STRUCT_LEARN_PARM;
 
+/*
+incremental decoding of one sequence that is edited in place (eg a document in an annotation tool)
+
+the Viterbi forward and backward score vectors of every position are cached, normalized to a max of 0; after replacing a range
+of tokens, the forward scores are recomputed from the edit on and the backward scores from the edit back, each until they
+match the cached ones again (the best paths have merged), and the tags are updated only between those points, so the work
+is proportional to the size of the edit and how far its effect reaches, not to the length of the sequence
+
+each tag is the argmax of forward + backward score at its position, which gives the Viterbi labeling (up to ties)
+*/
+class incrementalTagger
+{
+	public:
+
+		incrementalTagger(STRUCTMODEL* sm, STRUCT_LEARN_PARM* sparm);
+
+		/*
+		tag x from scratch
+		*/
+		LABEL tag(const PATTERN& x);
+		/*
+		replace numRemoved tokens starting at index start by the tokens in inserted, and return the labeling of the new sequence
+		*/
+		LABEL retag(unsigned int start, unsigned int numRemoved, const vector<token>& inserted);
+
+		unsigned int getLength() const {return positions.size();}
+		/*
+		number of forward and backward score vectors the last call computed (2 per position when tagging from scratch)
+		*/
+		unsigned int getNumRecomputed() const {return numRecomputed;}
+
+	private:
+
+		struct positionCache
+		{
+			token x;
+			vector<double> emissions, forward, backward; //indexed by tag
+		};
+
+		/*
+		recompute the forward scores of position j; return whether they changed
+		*/
+		bool updateForward(unsigned int j);
+		/*
+		recompute the backward scores of position j; return whether they changed
+		*/
+		bool updateBackward(unsigned int j);
+		/*
+		set the tags of positions [begin, end)
+		*/
+		void updateTags(unsigned int begin, unsigned int end);
+		LABEL getLabel() const;
+
+		STRUCTMODEL* sm;
+		STRUCT_LEARN_PARM* sparm;
+		vector<shared_ptr<positionCache> > positions; //pointers, so an insertion or deletion only moves pointers
+		vector<tagID> tags;
+		unsigned int numRecomputed;
+};
+
 typedef struct struct_test_stats {
   /* you can add variables for keeping statistics when evaluating the
      test predictions in svm_struct_classify. This can be used in the